@@ -0,0 +1,90 @@
+/**
+ * activesource.cpp
+ */
+#include "activesource.h"
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+static Logger logger = Logger::getInstance("activesource");
+
+// Frames missed while the adapter was closed longer than this may have moved the active source
+static const boost::chrono::seconds maxClosed(5);
+
+static const uint16_t unknownAddress = 0xFFFF;
+
+static const char *stateNames[] = { "unknown", "active", "inactive" };
+
+ActiveSource::ActiveSource() : current(STATE_UNKNOWN), physical(unknownAddress), path(unknownAddress),
+	closedAt(clock::time_point::min()) {}
+
+void ActiveSource::set(State state, const char *why) {
+	int previous = current.exchange(state);
+	if (previous != state)
+		LOG4CPLUS_INFO(logger, "Active source " << stateNames[previous] << " -> " << stateNames[state] << " (" << why << ")");
+}
+
+void ActiveSource::routed(uint16_t address) {
+	path = address;
+
+	if (physical == unknownAddress)
+		set(STATE_UNKNOWN, "routed, but we don't know our address");
+	else
+		set(address == physical ? STATE_ACTIVE : STATE_INACTIVE, "routed");
+}
+
+void ActiveSource::observed(const cec_command & command) {
+	if (!command.opcode_set)
+		return;
+
+	const cec_datapacket & p = command.parameters;
+
+	switch (command.opcode) {
+		case CEC_OPCODE_ACTIVE_SOURCE:
+			// Somebody else claimed it, we never receive our own
+			if (p.size >= 2)
+				path = (uint16_t) (p.data[0] << 8 | p.data[1]);
+			set(STATE_INACTIVE, "ACTIVE_SOURCE");
+			break;
+
+		case CEC_OPCODE_SET_STREAM_PATH:
+		case CEC_OPCODE_ROUTING_INFORMATION:
+			if (p.size >= 2)
+				routed((uint16_t) (p.data[0] << 8 | p.data[1]));
+			break;
+
+		case CEC_OPCODE_ROUTING_CHANGE:
+			// original address, then the new one
+			if (p.size >= 4)
+				routed((uint16_t) (p.data[2] << 8 | p.data[3]));
+			break;
+
+		case CEC_OPCODE_INACTIVE_SOURCE:
+			if (p.size >= 2 && (uint16_t) (p.data[0] << 8 | p.data[1]) == path)
+				path = unknownAddress;
+			break;
+
+		default:
+			break;
+	}
+}
+
+void ActiveSource::activated(bool active) {
+	if (active && physical != unknownAddress)
+		path = physical.load();
+	set(active ? STATE_ACTIVE : STATE_INACTIVE, "activated");
+}
+
+void ActiveSource::opened(clock::time_point now) {
+	if (closedAt != clock::time_point::min() && now - closedAt > maxClosed)
+		set(STATE_UNKNOWN, "closed for too long");
+}
+
+void ActiveSource::closed(bool inactive, clock::time_point now) {
+	closedAt = now;
+	if (inactive)
+		set(STATE_INACTIVE, "closed");
+}
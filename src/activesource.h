@@ -0,0 +1,76 @@
+#include <libcec/cectypes.h>
+
+#include <atomic>
+#include <cstdint>
+
+#include <boost/chrono.hpp>
+
+/**
+ * Tracks whether we are the active source, from the ACTIVE_SOURCE,
+ * SET_STREAM_PATH and ROUTING_CHANGE traffic on the bus and from libcec
+ * telling us we were (de)activated. Lets the daemon skip announcing itself
+ * when it already holds the active source, e.g. after a restart, and answer
+ * REQUEST_ACTIVE_SOURCE without asking anyone.
+ *
+ * Updated from the libcec callbacks, read from the main loop.
+ */
+class ActiveSource {
+
+	public:
+
+		enum State
+		{
+			STATE_UNKNOWN,  // nothing seen since the adapter was opened
+			STATE_ACTIVE,   // we are the active source
+			STATE_INACTIVE, // some other device is, or nobody is
+		};
+
+		typedef boost::chrono::steady_clock clock;
+
+		ActiveSource();
+
+		/**
+		 * Our own physical address, 0xFFFF while unknown
+		 */
+		void setPhysicalAddress(uint16_t address) {physical = address;};
+		uint16_t getPhysicalAddress() const { return physical; };
+
+		/**
+		 * Follows a frame received from the bus
+		 */
+		void observed(const CEC::cec_command & command);
+
+		/**
+		 * We were made (in)active, by our own announcement or by libcec
+		 */
+		void activated(bool active);
+
+		/**
+		 * The adapter was opened again, the state only survives a short restart
+		 */
+		void opened(clock::time_point now);
+
+		/**
+		 * The adapter was closed, inactive if we gave up the active source doing so
+		 */
+		void closed(bool inactive, clock::time_point now);
+
+		State state() const { return (State) current.load(); };
+		bool active() const { return state() == STATE_ACTIVE; };
+
+		/**
+		 * Physical address of the active source, 0xFFFF while unknown
+		 */
+		uint16_t activePath() const { return path; };
+
+	private:
+
+		std::atomic<int> current;
+		std::atomic<uint16_t> physical;
+		std::atomic<uint16_t> path;
+
+		clock::time_point closedAt; // only used by the main loop
+
+		void routed(uint16_t address);
+		void set(State state, const char *why);
+};
@@ -0,0 +1,32 @@
+/**
+ * coalescer.cpp
+ */
+#include "coalescer.h"
+
+bool Coalescer::offer(int state, clock::time_point now) {
+	if (now >= windowEnd) {
+		applied   = state;
+		windowEnd = now + window;
+		pending   = false;
+		return true;
+	}
+
+	// Still flapping, hold it back and extend the window
+	pending      = true;
+	pendingState = state;
+	windowEnd    = now + window;
+	return false;
+}
+
+bool Coalescer::expire(clock::time_point now, int & state) {
+	if (!pending || now < windowEnd)
+		return false;
+
+	pending = false;
+	if (pendingState == applied)
+		return false;
+
+	applied = state = pendingState;
+	windowEnd = now + window;
+	return true;
+}
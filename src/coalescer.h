@@ -0,0 +1,46 @@
+#include <boost/chrono.hpp>
+
+/**
+ * Collapses bursts of state changes into their final state.
+ *
+ * The first change after a quiet period is applied straight away. Changes
+ * arriving within the window after it are held back, and only the last one is
+ * applied once the window passes without further changes, and only if it
+ * differs from what was applied last.
+ */
+class Coalescer {
+
+	public:
+
+		typedef boost::chrono::steady_clock clock;
+
+		Coalescer() : window(clock::duration::zero()), windowEnd(clock::time_point::min()),
+			applied(-1), pending(false), pendingState(-1) {};
+
+		void setWindow(clock::duration window) {this->window = window;};
+
+		/**
+		 * A new state arrived, returns true if it should be applied now
+		 */
+		bool offer(int state, clock::time_point now);
+
+		/**
+		 * Call once deadline() has passed, returns true with the final state
+		 * of a burst if that still has to be applied
+		 */
+		bool expire(clock::time_point now, int & state);
+
+		/**
+		 * When expire() has something to do, time_point::max() when nothing is held back
+		 */
+		clock::time_point deadline() const { return pending ? windowEnd : clock::time_point::max(); };
+
+	private:
+
+		clock::duration window;
+		clock::time_point windowEnd;
+
+		int applied;
+		bool pending;
+		int pendingState;
+};
@@ -0,0 +1,423 @@
+/**
+ * events.cpp
+ *
+ * Reacts to the daemon's own events. Each line of an events file has the form
+ *
+ *   EVENT [if=COND[,COND..]] = ACTION[; ACTION..]
+ *
+ * where EVENT is standby, activate, deactivate, opened or timer NAME, COND is
+ * one of
+ *
+ *   active, inactive          whether we want to be the active source
+ *   active>DUR, inactive>DUR  and have been for longer than DUR
+ *   idle>DUR, idle<DUR        time since the last remote key
+ *
+ * and ACTION is one of
+ *
+ *   key CEC_KEY
+ *   input KEY_NAME
+ *   transmit [ADDR] OPCODE[:XX..]
+ *   timer NAME DUR
+ *   cancel NAME
+ *   hook standby|activate|deactivate
+ *   run COMMAND..
+ *
+ * Durations are a number followed by ms, s, m or h. run takes the rest of the
+ * line, so it comes last.
+ */
+#include "events.h"
+#include "rules.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::string;
+using std::vector;
+
+static Logger logger = Logger::getInstance("events");
+
+static const char *eventNames[EventRules::EVENT_MAX] = { "standby", "activate", "deactivate", "opened", "timer" };
+
+static bool parseDuration(const string & s, boost::chrono::milliseconds & duration) {
+	char *end;
+
+	if (s.empty() || s[0] < '0' || s[0] > '9')
+		return false;
+
+	long value = strtol(s.c_str(), &end, 10);
+	string unit(end);
+	if (unit == "ms") {
+		duration = boost::chrono::milliseconds(value);
+	} else if (unit == "s") {
+		duration = boost::chrono::seconds(value);
+	} else if (unit == "m") {
+		duration = boost::chrono::minutes(value);
+	} else if (unit == "h") {
+		duration = boost::chrono::hours(value);
+	} else {
+		return false;
+	}
+	return true;
+}
+
+static bool parseHex(const string & s, uint8_t & value) {
+	char *end;
+
+	if (s.empty() || s.size() > 2)
+		return false;
+
+	long v = strtol(s.c_str(), &end, 16);
+	if (*end != '\0')
+		return false;
+
+	value = (uint8_t) v;
+	return true;
+}
+
+bool EventRule::matches(const EventState & state) const {
+	if (source == SOURCE_ACTIVE && !state.active)
+		return false;
+	if (source == SOURCE_INACTIVE && state.active)
+		return false;
+	if (state.sinceSource < sourceFor)
+		return false;
+
+	return state.idle >= idleOver && state.idle < idleUnder;
+}
+
+EventRules::EventRules(std::function<bool (const string &, uint16_t &)> inputKey) : inputKey(inputKey) {}
+
+int EventRules::timer(const string & name) {
+	for (size_t i = 0; i < timerNames.size(); i++) {
+		if (timerNames[i] == name)
+			return i;
+	}
+
+	timerNames.push_back(name);
+	deadlines.push_back(clock::time_point::max());
+	timerTable.resize(timerNames.size());
+	return timerNames.size() - 1;
+}
+
+bool EventRules::parseAction(const string & s, EventAction & action, string & error) {
+	std::istringstream ss(s);
+	string type, arg;
+
+	ss >> type;
+
+	if (type == "key") {
+		action.type = EventAction::ACTION_KEY;
+
+		ss >> arg;
+		if (!CommandRules::parseKey(arg, action.key)) {
+			error = "unknown CEC key '" + arg + "'";
+			return false;
+		}
+
+	} else if (type == "input") {
+		action.type = EventAction::ACTION_INPUT;
+
+		ss >> arg;
+		if (!inputKey(arg, action.input)) {
+			error = "unknown key '" + arg + "'";
+			return false;
+		}
+
+	} else if (type == "transmit") {
+		action.type = EventAction::ACTION_TRANSMIT;
+
+		string first;
+		ss >> first >> arg;
+		if (arg.empty()) {
+			// No destination given, it goes to the TV
+			arg = first;
+		} else if (!CommandRules::parseAddress(first, action.to)) {
+			error = "unknown address '" + first + "'";
+			return false;
+		}
+
+		std::istringstream bytes(arg);
+		string item;
+		std::getline(bytes, item, ':');
+		uint8_t value;
+		if (CommandRules::parseOpcode(item, action.opcode)) {
+			// named
+		} else if (parseHex(item, value)) {
+			action.opcode = (cec_opcode) value;
+		} else {
+			error = "unknown opcode '" + item + "'";
+			return false;
+		}
+
+		while (std::getline(bytes, item, ':')) {
+			if (!parseHex(item, value) || action.parameters.size() == RULE_MAX_PARAMETERS) {
+				error = "bad parameters '" + arg + "'";
+				return false;
+			}
+			action.parameters.push_back(value);
+		}
+
+	} else if (type == "timer" || type == "cancel") {
+		action.type = (type == "timer") ? EventAction::ACTION_TIMER : EventAction::ACTION_CANCEL;
+
+		string name;
+		ss >> name;
+		if (name.empty()) {
+			error = "missing timer name";
+			return false;
+		}
+		if (action.type == EventAction::ACTION_TIMER) {
+			// a timer that runs out straight away could fire in a loop
+			ss >> arg;
+			if (!parseDuration(arg, action.delay) || action.delay <= boost::chrono::milliseconds::zero()) {
+				error = "bad delay '" + arg + "'";
+				return false;
+			}
+		}
+		action.timer = timer(name);
+
+	} else if (type == "hook") {
+		action.type = EventAction::ACTION_HOOK;
+
+		ss >> arg;
+		if (arg == "standby") {
+			action.hook = EventAction::HOOK_STANDBY;
+		} else if (arg == "activate") {
+			action.hook = EventAction::HOOK_ACTIVATE;
+		} else if (arg == "deactivate") {
+			action.hook = EventAction::HOOK_DEACTIVATE;
+		} else {
+			error = "unknown hook '" + arg + "'";
+			return false;
+		}
+
+	} else {
+		error = "unknown action '" + type + "'";
+		return false;
+	}
+
+	if (ss >> arg) {
+		error = "trailing '" + arg + "'";
+		return false;
+	}
+	return true;
+}
+
+bool EventRules::parse(const string & line, Event & event, int & timer, EventRule & rule, string & error) {
+	// The match and action sides are split on the '=' surrounded by spaces
+	size_t equalPos = line.find(" = ");
+	if (equalPos == string::npos) {
+		error = "missing ' = ' between event and action";
+		return false;
+	}
+
+	std::istringstream match(line.substr(0, equalPos));
+
+	string token;
+	match >> token;
+
+	event = EVENT_MAX;
+	for (int e = 0; e < EVENT_MAX; e++) {
+		if (token == eventNames[e])
+			event = (Event) e;
+	}
+	if (event == EVENT_MAX) {
+		error = "unknown event '" + token + "'";
+		return false;
+	}
+
+	timer = -1;
+	if (event == EVENT_TIMER) {
+		match >> token;
+		if (!match || token.compare(0, 3, "if=") == 0) {
+			error = "missing timer name";
+			return false;
+		}
+		timer = this->timer(token);
+	}
+
+	while (match >> token) {
+		if (token.compare(0, 3, "if=") != 0) {
+			error = "unknown condition '" + token + "'";
+			return false;
+		}
+
+		std::istringstream conditions(token.substr(3));
+		string condition;
+		while (std::getline(conditions, condition, ',')) {
+			size_t pos = condition.find_first_of("<>");
+			string name = condition.substr(0, pos);
+			boost::chrono::milliseconds duration(0);
+			if (pos != string::npos && !parseDuration(condition.substr(pos + 1), duration)) {
+				error = "bad duration in '" + condition + "'";
+				return false;
+			}
+
+			if ((name == "active" || name == "inactive") && (pos == string::npos || condition[pos] == '>')) {
+				rule.source    = (name == "active") ? EventRule::SOURCE_ACTIVE : EventRule::SOURCE_INACTIVE;
+				rule.sourceFor = duration;
+			} else if (name == "idle" && pos != string::npos && condition[pos] == '>') {
+				rule.idleOver = duration;
+			} else if (name == "idle" && pos != string::npos) {
+				rule.idleUnder = duration;
+			} else {
+				error = "unknown condition '" + condition + "'";
+				return false;
+			}
+		}
+	}
+
+	// Actions are separated by ';', except that run takes the rest of the line
+	string actions = line.substr(equalPos + 3);
+	size_t start = 0;
+	while (start < actions.size()) {
+		start = actions.find_first_not_of(" \t", start);
+		if (start == string::npos)
+			break;
+
+		EventAction action;
+		if (actions.compare(start, 4, "run ") == 0) {
+			action.type    = EventAction::ACTION_RUN;
+			action.command = actions.substr(actions.find_first_not_of(" \t", start + 4));
+			rule.actions.push_back(action);
+			break;
+		}
+
+		size_t end = actions.find(';', start);
+		if (!parseAction(actions.substr(start, end == string::npos ? string::npos : end - start), action, error))
+			return false;
+		rule.actions.push_back(action);
+
+		if (end == string::npos)
+			break;
+		start = end + 1;
+	}
+
+	if (rule.actions.empty()) {
+		error = "missing action";
+		return false;
+	}
+	return true;
+}
+
+bool EventRules::add(const string & line, int lineNumber) {
+	EventRule rule;
+	Event event;
+	int timer;
+	string error;
+
+	if (!parse(line, event, timer, rule, error)) {
+		LOG4CPLUS_WARN(logger, "Invalid event rule on line " << lineNumber << ": " << error);
+		return false;
+	}
+	rule.line = lineNumber;
+
+	if (event == EVENT_TIMER)
+		timerTable[timer].push_back(rule);
+	else
+		table[event].push_back(rule);
+	return true;
+}
+
+bool EventRules::loadFromFile(const string & filename) {
+	LOG4CPLUS_INFO(logger, "Loading event rules from: " << filename);
+
+	std::ifstream file(filename.c_str());
+	if (!file.is_open()) {
+		LOG4CPLUS_ERROR(logger, "Failed to open event rules file: " << filename);
+		return false;
+	}
+
+	string line;
+	int lineNumber = 0;
+	int rulesLoaded = 0;
+	int failed = 0;
+
+	while (std::getline(file, line)) {
+		lineNumber++;
+
+		// Trim whitespace, skip empty lines and comments
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		if (add(line, lineNumber))
+			rulesLoaded++;
+		else
+			failed++;
+	}
+
+	for (size_t t = 0; t < timerNames.size(); t++) {
+		if (timerTable[t].empty())
+			LOG4CPLUS_WARN(logger, "No rule for timer " << timerNames[t] << " in " << filename);
+	}
+
+	LOG4CPLUS_INFO(logger, "Loaded " << rulesLoaded << " event rules from " << filename);
+	if (failed)
+		LOG4CPLUS_ERROR(logger, failed << " invalid event rules in " << filename);
+
+	// A file with mistakes in it is not half used on reload
+	return rulesLoaded > 0 && failed == 0;
+}
+
+const EventRule * EventRules::match(Event event, const EventState & state, int timer) const {
+	const vector<EventRule> & rules = (event == EVENT_TIMER) ? timerTable[timer] : table[event];
+
+	for (vector<EventRule>::const_iterator rule = rules.begin(); rule != rules.end(); ++rule) {
+		if (rule->matches(state))
+			return &*rule;
+	}
+	return NULL;
+}
+
+size_t EventRules::size() const {
+	size_t count = 0;
+	for (int event = 0; event < EVENT_MAX; event++)
+		count += table[event].size();
+	for (size_t t = 0; t < timerTable.size(); t++)
+		count += timerTable[t].size();
+	return count;
+}
+
+void EventRules::adopt(const EventRules & previous) {
+	for (size_t p = 0; p < previous.timerNames.size(); p++) {
+		if (previous.deadlines[p] == clock::time_point::max())
+			continue;
+
+		for (size_t t = 0; t < timerNames.size(); t++) {
+			if (timerNames[t] == previous.timerNames[p])
+				deadlines[t] = previous.deadlines[p];
+		}
+	}
+}
+
+EventRules::clock::time_point EventRules::deadline() const {
+	clock::time_point next = clock::time_point::max();
+	for (size_t t = 0; t < deadlines.size(); t++)
+		next = std::min(next, deadlines[t]);
+	return next;
+}
+
+int EventRules::expired(clock::time_point now) {
+	for (size_t t = 0; t < deadlines.size(); t++) {
+		if (deadlines[t] <= now) {
+			deadlines[t] = clock::time_point::max();
+			return t;
+		}
+	}
+	return -1;
+}
+
+const char * EventRules::eventName(Event event) {
+	return eventNames[event];
+}
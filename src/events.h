@@ -0,0 +1,169 @@
+#include <libcec/cectypes.h>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/chrono.hpp>
+
+/**
+ * Something to do when an event rule fires
+ */
+class EventAction {
+	public:
+		enum Type
+		{
+			ACTION_KEY,      // simulate a CEC key press, through the keymap
+			ACTION_INPUT,    // tap a uinput key, e.g. KEY_WAKEUP
+			ACTION_TRANSMIT, // send a CEC frame
+			ACTION_TIMER,    // (re)start a timer
+			ACTION_CANCEL,   // stop a timer
+			ACTION_HOOK,     // run the --onstandby/--onactivate/--ondeactivate command
+			ACTION_RUN,      // run a shell command, the last resort
+		};
+
+		enum Hook
+		{
+			HOOK_STANDBY,
+			HOOK_ACTIVATE,
+			HOOK_DEACTIVATE,
+		};
+
+		EventAction() : type(ACTION_KEY), key(CEC::CEC_USER_CONTROL_CODE_UNKNOWN), input(0), hook(HOOK_STANDBY),
+			timer(-1), to(CEC::CECDEVICE_TV), opcode(CEC::CEC_OPCODE_NONE) {};
+
+		Type type;
+		CEC::cec_user_control_code key;  // ACTION_KEY
+		uint16_t input;                  // ACTION_INPUT
+		Hook hook;                       // ACTION_HOOK
+		int timer;                       // ACTION_TIMER, ACTION_CANCEL
+		boost::chrono::milliseconds delay; // ACTION_TIMER
+		CEC::cec_logical_address to;     // ACTION_TRANSMIT
+		CEC::cec_opcode opcode;
+		std::vector<uint8_t> parameters;
+		std::string command;             // ACTION_RUN
+};
+
+/**
+ * What the conditions of an event rule look at
+ */
+struct EventState
+{
+	bool active;                                       // we want to be the active source
+	boost::chrono::steady_clock::duration sinceSource; // since we were (de)activated
+	boost::chrono::steady_clock::duration idle;        // since the last remote key
+};
+
+/**
+ * A rule for one event, with conditions on the daemon's state
+ */
+class EventRule {
+	public:
+		enum Source
+		{
+			SOURCE_ANY,
+			SOURCE_ACTIVE,   // we want to be the active source
+			SOURCE_INACTIVE,
+		};
+
+		typedef boost::chrono::steady_clock clock;
+
+		EventRule() : source(SOURCE_ANY), sourceFor(clock::duration::zero()), idleOver(clock::duration::zero()),
+			idleUnder(clock::duration::max()), line(0) {};
+
+		Source source;
+		clock::duration sourceFor; // the source state held at least this long
+		clock::duration idleOver;  // no remote key for longer than this
+		clock::duration idleUnder; // and for less than this
+
+		std::vector<EventAction> actions;
+
+		int line; // where the rule came from, for logging
+
+		bool matches(const EventState & state) const;
+};
+
+/**
+ * Rules reacting to the daemon's own events, so the common one line hooks
+ * ("on standby, when inactive for 10 minutes, suspend") run in the daemon
+ * instead of forking a shell.
+ *
+ * The rules are compiled when loaded: each event indexes its own list of
+ * rules, conditions are durations compared against the state passed in, key
+ * names, addresses and timer names are resolved to numbers. There is nothing
+ * in the language that can loop or touch the system, except the run action.
+ *
+ * Only used from the main loop, timers included.
+ */
+class EventRules {
+
+	public:
+
+		enum Event
+		{
+			EVENT_STANDBY,
+			EVENT_ACTIVATE,
+			EVENT_DEACTIVATE,
+			EVENT_OPENED,  // the adapter was opened, or opened again
+			EVENT_TIMER,   // a timer ran out
+			EVENT_MAX,
+		};
+
+		typedef boost::chrono::steady_clock clock;
+
+		/**
+		 * inputKey resolves the uinput key names, e.g. KEY_WAKEUP
+		 */
+		explicit EventRules(std::function<bool (const std::string &, uint16_t &)> inputKey);
+
+		/**
+		 * False when the file can't be read or any of its lines is invalid
+		 */
+		bool loadFromFile(const std::string & filename);
+
+		bool add(const std::string & line, int lineNumber = 0);
+
+		/**
+		 * Returns the first rule for event matching state, or NULL. timer
+		 * picks the timer for EVENT_TIMER.
+		 */
+		const EventRule * match(Event event, const EventState & state, int timer = -1) const;
+
+		size_t size() const;
+
+		/**
+		 * Keeps the timers of previous running, for the timers that have the same name here
+		 */
+		void adopt(const EventRules & previous);
+
+		void start(int timer, clock::time_point at) { deadlines[timer] = at; };
+		void cancel(int timer) { deadlines[timer] = clock::time_point::max(); };
+		const std::string & timerName(int timer) const { return timerNames[timer]; };
+
+		/**
+		 * When the next timer runs out, max() if none is running
+		 */
+		clock::time_point deadline() const;
+
+		/**
+		 * Stops and returns a timer that ran out by now, -1 if none did
+		 */
+		int expired(clock::time_point now);
+
+		static const char * eventName(Event event);
+
+	private:
+
+		std::function<bool (const std::string &, uint16_t &)> inputKey;
+
+		std::vector<EventRule> table[EVENT_MAX];
+		std::vector<std::vector<EventRule>> timerTable; // EVENT_TIMER rules, by timer
+
+		std::vector<std::string> timerNames;
+		std::vector<clock::time_point> deadlines;
+
+		int timer(const std::string & name);
+		bool parse(const std::string & line, Event & event, int & timer, EventRule & rule, std::string & error);
+		bool parseAction(const std::string & s, EventAction & action, std::string & error);
+};
@@ -0,0 +1,232 @@
+/**
+ * forwarder.cpp
+ *
+ * Local key presses are passed on once, and auto-repeats no more often than
+ * the transmit queue repeats a held key on the bus. A key held down locally
+ * is then held down on the remote device for about as long, rather than a
+ * 30Hz repeat burst turning into seconds of queued presses.
+ */
+#include "forwarder.h"
+#include "transmit.h"
+#include "metrics.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::string;
+using std::vector;
+
+static Logger logger = Logger::getInstance("forwarder");
+
+// How often a device that went away is looked for again
+static const boost::chrono::seconds reopenInterval(5);
+
+InputForwarder::InputForwarder() : socketFd(-1), stopping(false) {
+	for (int i = 0; i <= KEY_MAX; i++) {
+		mappings[i].key = CEC_USER_CONTROL_CODE_UNKNOWN;
+		mappings[i].destination = CECDEVICE_UNKNOWN;
+	}
+}
+
+InputForwarder::~InputForwarder() {
+	stop();
+}
+
+void InputForwarder::map(uint16_t code, cec_user_control_code key, cec_logical_address destination) {
+	if (code > KEY_MAX)
+		return;
+	mappings[code].key = key;
+	mappings[code].destination = destination;
+}
+
+void InputForwarder::start(Handler handler) {
+	if (!enabled() || reader.joinable())
+		return;
+
+	this->handler = handler;
+	stopping = false;
+
+	if (!socketPath.empty() && !openSocket())
+		throw std::runtime_error("Failed to listen on " + socketPath);
+
+	for (vector<Device>::iterator device = devices.begin(); device != devices.end(); ++device) {
+		if (!open(*device))
+			device->retryAt = boost::chrono::steady_clock::now() + reopenInterval;
+	}
+
+	reader = boost::thread(&InputForwarder::run, this);
+}
+
+void InputForwarder::stop() {
+	if (!reader.joinable())
+		return;
+
+	stopping = true;
+	reader.join();
+
+	for (vector<Device>::iterator device = devices.begin(); device != devices.end(); ++device)
+		close(*device);
+
+	if (socketFd >= 0) {
+		::close(socketFd);
+		unlink(socketPath.c_str());
+		socketFd = -1;
+	}
+}
+
+bool InputForwarder::open(Device & device) {
+	device.fd = ::open(device.path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (device.fd < 0) {
+		LOG4CPLUS_DEBUG(logger, "Failed to open " << device.path << ": " << strerror(errno));
+		return false;
+	}
+
+	// Keep the keys from the rest of the host, e.g. so volume keys don't change the PC's volume too
+	if (ioctl(device.fd, EVIOCGRAB, (void *) 1) < 0)
+		LOG4CPLUS_WARN(logger, "Failed to grab " << device.path << ": " << strerror(errno));
+
+	LOG4CPLUS_INFO(logger, "Forwarding keys from " << device.path);
+	return true;
+}
+
+void InputForwarder::close(Device & device) {
+	if (device.fd < 0)
+		return;
+
+	ioctl(device.fd, EVIOCGRAB, (void *) 0);
+	::close(device.fd);
+	device.fd = -1;
+}
+
+bool InputForwarder::openSocket() {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socketPath.size() >= sizeof(addr.sun_path)) {
+		LOG4CPLUS_ERROR(logger, "Socket path too long: " << socketPath);
+		return false;
+	}
+	strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+
+	socketFd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socketFd < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to create socket: " << strerror(errno));
+		return false;
+	}
+
+	// A socket left behind by an earlier run, anything else is for bind() to refuse
+	struct stat st;
+	if (lstat(socketPath.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(socketPath.c_str());
+	if (bind(socketFd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to bind " << socketPath << ": " << strerror(errno));
+		::close(socketFd);
+		socketFd = -1;
+		return false;
+	}
+
+	LOG4CPLUS_INFO(logger, "Forwarding keys sent to " << socketPath);
+	return true;
+}
+
+void InputForwarder::run() {
+	vector<struct pollfd> fds;
+	vector<Device *> owners;
+	fds.reserve(devices.size() + 1);
+	owners.reserve(devices.size() + 1);
+
+	struct input_event events[64];
+
+	while (!stopping) {
+		boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+
+		fds.clear();
+		owners.clear();
+		for (vector<Device>::iterator device = devices.begin(); device != devices.end(); ++device) {
+			if (device->fd < 0 && now >= device->retryAt && !open(*device))
+				device->retryAt = now + reopenInterval;
+			if (device->fd < 0)
+				continue;
+
+			struct pollfd pfd = { device->fd, POLLIN, 0 };
+			fds.push_back(pfd);
+			owners.push_back(&*device);
+		}
+		if (socketFd >= 0) {
+			struct pollfd pfd = { socketFd, POLLIN, 0 };
+			fds.push_back(pfd);
+			owners.push_back(NULL);
+		}
+
+		// Wake up now and then to notice stop() and devices coming back
+		int ret = poll(fds.data(), fds.size(), 200);
+		if (ret < 0 && errno != EINTR) {
+			LOG4CPLUS_ERROR(logger, "poll failed: " << strerror(errno));
+			break;
+		}
+		if (ret <= 0)
+			continue;
+
+		now = boost::chrono::steady_clock::now();
+		for (size_t i = 0; i < fds.size(); i++) {
+			if (fds[i].revents == 0)
+				continue;
+
+			ssize_t n = read(fds[i].fd, events, sizeof(events));
+			if (n < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+
+			for (ssize_t e = 0; e < n / (ssize_t) sizeof(struct input_event); e++)
+				event(events[e], now);
+
+			if ((n <= 0 || (fds[i].revents & (POLLERR | POLLHUP))) && owners[i]) {
+				// Unplugged, look for it again later
+				LOG4CPLUS_WARN(logger, "Lost " << owners[i]->path << ": " << (n < 0 ? strerror(errno) : "closed"));
+				close(*owners[i]);
+				owners[i]->retryAt = now + reopenInterval;
+			}
+		}
+	}
+}
+
+void InputForwarder::event(const struct input_event & ev, boost::chrono::steady_clock::time_point now) {
+	if (ev.type != EV_KEY || ev.code > KEY_MAX)
+		return;
+
+	Mapping & mapping = mappings[ev.code];
+	if (mapping.key == CEC_USER_CONTROL_CODE_UNKNOWN)
+		return;
+
+	switch (ev.value) {
+		case 1: // pressed
+			break;
+		case 2: // auto-repeat
+			if (now - mapping.forwarded < TransmitQueue::keyRepeat) {
+				Metrics::instance().inc(Metrics::TRANSMITS_COALESCED);
+				return;
+			}
+			break;
+		default: // released, the transmit queue releases it once its presses are sent
+			return;
+	}
+
+	LOG4CPLUS_DEBUG(logger, "Forwarding key " << ev.code << " as " << mapping.key << " to " << mapping.destination);
+	mapping.forwarded = now;
+	handler(mapping.destination, mapping.key);
+}
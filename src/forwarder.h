@@ -0,0 +1,83 @@
+#include <libcec/cectypes.h>
+#include <linux/input.h>
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+
+/**
+ * Reads key presses from local input devices and hands the mapped ones on as
+ * remote control keys for another device on the bus, e.g. volume keys for the
+ * AVR. The devices are grabbed, so nothing else on the host sees their keys.
+ *
+ * For testing, a unix datagram socket can stand in for a device: every
+ * datagram sent to it holds one or more struct input_event.
+ */
+class InputForwarder {
+
+	public:
+
+		typedef std::function<void (CEC::cec_logical_address destination, CEC::cec_user_control_code key)> Handler;
+
+		InputForwarder();
+		virtual ~InputForwarder();
+
+		/**
+		 * Forwards the local key code as key, to destination
+		 */
+		void map(uint16_t code, CEC::cec_user_control_code key, CEC::cec_logical_address destination);
+
+		void addDevice(const std::string & path) {devices.push_back(Device(path));};
+		void setSocket(const std::string & path) {this->socketPath = path;};
+
+		bool enabled() const { return !devices.empty() || !socketPath.empty(); };
+
+		/**
+		 * Starts reading the devices, handler is called from the reader thread
+		 */
+		void start(Handler handler);
+		void stop();
+
+	private:
+
+		struct Mapping
+		{
+			CEC::cec_user_control_code key; // CEC_USER_CONTROL_CODE_UNKNOWN if not forwarded
+			CEC::cec_logical_address destination;
+			boost::chrono::steady_clock::time_point forwarded; // last press or repeat passed on
+		};
+
+		struct Device
+		{
+			Device(const std::string & path) : path(path), fd(-1), retryAt(boost::chrono::steady_clock::time_point::min()) {};
+
+			std::string path;
+			int fd;
+			boost::chrono::steady_clock::time_point retryAt; // when to open it again if it went away
+		};
+
+		Mapping mappings[KEY_MAX + 1];
+
+		std::vector<Device> devices;
+		std::string socketPath;
+		int socketFd;
+
+		Handler handler;
+		std::atomic<bool> stopping;
+		boost::thread reader;
+
+		void run();
+		bool open(Device & device);
+		void close(Device & device);
+		bool openSocket();
+		void event(const struct input_event & ev, boost::chrono::steady_clock::time_point now);
+
+		// Not implemented, owns file descriptors
+		InputForwarder(InputForwarder const&);
+		void operator=(InputForwarder const&);
+};
@@ -1,121 +1,175 @@
 #include "hdmi.h"
 
 #include <iostream>
-#include <sstream>
-#include <string>
 
+#include <cctype>
 #include <cstdio>
+#include <cstring>
 
 namespace HDMI {
 
-std::ostream& operator<<(std::ostream &out, const HDMI::physical_address & address)
+/**
+ * One component of an address, 0 to 15
+ */
+static from_chars_result parse_component(const char *first, const char *last, int & value)
 {
-    return out << address[0] << '.' << address[1] << '.'
-               << address[2] << '.' << address[3];
-}
-
-std::istream& operator>>(std::istream &in, HDMI::physical_address & address)
-{
-    std::string s;
-
-    in >> s;
-
-    std::istringstream ss(s);
-    int val[4] = { 0,0,0,0 };
-    int len=0;
+    const char *p = first;
+    int val = 0;
 
-    do
+    while( p != last && *p >= '0' && *p <= '9' )
     {
-        ss >> val[len];
-        if( ss.fail() || val[len] <0 || val[len]>15 )
-        {
-            in.setstate(std::ios::failbit);
-            break;
-        }
-        switch( ss.peek() )
+        val = val * 10 + (*p - '0');
+        if( val > 15 )
         {
-            case EOF:
-                break;
-            case '.':
-                ss.ignore();
-                break;
-            default:
-                in.setstate(std::ios::failbit);
-                break;
+            from_chars_result result = { first, std::errc::result_out_of_range };
+            return result;
         }
+        ++p;
     }
-    while( !ss.eof() && (++len < 4) );
 
-    if( len == 4 )
+    if( p == first )
     {
-        in.setstate(std::ios::failbit);
+        from_chars_result result = { first, std::errc::invalid_argument };
+        return result;
     }
-    else if( ! in.fail() )
+
+    value = val;
+    from_chars_result result = { p, std::errc() };
+    return result;
+}
+
+from_chars_result from_chars(const char *first, const char *last, HDMI::physical_address & value)
+{
+    int val[4] = { 0,0,0,0 };
+
+    from_chars_result result = parse_component(first, last, val[0]);
+    if( result.ec != std::errc() )
+        return result;
+
+    for( int len = 1; len < 4; ++len )
     {
-        address.set(val);
+        // a trailing '.' isn't part of the address
+        if( result.ptr == last || *result.ptr != '.' )
+            break;
+
+        from_chars_result next = parse_component(result.ptr + 1, last, val[len]);
+        if( next.ec == std::errc::result_out_of_range )
+        {
+            next.ptr = first;
+            return next;
+        }
+        if( next.ec != std::errc() )
+            break;
+        result = next;
     }
 
-    return in;
+    value.set(val);
+    return result;
 }
 
-std::istream& operator>>(std::istream &in, HDMI::address & address)
+from_chars_result from_chars(const char *first, const char *last, HDMI::address & value)
 {
-    char c = in.peek();
-    if( c >= '0' && c <= '9' )
+    HDMI::address parsed;
+    from_chars_result result = { first, std::errc::invalid_argument };
+
+    if( first != last && *first >= '0' && *first <= '9' )
     {
-        in >> address.physical;
+        result = from_chars(first, last, parsed.physical);
+        if( result.ec == std::errc() )
+            value = parsed;
+        return result;
     }
+
+    if( last - first < 2 )
+        return result;
+
+    if( first[0] == 't' && first[1] == 'v' )
+        parsed.logical = CEC::CECDEVICE_TV;
+    else if( first[0] == 'a' && first[1] == 'v' )
+        parsed.logical = CEC::CECDEVICE_AUDIOSYSTEM;
     else
-    {
-        std::string s;
+        return result;
 
-        in >> s;
+    const char *p = first + 2;
+    int port = 0;
 
-        if( s.find("tv") == 0 )
-        {
-            address.logical = CEC::CECDEVICE_TV;
-            s.erase(0, 2);
-        }
-        else if( s.find("av") == 0 )
+    // look for port
+    if( p != last && *p == '.' )
+    {
+        from_chars_result next = parse_component(p + 1, last, port);
+        if( next.ec != std::errc() )
         {
-            address.logical = CEC::CECDEVICE_AUDIOSYSTEM;
-            s.erase(0, 2);
+            next.ptr = first;
+            return next;
         }
-        else
+        p = next.ptr;
+    }
+
+    /* auto detect port when using tv, need a specific port otherwise */
+    if( port == 0 && parsed.logical != CEC::CECDEVICE_TV )
+        return result;
+
+    parsed.port = port;
+    value = parsed;
+    result.ptr = p;
+    result.ec = std::errc();
+    return result;
+}
+
+/**
+ * Reads the next word into buf, which is long enough for any address,
+ * returns its end or NULL and fails the stream when there is none
+ */
+template <size_t N>
+static const char * read_word(std::istream &in, char (&buf)[N])
+{
+    std::istream::sentry sentry(in);
+    if( ! sentry )
+        return NULL;
+
+    size_t len = 0;
+    for( int c = in.peek(); c != EOF && ! isspace(c); c = in.peek() )
+    {
+        if( len == N )
         {
             in.setstate(std::ios::failbit);
-            return in;
+            return NULL;
         }
+        buf[len++] = (char) in.get();
+    }
+    return buf + len;
+}
 
-        if( s.empty() )
-        {
-            if( address.logical == CEC::CECDEVICE_TV )
-            {
-                /* auto detect port when using tv */
-                address.port = 0;
-            }
-            else
-            {
-                /* need a specific port otherwise */
-                in.setstate(std::ios::failbit);
-            }
-        }
-        else
-        {
-            // look for port
-            std::istringstream ss(s);
-            char c;
-            unsigned port;
+std::ostream& operator<<(std::ostream &out, const HDMI::physical_address & address)
+{
+    return out << address[0] << '.' << address[1] << '.'
+               << address[2] << '.' << address[3];
+}
 
-            ss >> c >> port;
+std::istream& operator>>(std::istream &in, HDMI::physical_address & address)
+{
+    char buf[16];
+    const char *end = read_word(in, buf);
+    if( end == NULL )
+        return in;
 
-            if( ss.fail() || c != '.' || port < 1 || port > 15 )
-                in.setstate(std::ios::failbit);
+    from_chars_result result = from_chars(buf, end, address);
+    if( result.ec != std::errc() || result.ptr != end )
+        in.setstate(std::ios::failbit);
+    return in;
+}
 
-            address.port = port;
-        }
-    }
-    return in; 
+std::istream& operator>>(std::istream &in, HDMI::address & address)
+{
+    char buf[16];
+    const char *end = read_word(in, buf);
+    if( end == NULL )
+        return in;
+
+    from_chars_result result = from_chars(buf, end, address);
+    if( result.ec != std::errc() || result.ptr != end )
+        in.setstate(std::ios::failbit);
+    return in;
 }
 
 std::ostream& operator<<(std::ostream &out, const HDMI::address & address)
@@ -126,14 +180,14 @@ std::ostream& operator<<(std::ostream &out, const HDMI::address & address)
             out << "tv";
             if( address.port != 0 )
             {
-                out << '.' << address.port;
+                out << '.' << (int) address.port;
             }
             break;
         case CEC::CECDEVICE_AUDIOSYSTEM:
             out << "av";
             if( address.port != 0 )
             {
-                out << '.' << address.port;
+                out << '.' << (int) address.port;
             }
             break;
         default:
@@ -143,4 +197,4 @@ std::ostream& operator<<(std::ostream &out, const HDMI::address & address)
     return out;
 }
 
-}
\ No newline at end of file
+}
@@ -1,5 +1,6 @@
 #include <cstdint>
 #include <iostream>
+#include <system_error>
 #include <libcec/cectypes.h>
 
 namespace HDMI
@@ -36,6 +37,28 @@ namespace HDMI
         uint8_t port;
     };
 
+    /**
+     * Result of from_chars, like std::from_chars: ptr is just past what was
+     * parsed, or first with ec set when nothing could be
+     */
+    struct from_chars_result
+    {
+        const char *ptr;
+        std::errc ec;
+    };
+
+    /**
+     * Parses A[.B[.C[.D]]] from [first, last) without allocating, value is
+     * only set on success
+     */
+    from_chars_result from_chars(const char *first, const char *last, HDMI::physical_address & value);
+
+    /**
+     * Parses a physical address, tv[.N] or av.N from [first, last) without
+     * allocating, value is only set on success
+     */
+    from_chars_result from_chars(const char *first, const char *last, HDMI::address & value);
+
     std::ostream& operator<<(std::ostream &out, const HDMI::physical_address & address);
     std::istream& operator>>(std::istream &in, HDMI::physical_address & address);
 
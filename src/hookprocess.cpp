@@ -0,0 +1,221 @@
+/**
+ * hookprocess.cpp
+ *
+ * Feeds events to a persistent helper process over a pipe.
+ */
+#include "hookprocess.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("hookprocess");
+
+// Restart delays, reset once the helper has stayed up for a while
+static const boost::chrono::milliseconds minBackoff(100);
+static const boost::chrono::seconds maxBackoff(30);
+static const boost::chrono::seconds stableUptime(10);
+
+HookProcess::HookProcess() : queueSize(0), stopping(false), pid(-1), fd(-1) {}
+
+HookProcess::~HookProcess() {
+	stop();
+}
+
+void HookProcess::start(const string & command, size_t queueSize) {
+	this->command   = command;
+	this->queueSize = std::max(queueSize, (size_t) 1);
+	stopping = false;
+
+	writer = boost::thread(&HookProcess::run, this);
+	LOG4CPLUS_INFO(logger, "Sending events to \"" << command << "\"");
+}
+
+void HookProcess::stop() {
+	if (!writer.joinable())
+		return;
+
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		stopping = true;
+		cond.notify_all();
+	}
+	writer.join();
+
+	// Whatever the helper didn't read isn't for the next one
+	queue.clear();
+	command.clear();
+}
+
+bool HookProcess::post(const string & line) {
+	boost::lock_guard<boost::mutex> guard(lock);
+
+	// Called from the dispatch thread, which must not wait for a slow helper
+	if (stopping || queue.size() >= queueSize) {
+		Metrics::instance().inc(Metrics::HOOK_EVENTS_DROPPED);
+		LOG4CPLUS_WARN(logger, "Hook process is not reading, dropped \"" << line << "\"");
+		return false;
+	}
+
+	queue.push_back(line + "\n");
+	cond.notify_all();
+	return true;
+}
+
+void HookProcess::run() {
+	boost::chrono::steady_clock::duration backoff = boost::chrono::steady_clock::duration::zero();
+
+	boost::unique_lock<boost::mutex> guard(lock);
+	for (;;) {
+		while (!stopping && queue.empty())
+			cond.wait(guard);
+		if (stopping)
+			break;
+
+		string line = queue.front();
+		guard.unlock();
+
+		// The helper is only started once there is something to tell it
+		bool ok = (fd >= 0 || spawn()) && write(line);
+
+		guard.lock();
+		if (ok) {
+			queue.pop_front();
+			cond.notify_all();
+			continue;
+		}
+		if (stopping)
+			break;
+
+		// Keep the line, and retry with a fresh helper after the backoff
+		guard.unlock();
+		bool stable = pid >= 0 && boost::chrono::steady_clock::now() - started >= stableUptime;
+		reap(false);
+		Metrics::instance().inc(Metrics::HOOK_PROCESS_RESTARTS);
+
+		if (stable)
+			backoff = boost::chrono::steady_clock::duration::zero();
+		else
+			backoff = std::min<boost::chrono::steady_clock::duration>(std::max<boost::chrono::steady_clock::duration>(backoff * 2, minBackoff), maxBackoff);
+
+		LOG4CPLUS_WARN(logger, "Hook process went away, restarting in "
+			<< boost::chrono::duration_cast<boost::chrono::milliseconds>(backoff).count() << "ms");
+
+		boost::chrono::steady_clock::time_point retry = boost::chrono::steady_clock::now() + backoff;
+		guard.lock();
+		while (!stopping && cond.wait_until(guard, retry) != boost::cv_status::timeout)
+			;
+	}
+	guard.unlock();
+
+	reap(true);
+}
+
+bool HookProcess::spawn() {
+	// A socket rather than a pipe, so writes to a helper that went away can use
+	// MSG_NOSIGNAL instead of SIGPIPE being ignored for the whole daemon
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to create hook socket: " << strerror(errno));
+		return false;
+	}
+
+	pid_t child = fork();
+	if (child < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to start hook process: " << strerror(errno));
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if (child == 0) {
+		// Only async signal safe calls from here on
+		dup2(fds[0], STDIN_FILENO);
+		// Own process group, so whatever the shell started can be stopped too
+		setpgid(0, 0);
+		execl("/bin/sh", "sh", "-c", command.c_str(), (char *) NULL);
+		_exit(127);
+	}
+
+	setpgid(child, child);
+	close(fds[0]);
+	fd  = fds[1];
+	pid = child;
+	started = boost::chrono::steady_clock::now();
+
+	// Writes must not block forever, so stop() still works when the helper hangs
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	LOG4CPLUS_DEBUG(logger, "Started hook process " << pid);
+	return true;
+}
+
+bool HookProcess::write(const string & line) {
+	const char *p = line.data();
+	size_t left = line.size();
+
+	while (left > 0) {
+		ssize_t ret = send(fd, p, left, MSG_NOSIGNAL);
+		if (ret > 0) {
+			p += ret;
+			left -= ret;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno != EAGAIN)
+			return false;
+
+		// Socket is full, wait for the helper while checking for stop()
+		struct pollfd pfd = { fd, POLLOUT, 0 };
+		if (poll(&pfd, 1, 200) < 0 && errno != EINTR)
+			return false;
+		if (pfd.revents & (POLLERR | POLLHUP))
+			return false;
+
+		boost::lock_guard<boost::mutex> guard(lock);
+		if (stopping)
+			return false;
+	}
+	return true;
+}
+
+void HookProcess::reap(bool terminate) {
+	if (fd >= 0) {
+		// EOF tells the helper to finish
+		close(fd);
+		fd = -1;
+	}
+	if (pid < 0)
+		return;
+
+	// Give it a second to exit by itself
+	for (int i = 0; i < 10; i++) {
+		if (waitpid(pid, NULL, WNOHANG) != 0) {
+			pid = -1;
+			return;
+		}
+		if (!terminate)
+			break;
+		usleep(100000);
+	}
+
+	kill(-pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	pid = -1;
+}
@@ -0,0 +1,67 @@
+#include <deque>
+#include <string>
+
+#include <sys/types.h>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+/**
+ * A long lived helper started with "/bin/sh -c <command>", that is sent one
+ * line per event on its stdin instead of forking a hook per event.
+ *
+ * Events are queued and written by a background thread. The helper is started
+ * again, with backoff, when it exits. When it stops reading, the queue fills
+ * and post() drops and counts the events that don't fit, it never waits.
+ */
+class HookProcess {
+
+	public:
+
+		HookProcess();
+		virtual ~HookProcess();
+
+		void start(const std::string & command, size_t queueSize = 64);
+
+		/**
+		 * Closes the helper's stdin and waits for it to exit, can be started
+		 * again afterwards
+		 */
+		void stop();
+
+		bool enabled() const { return !command.empty(); };
+
+		/**
+		 * Queues line (without the newline) for the helper, returns false if
+		 * it had to be dropped
+		 */
+		bool post(const std::string & line);
+
+	private:
+
+		void run();
+		bool spawn();
+		void reap(bool terminate);
+		bool write(const std::string & line);
+
+		std::string command;
+		size_t queueSize;
+
+		boost::mutex lock;
+		boost::condition_variable cond; // signalled when the queue changes or on stop
+		std::deque<std::string> queue;
+		bool stopping;
+
+		// Only used by the writer thread
+		pid_t pid;
+		int fd;
+		boost::chrono::steady_clock::time_point started;
+
+		boost::thread writer;
+
+		// Not implemented, owns a process
+		HookProcess(HookProcess const&);
+		void operator=(HookProcess const&);
+};
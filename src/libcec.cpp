@@ -16,6 +16,9 @@
  */
 #include "libcec.h"
 #include "hdmi.h"
+#include "metrics.h"
+#include "profile.h"
+#include "recorder.h"
 
 #include <cstdio>
 #include <iostream>
@@ -49,7 +52,7 @@ static Logger logger = Logger::getInstance("libcec");
 const map<enum cec_user_control_code, const char *> Cec::cecUserControlCodeName = Cec::setupUserControlCodeName();
 
 // We store a global handle, so we can use g_cec->ToString(..) in certain cases. This is a bit of a HACK :(
-static ICECAdapter * g_cec = NULL;
+static CecAdapter * g_cec = NULL;
 
 void cecLogMessage(void *cbParam, const cec_log_message* message) {
 	try {
@@ -58,18 +61,21 @@ void cecLogMessage(void *cbParam, const cec_log_message* message) {
 }
 
 void cecKeyPress(void *cbParam, const cec_keypress* key) {
+	FlightRecorder::instance().key(*key);
 	try {
 		((CecCallback*) cbParam)->onCecKeyPress(*key);
 	} catch (...) {}
 }
 
 void cecCommand(void *cbParam, const cec_command* command) {
+	FlightRecorder::instance().frame(*command);
 	try {
 		((CecCallback*) cbParam)->onCecCommand(*command);
 	} catch (...) {}
 }
 
 void cecAlert(void *cbParam, const libcec_alert alert, const libcec_parameter param) {
+	FlightRecorder::instance().alert(alert);
 	try {
 		((CecCallback*) cbParam)->onCecAlert(alert, param);
 	} catch (...) {}
@@ -94,15 +100,35 @@ void cecSourceActivated(void *cbParam, const cec_logical_address address, const
 	} catch (...) {}
 }
 
-struct ICECAdapterDeleter : std::default_delete<ICECAdapter> {
-	//ICECAdapterDeleter() = default;
+/**
+ * The adapter libcec gives us
+ */
+class LibCecAdapter : public CecAdapter {
+private:
+	ICECAdapter * cec;
 
-	void operator()(ICECAdapter* ptr) const {
-		if (ptr) {
-			UnloadLibCec(ptr);
-			g_cec = NULL;
-		}
-	}
+public:
+	LibCecAdapter(ICECAdapter * cec) : cec(cec) {}
+	~LibCecAdapter() { UnloadLibCec(cec); }
+
+	void InitVideoStandalone() { cec->InitVideoStandalone(); }
+	int8_t DetectAdapters(cec_adapter_descriptor *devices, uint8_t size) { return cec->DetectAdapters(devices, size, NULL); }
+	bool Open(const char *port) { return cec->Open(port); }
+	void Close() { cec->Close(); }
+	bool PingAdapter() { return cec->PingAdapter(); }
+	bool Transmit(const cec_command & command) { return cec->Transmit(command); }
+	bool SetActiveSource(cec_device_type type) { return cec->SetActiveSource(type); }
+	bool SetInactiveView() { return cec->SetInactiveView(); }
+	cec_logical_addresses GetLogicalAddresses() { return cec->GetLogicalAddresses(); }
+	cec_logical_addresses GetActiveDevices() { return cec->GetActiveDevices(); }
+	uint16_t GetPhysicalAddress() { return cec->GetPhysicalAddress(); }
+	uint16_t GetDevicePhysicalAddress(cec_logical_address address) { return cec->GetDevicePhysicalAddress(address); }
+	uint32_t GetDeviceVendorId(cec_logical_address address) { return cec->GetDeviceVendorId(address); }
+	string GetDeviceOSDName(cec_logical_address address) { return cec->GetDeviceOSDName(address); }
+
+	const char *ToString(const cec_opcode opcode) { return cec->ToString(opcode); }
+	const char *ToString(const cec_logical_address address) { return cec->ToString(address); }
+	const char *ToString(const cec_vendor_id vendor) { return cec->ToString(vendor); }
 };
 
 /**
@@ -127,7 +153,7 @@ public:
 	}
 };
 
-Cec::Cec(const char * name, CecCallback * callback)
+Cec::Cec(const char * name, CecCallback * callback) : reinit(false)
 {
 	assert(name != NULL);
 	assert(callback != NULL);
@@ -149,7 +175,9 @@ Cec::Cec(const char * name, CecCallback * callback)
 	config.callbacks                    = &callbacks;
 }
 
-Cec::~Cec() {}
+Cec::~Cec() {
+	g_cec = NULL;
+}
 
 void Cec::init()
 {
@@ -157,11 +185,20 @@ void Cec::init()
     {
         // LibCecInitialise is noisy, so we redirect cout to nowhere
         RedirectStreamBuffer redirect(cout, 0);
-        g_cec = LibCecInitialise(&config);
-        if (! g_cec) {
-            throw std::runtime_error("Failed to initialise libCEC");
+        if (adapterFactory) {
+            StartupProfile::Scope profile(StartupProfile::PHASE_LIBCEC_INIT);
+            cec.reset(adapterFactory(config));
+        } else {
+            StartupProfile::Scope profile(StartupProfile::PHASE_LIBCEC_INIT);
+            ICECAdapter * adapter = LibCecInitialise(&config);
+            if (! adapter) {
+                throw std::runtime_error("Failed to initialise libCEC");
+            }
+            cec.reset(new LibCecAdapter(adapter));
         }
-        cec = std::unique_ptr<CEC::ICECAdapter>(g_cec, ICECAdapterDeleter());
+        g_cec = cec.get();
+
+        StartupProfile::Scope profile(StartupProfile::PHASE_VIDEO_INIT);
         cec->InitVideoStandalone();
     }
 }
@@ -170,12 +207,20 @@ void Cec::open(const std::string &name) {
 	LOG4CPLUS_TRACE_STR(logger, "Cec::open()");
 	int id = 0;
 
+	// libcec only reads its configuration when it is initialised
+	if (reinit) {
+		g_cec = NULL;
+		cec.reset();
+		reinit = false;
+	}
 	init();
 
 	// Search for adapters
 	cec_adapter_descriptor devices[MAX_CEC_PORTS];
 
-	uint8_t ret = cec->DetectAdapters(devices, MAX_CEC_PORTS, NULL);
+	StartupProfile::instance().begin(StartupProfile::PHASE_DETECT);
+	uint8_t ret = cec->DetectAdapters(devices, MAX_CEC_PORTS);
+	StartupProfile::instance().end(StartupProfile::PHASE_DETECT);
 	if (ret < 0) {
 		throw std::runtime_error("Error occurred searching for adapters");
 	}
@@ -203,8 +248,13 @@ void Cec::open(const std::string &name) {
 	// Just use the first found
 	LOG4CPLUS_INFO(logger, "Opening " << devices[id].strComPath);
 
-	if (!cec->Open(devices[id].strComName)) {
-		throw std::runtime_error("Failed to open adapter");
+	// Negotiation ends when libcec tells us our logical address, which may be after Open returned
+	StartupProfile::instance().begin(StartupProfile::PHASE_NEGOTIATE);
+	{
+		StartupProfile::Scope profile(StartupProfile::PHASE_OPEN);
+		if (!cec->Open(devices[id].strComName)) {
+			throw std::runtime_error("Failed to open adapter");
+		}
 	}
 
 	LOG4CPLUS_INFO(logger, "Opened " << devices[id].strComPath);
@@ -213,6 +263,13 @@ void Cec::open(const std::string &name) {
 void Cec::close(bool makeInactive) {
 	assert(cec);
 
+	{
+		boost::lock_guard<boost::mutex> lock(transmitLock);
+		if (!transmitQueue.empty())
+			LOG4CPLUS_INFO(logger, "Dropping queued commands");
+		transmitQueue.clear();
+	}
+
     if (makeInactive)
         cec->SetInactiveView();
     cec->Close();
@@ -225,15 +282,35 @@ void Cec::setTargetAddress(const HDMI::address & address) {
 	config.baseDevice = address.logical;
 	LOG4CPLUS_INFO(logger, "HDMI port is set to " << (int)address.port);
 	config.iHDMIPort = address.port;
+	reinit = true;
+}
+
+void Cec::resetTargetAddress() {
+	libcec_configuration defaults;
+	defaults.Clear();
+
+	LOG4CPLUS_INFO(logger, "Physical Address is autodetected");
+	config.iPhysicalAddress = defaults.iPhysicalAddress;
+	config.baseDevice = defaults.baseDevice;
+	config.iHDMIPort = defaults.iHDMIPort;
+	reinit = true;
+}
+
+void Cec::setBusBudget(int percent) {
+	boost::lock_guard<boost::mutex> lock(transmitLock);
+	transmitQueue.setBudget(percent / 100.0);
 }
 
 void Cec::makeActive() {
 	assert(cec);
 
-	// and made active
-	if (!cec->SetActiveSource(config.deviceTypes[0])) {
-		throw std::runtime_error("Failed to become active");
-	}
+	// sent through SetActiveSource() by transmitPending(), ahead of the rest
+	cec_command frame;
+	uint16_t physical = cec->GetPhysicalAddress();
+	cec_command::Format(frame, cec->GetLogicalAddresses().primary, CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE);
+	frame.parameters.PushBack((uint8_t) (physical >> 8));
+	frame.parameters.PushBack((uint8_t) (physical & 0xFF));
+	transmit(frame, TransmitQueue::PRIORITY_HIGH);
 }
 
 bool Cec::ping() {
@@ -242,6 +319,84 @@ bool Cec::ping() {
     return cec->PingAdapter();
 }
 
+void Cec::transmit(const cec_command & command, TransmitQueue::Priority priority) {
+	boost::lock_guard<boost::mutex> lock(transmitLock);
+
+	if (!transmitQueue.push(command, priority, boost::chrono::steady_clock::now())) {
+		LOG4CPLUS_DEBUG(logger, "Not queueing " << command << ", already queued or queue full");
+		Metrics::instance().inc(Metrics::TRANSMITS_COALESCED);
+	}
+}
+
+void Cec::transmitKey(cec_logical_address destination, cec_user_control_code key, TransmitQueue::Priority priority) {
+	assert(cec);
+
+	cec_logical_address initiator = cec->GetLogicalAddresses().primary;
+
+	boost::lock_guard<boost::mutex> lock(transmitLock);
+	if (!transmitQueue.pushKey(initiator, destination, key, priority, boost::chrono::steady_clock::now()))
+		Metrics::instance().inc(Metrics::TRANSMITS_COALESCED);
+}
+
+void Cec::transmitPending() {
+	assert(cec);
+
+	boost::unique_lock<boost::mutex> lock(transmitLock);
+
+	// One at a time, so key presses queued meanwhile are dispatched in between
+	cec_command command;
+	if (transmitQueue.next(boost::chrono::steady_clock::now(), command)) {
+		// don't hold up the callbacks while the adapter waits for the bus
+		lock.unlock();
+
+		LOG4CPLUS_DEBUG(logger, "Transmit " << command);
+		bool ok;
+		if (command.opcode_set && command.opcode == CEC_OPCODE_ACTIVE_SOURCE
+				&& command.initiator == cec->GetLogicalAddresses().primary) {
+			// so libcec knows we are the active source, and answers for it
+			ok = cec->SetActiveSource(config.deviceTypes[0]);
+		} else {
+			ok = cec->Transmit(command);
+		}
+
+		lock.lock();
+		boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+		switch (transmitQueue.sent(command, ok, now)) {
+			case TransmitQueue::RESULT_SENT:
+				Metrics::instance().inc(Metrics::TRANSMITS);
+				break;
+			case TransmitQueue::RESULT_RETRY:
+				LOG4CPLUS_DEBUG(logger, "Not acknowledged, retrying " << command);
+				Metrics::instance().inc(Metrics::TRANSMIT_RETRIES);
+				break;
+			case TransmitQueue::RESULT_FAILED:
+				LOG4CPLUS_WARN(logger, "Failed to transmit " << command);
+				Metrics::instance().inc(Metrics::TRANSMIT_NACKS);
+				break;
+		}
+		Metrics::instance().busOccupancy(transmitQueue.occupancy(now));
+	}
+}
+
+boost::chrono::steady_clock::time_point Cec::transmitDeadline(boost::chrono::steady_clock::time_point now) const {
+	boost::lock_guard<boost::mutex> lock(transmitLock);
+	return transmitQueue.deadline(now);
+}
+
+void Cec::observed(const cec_command & command) {
+	boost::lock_guard<boost::mutex> lock(transmitLock);
+
+	boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+	transmitQueue.observed(command, now);
+	Metrics::instance().busOccupancy(transmitQueue.occupancy(now));
+}
+
+uint16_t Cec::getPhysicalAddress() {
+	assert(cec);
+
+	return cec->GetDevicePhysicalAddress(cec->GetLogicalAddresses().primary);
+}
+
 
 /**
  * Prints the name of all found adapters
@@ -252,7 +407,7 @@ ostream & Cec::listDevices(ostream & out) {
 
     init();
 
-	int8_t ret = cec->DetectAdapters(devices, MAX_CEC_PORTS, NULL);
+	int8_t ret = cec->DetectAdapters(devices, MAX_CEC_PORTS);
 	if (ret < 0) {
 		LOG4CPLUS_ERROR(logger, "Error occurred searching for adapters");
 		return out;
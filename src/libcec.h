@@ -1,10 +1,15 @@
 #include <cstddef>
 #include <libcec/cec.h>
 
+#include "transmit.h"
+
+#include <functional>
 #include <memory>
 #include <map>
 #include <string>
 
+#include <boost/thread/mutex.hpp>
+
 namespace HDMI {
 	class physical_address;
 	class address;
@@ -24,6 +29,35 @@ class CecCallback {
 		virtual void onCecSourceActivated(const CEC::cec_logical_address & address, bool bActivated) = 0;
 };
 
+/**
+ * The calls we make on libcec's ICECAdapter, so something else can stand in
+ * for the adapter. Same names and meaning as ICECAdapter, whose full
+ * interface changes with every libcec version.
+ */
+class CecAdapter {
+	public:
+		virtual ~CecAdapter() {}
+
+		virtual void InitVideoStandalone() = 0;
+		virtual int8_t DetectAdapters(CEC::cec_adapter_descriptor *devices, uint8_t size) = 0;
+		virtual bool Open(const char *port) = 0;
+		virtual void Close() = 0;
+		virtual bool PingAdapter() = 0;
+		virtual bool Transmit(const CEC::cec_command & command) = 0;
+		virtual bool SetActiveSource(CEC::cec_device_type type) = 0;
+		virtual bool SetInactiveView() = 0;
+		virtual CEC::cec_logical_addresses GetLogicalAddresses() = 0;
+		virtual CEC::cec_logical_addresses GetActiveDevices() = 0;
+		virtual uint16_t GetPhysicalAddress() = 0;
+		virtual uint16_t GetDevicePhysicalAddress(CEC::cec_logical_address address) = 0;
+		virtual uint32_t GetDeviceVendorId(CEC::cec_logical_address address) = 0;
+		virtual std::string GetDeviceOSDName(CEC::cec_logical_address address) = 0;
+
+		virtual const char *ToString(const CEC::cec_opcode opcode) = 0;
+		virtual const char *ToString(const CEC::cec_logical_address address) = 0;
+		virtual const char *ToString(const CEC::cec_vendor_id vendor) = 0;
+};
+
 /**
  * Simple wrapper class around libcec
  */
@@ -37,7 +71,15 @@ class Cec {
 		CEC::ICECCallbacks callbacks;
 		CEC::libcec_configuration config;
 
-		std::unique_ptr<CEC::ICECAdapter> cec;
+		std::unique_ptr<CecAdapter> cec;
+		bool reinit; // config changed since libcec was initialised
+
+		// Creates the adapter instead of libcec when set
+		std::function<CecAdapter * (const CEC::libcec_configuration & config)> adapterFactory;
+
+		// Our outgoing frames, also told about everybody else's
+		TransmitQueue transmitQueue;
+		mutable boost::mutex transmitLock;
 
 		// Inits the CECAdapter 
 		void init();
@@ -49,6 +91,13 @@ class Cec {
 		Cec(const char *name, CecCallback *callback);
 		virtual ~Cec();
 
+		/**
+		 * Uses the adapters factory creates rather than loading libcec
+		 */
+		void setAdapterFactory(std::function<CecAdapter * (const CEC::libcec_configuration & config)> factory) {
+			adapterFactory = factory;
+		};
+
 		/**
 		 * List all found adapters and prints them out
 		 */
@@ -64,10 +113,59 @@ class Cec {
 		 */
 		void close(bool makeInactive = true);
 
+		/**
+		 * Queues our ACTIVE_SOURCE broadcast, sent by transmitPending()
+		 */
 		void makeActive();
+
+		/**
+		 * Sets the address to claim, or goes back to autodetecting it. Takes
+		 * effect the next time the adapter is opened.
+		 */
 		void setTargetAddress(const HDMI::address & address);
+		void resetTargetAddress();
 		bool ping();
 
+		/**
+		 * Queues a raw command for the bus, sent by transmitPending()
+		 */
+		void transmit(const CEC::cec_command & command, TransmitQueue::Priority priority = TransmitQueue::PRIORITY_NORMAL);
+
+		/**
+		 * Queues a remote key press for another device, repeated presses of
+		 * the same key are sent as one longer press
+		 */
+		void transmitKey(CEC::cec_logical_address destination, CEC::cec_user_control_code key,
+			TransmitQueue::Priority priority = TransmitQueue::PRIORITY_NORMAL);
+
+		/**
+		 * Sends the next queued command if the bus has room for it, blocks while
+		 * it is sent
+		 */
+		void transmitPending();
+
+		/**
+		 * When transmitPending() next has something to do, now if it has already,
+		 * time_point::max() if nothing is queued
+		 */
+		boost::chrono::steady_clock::time_point transmitDeadline(boost::chrono::steady_clock::time_point now) const;
+
+		/**
+		 * Accounts for a command received from the bus
+		 */
+		void observed(const CEC::cec_command & command);
+
+		/**
+		 * Holds our commands back while the bus was busy for more than this
+		 * percentage of the last second (1-100)
+		 */
+		void setBusBudget(int percent);
+
+		/**
+		 * Our physical address, as libcec worked it out when opening
+		 */
+		uint16_t getPhysicalAddress();
+
 	// These are just wrapper functions, to map C callbacks to C++
 	friend void cecLogMessage (void *cbParam, const CEC::cec_log_message *message);
 	friend void cecKeyPress   (void *cbParam, const CEC::cec_keypress *key);
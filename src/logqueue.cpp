@@ -0,0 +1,211 @@
+/**
+ * logqueue.cpp
+ *
+ * The queue is a bounded multi-producer queue of sequenced slots: a slot is
+ * free to fill when its sequence equals the position claimed, and ready to
+ * write when it is one past it. Producers only ever contend on claiming a
+ * position, never on the writer.
+ */
+#include "logqueue.h"
+#include "metrics.h"
+
+#include <cerrno>
+#include <ctime>
+
+#include <unistd.h>
+
+#include <log4cplus/layout.h>
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace log4cplus;
+
+static Logger logger = Logger::getInstance("logqueue");
+
+// The same message again within this is counted rather than written
+static const boost::chrono::seconds repeatWindow(10);
+
+LogQueue::LogQueue(int fd, size_t capacity) : fd(fd), mask(0), head(0), tail(0), dropped(0),
+	idle(false), stopping(false), repeats(0) {
+
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+	slots.reset(new Slot[size]);
+	mask = size - 1;
+	for (size_t i = 0; i < size; i++)
+		slots[i].sequence = i;
+
+	sem_init(&wake, 0, 0);
+	writer.reset(new boost::thread(&LogQueue::run, this));
+}
+
+LogQueue::~LogQueue() {
+	close();
+	destructorImpl();
+	sem_destroy(&wake);
+}
+
+void LogQueue::close() {
+	if (stopping.exchange(true))
+		return;
+
+	sem_post(&wake);
+	if (writer && writer->joinable())
+		writer->join();
+	closed = true;
+}
+
+void LogQueue::forked() {
+	// The parent's writer is not running here, its handle is of no use
+	writer.release();
+
+	sem_init(&wake, 0, 0);
+	idle = false;
+	writer.reset(new boost::thread(&LogQueue::run, this));
+}
+
+void LogQueue::append(const spi::InternalLoggingEvent & event) {
+	if (!push(event)) {
+		dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	// pairs with the fence the writer goes to sleep with
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (idle.load(std::memory_order_relaxed) && idle.exchange(false))
+		sem_post(&wake);
+}
+
+bool LogQueue::push(const spi::InternalLoggingEvent & event) {
+	size_t pos = head.load(std::memory_order_relaxed);
+	Slot * slot;
+	for (;;) {
+		slot = &slots[pos & mask];
+		ptrdiff_t diff = (ptrdiff_t) (slot->sequence.load(std::memory_order_acquire) - pos);
+		if (diff == 0) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			// the writer hasn't emptied this slot yet, full
+			return false;
+		} else {
+			pos = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	slot->event.reset(new spi::InternalLoggingEvent(event));
+	slot->sequence.store(pos + 1, std::memory_order_release);
+	return true;
+}
+
+std::unique_ptr<spi::InternalLoggingEvent> LogQueue::pop() {
+	Slot & slot = slots[tail & mask];
+	if (slot.sequence.load(std::memory_order_acquire) != tail + 1)
+		return std::unique_ptr<spi::InternalLoggingEvent>();
+
+	std::unique_ptr<spi::InternalLoggingEvent> event(std::move(slot.event));
+	slot.sequence.store(tail + mask + 1, std::memory_order_release);
+	tail++;
+	return event;
+}
+
+void LogQueue::run() {
+	for (;;) {
+		// everything queued goes out in one write
+		while (std::unique_ptr<spi::InternalLoggingEvent> event = pop())
+			write(std::move(event));
+
+		size_t lost = dropped.exchange(0);
+		if (lost) {
+			Metrics::instance().inc(Metrics::LOG_MESSAGES_DROPPED, lost);
+			if (logger.isEnabledFor(WARN_LOG_LEVEL)) {
+				std::ostringstream message;
+				message << "Dropped " << lost << " log messages, the log could not keep up";
+				layout->formatAndAppend(batch, spi::InternalLoggingEvent(logger.getName(), WARN_LOG_LEVEL, message.str(), __FILE__, __LINE__));
+			}
+		}
+
+		boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+		if (repeats && now - repeatsSince >= repeatWindow)
+			repeated();
+		flush();
+
+		if (stopping)
+			break;
+
+		idle = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (slots[tail & mask].sequence.load(std::memory_order_relaxed) == tail + 1) {
+			idle = false;
+			continue;
+		}
+
+		if (repeats) {
+			// wake up to write how often the last message was repeated
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			boost::chrono::nanoseconds left = repeatsSince + repeatWindow - now;
+			deadline.tv_sec  += left.count() / 1000000000;
+			deadline.tv_nsec += left.count() % 1000000000;
+			if (deadline.tv_nsec >= 1000000000) {
+				deadline.tv_sec++;
+				deadline.tv_nsec -= 1000000000;
+			}
+			while (sem_timedwait(&wake, &deadline) < 0 && errno == EINTR);
+		} else {
+			while (sem_wait(&wake) < 0 && errno == EINTR);
+		}
+
+		// producers may have posted more than once
+		while (sem_trywait(&wake) == 0);
+		idle = false;
+	}
+
+	// nothing queued before closing is lost
+	while (std::unique_ptr<spi::InternalLoggingEvent> event = pop())
+		write(std::move(event));
+	repeated();
+	flush();
+}
+
+void LogQueue::write(std::unique_ptr<spi::InternalLoggingEvent> event) {
+	boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+
+	if (last && now - lastAt < repeatWindow && event->getLogLevel() == last->getLogLevel()
+		&& event->getMessage() == last->getMessage() && event->getLoggerName() == last->getLoggerName()) {
+		if (repeats++ == 0)
+			repeatsSince = now;
+		lastAt = now;
+		return;
+	}
+
+	repeated();
+	layout->formatAndAppend(batch, *event);
+	last = std::move(event);
+	lastAt = now;
+}
+
+void LogQueue::repeated() {
+	if (!repeats)
+		return;
+
+	std::ostringstream message;
+	message << "Last message repeated " << repeats << (repeats == 1 ? " time" : " times");
+	layout->formatAndAppend(batch, spi::InternalLoggingEvent(last->getLoggerName(), last->getLogLevel(), message.str(), __FILE__, __LINE__));
+	repeats = 0;
+}
+
+void LogQueue::flush() {
+	const std::string & out = batch.str();
+	size_t written = 0;
+	while (written < out.size()) {
+		ssize_t ret = ::write(fd, out.data() + written, out.size() - written);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break; // nowhere to report it
+		written += ret;
+	}
+	batch.str("");
+}
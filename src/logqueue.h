@@ -0,0 +1,86 @@
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <sstream>
+
+#include <semaphore.h>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <log4cplus/appender.h>
+
+/**
+ * A log appender that never blocks the thread logging. Events go into a
+ * bounded lock-free queue, and a background thread formats and writes them,
+ * as many as are queued in one write.
+ *
+ * The same message logged again and again is written once, followed by how
+ * many times it was repeated. When the writer falls behind and the queue is
+ * full, events are dropped and how many is reported once it caught up.
+ */
+class LogQueue : public log4cplus::Appender {
+
+	public:
+
+		/**
+		 * Writes to fd, which stays open, queueing at most capacity events
+		 */
+		LogQueue(int fd, size_t capacity = 1024);
+		virtual ~LogQueue();
+
+		/**
+		 * Writes what is queued and stops the writer
+		 */
+		virtual void close();
+
+		/**
+		 * Starts the writer again in a forked child, it only ran in the parent
+		 */
+		void forked();
+
+	protected:
+
+		virtual void append(const log4cplus::spi::InternalLoggingEvent & event);
+
+	private:
+
+		// Not implemented
+		LogQueue(LogQueue const&);
+		void operator=(LogQueue const&);
+
+		struct Slot
+		{
+			std::atomic<size_t> sequence;
+			std::unique_ptr<log4cplus::spi::InternalLoggingEvent> event;
+		};
+
+		int fd;
+		std::unique_ptr<Slot[]> slots;
+		size_t mask;
+		std::atomic<size_t> head;   // next slot to fill
+		size_t tail;                // next slot to write, only used by the writer
+		std::atomic<size_t> dropped;
+
+		bool push(const log4cplus::spi::InternalLoggingEvent & event);
+		std::unique_ptr<log4cplus::spi::InternalLoggingEvent> pop();
+
+		// Wakes the writer when it sleeps
+		sem_t wake;
+		std::atomic<bool> idle;
+		std::atomic<bool> stopping;
+
+		// The writer thread, leaked rather than joined in a forked child
+		std::unique_ptr<boost::thread> writer;
+		void run();
+		void write(std::unique_ptr<log4cplus::spi::InternalLoggingEvent> event);
+		void flush();
+
+		// Only used by the writer
+		std::ostringstream batch;
+		std::unique_ptr<log4cplus::spi::InternalLoggingEvent> last;
+		boost::chrono::steady_clock::time_point lastAt;       // when last was logged, or repeated
+		boost::chrono::steady_clock::time_point repeatsSince; // first repeat not written yet
+		unsigned repeats;
+		void repeated();
+};
@@ -8,12 +8,16 @@
  */
 #include "main.h"
 #include "config.h"
-#include "hdmi.h"
+#include "logqueue.h"
+#include "profile.h"
+#include "recorder.h"
+#include "simulator.h"
 
 #define CEC_NAME    "linux PC"
 #define UINPUT_NAME "libcec-daemon"
 
 #include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <iostream>
 #include <cstdint>
@@ -23,6 +27,9 @@
 #include <string>
 #include <vector>
 #include <unistd.h>
+#include <sys/prctl.h>
+#include <cerrno>
+#include <cstring>
 #include <fstream>
 #include <sstream>
 
@@ -34,7 +41,6 @@
 
 #include <log4cplus/logger.h>
 #include <log4cplus/loggingmacros.h>
-#include <log4cplus/configurator.h>
 
 using namespace CEC;
 using namespace log4cplus;
@@ -45,7 +51,6 @@ using std::endl;
 using std::min;
 using std::string;
 using std::vector;
-using std::queue;
 using std::list;
 using std::map;
 using std::ifstream;
@@ -68,19 +73,56 @@ enum
 	COMMAND_RESTART,
 	COMMAND_KEYPRESS,
 	COMMAND_KEYRELEASE,
+	COMMAND_KEY,
+	COMMAND_TRANSMIT,
+	COMMAND_VENDOR,
+	COMMAND_FORWARD,
+	COMMAND_RELOAD,
 	COMMAND_EXIT,
 };
 
+// Turns a lower priority lane gets at the latest when higher ones stay busy
+static const unsigned laneStarvationLimit = 8;
+
+// How long synthetic key presses are held down
+static const boost::chrono::milliseconds keyPressDuration(100);
+
 Main & Main::instance() {
 	// Singleton pattern so we can use main from a sighandle
 	static Main main;
 	return main;
 }
 
-Main::Main() : cec(getCecName(), this), uinput(UINPUT_NAME, uinputCecMap),
-	makeActive(true), running(false), lastUInputKeys({ }), logicalAddress(CECDEVICE_UNKNOWN)
+Main::Main() : cec(getCecName(), this), uinput(UINPUT_NAME, uinputKeys()),
+	pointer(uinput), pointerToggle(CEC_USER_CONTROL_CODE_UNKNOWN),
+	makeActive(true), running(false), releaseAt(boost::chrono::steady_clock::time_point::max()),
+	passedOver(), logicalAddress(CECDEVICE_UNKNOWN), portPinned(false), mprisHeld(CEC_USER_CONTROL_CODE_UNKNOWN),
+	pingInterval(boost::chrono::seconds(43)), timerSlack(-1), maxHold(boost::chrono::seconds(10)), lastTraffic(0)
 {
 	LOG4CPLUS_TRACE_STR(logger, "Main::Main()");
+	std::shared_ptr<CommandRules> defaultRules = std::make_shared<CommandRules>();
+	defaultRules->loadDefaults();
+	rules = defaultRules;
+	events.reset(new EventRules(&Main::keyCode));
+	sourceSince = lastKey = boost::chrono::steady_clock::now();
+
+	memset(&status, 0, sizeof(status));
+	status.last_key = 0xFFFF;
+	statusChanged   = false;
+	tvPower         = CEC_DAEMON_STATUS_POWER_UNKNOWN;
+	vendorDecoders = std::make_shared<VendorDecoders>();
+
+	vendorButton = CEC_USER_CONTROL_CODE_UNKNOWN;
+	for( int i = 0; i < 16; i++ )
+	{
+		vendorIds[i]   = CEC_VENDOR_UNKNOWN;
+		vendorAsked[i] = false;
+	}
+
+	/* forwarded local volume keys control the audio system */
+	forwarder.map(KEY_VOLUMEUP,   CEC_USER_CONTROL_CODE_VOLUME_UP,   CECDEVICE_AUDIOSYSTEM);
+	forwarder.map(KEY_VOLUMEDOWN, CEC_USER_CONTROL_CODE_VOLUME_DOWN, CECDEVICE_AUDIOSYSTEM);
+	forwarder.map(KEY_MUTE,       CEC_USER_CONTROL_CODE_MUTE,        CECDEVICE_AUDIOSYSTEM);
 }
 
 Main::~Main() {
@@ -88,7 +130,7 @@ Main::~Main() {
 	stop();
 }
 
-void Main::loop(const string & device) {
+void Main::loop() {
 	LOG4CPLUS_TRACE_STR(logger, "Main::loop()");
 
 	struct sigaction action;
@@ -97,82 +139,271 @@ void Main::loop(const string & device) {
 	action.sa_flags = SA_RESETHAND;
 	sigemptyset(&action.sa_mask);
 
+	/* unlike a second SIGINT, a second SIGHUP only reloads again */
+	struct sigaction reloadAction = action;
+	reloadAction.sa_flags = 0;
+
 	int restart = false;
 
+	if( timerSlack >= 0 )
+		applyTimerSlack();
+
+	/* this thread owns uinput, so it is the one that gets real-time priority */
+	realtime.apply();
+
+	if( ! hookProcessCommand.empty() )
+	{
+		RealTime::Unpinned unpinned(realtime);
+		hookProcess.start(hookProcessCommand);
+	}
+
+	if( forwarder.enabled() )
+	{
+		RealTime::Unpinned unpinned(realtime);
+		forwarder.start([this](cec_logical_address destination, cec_user_control_code key) {
+			forwardKey(destination, key);
+		});
+	}
+
 	do
 	{
-		cec.open(device);
+		/* reopening, libcec doesn't need to detect the port again */
+		if (restart)
+			pinDetectedPort();
+		restart = false;
+
+		FlightRecorder::instance().state(FlightRecorder::STATE_OPENING);
+		{
+			/* libcec starts its threads in here */
+			RealTime::Unpinned unpinned(realtime);
+			cec.open(settings.adapter);
+		}
+		FlightRecorder::instance().state(FlightRecorder::STATE_OPENED);
 
 		running = true;
+		onCecTraffic();
+
+		/* devices that didn't tell us their vendor may answer this time */
+		for( int i = 0; i < 16; i++ )
+			vendorAsked[i] = false;
+		notify.status("Adapter opened");
 
 		/* install signals */
-		sigaction (SIGHUP,  &action, NULL);
+		sigaction (SIGHUP,  &reloadAction, NULL);
 		sigaction (SIGINT,  &action, NULL);
 		sigaction (SIGTERM, &action, NULL);
 
+		activeSource.opened(boost::chrono::steady_clock::now());
+		activeSource.setPhysicalAddress(cec.getPhysicalAddress());
+		topology.setOurAddress(logicalAddress, cec.getPhysicalAddress());
+
 		if (makeActive) {
-			cec.makeActive();
+			/* after a quick restart the TV is usually still showing us */
+			if (activeSource.active()) {
+				LOG4CPLUS_INFO(logger, "Still the active source, not announcing again");
+			} else {
+				/* tried now rather than from the loop, so readiness is normally reported after it */
+				StartupProfile::Scope profile(StartupProfile::PHASE_ACTIVATE);
+				cec.makeActive();
+				cec.transmitPending();
+				activeSource.activated(true);
+			}
 		}
 
+		/* adapter open, uinput created and activated: the remote works now */
+		notify.ready();
+		StartupProfile::instance().ready();
+		notify.status(makeActive ? "Active" : "Inactive");
+		publishStatus();
+		runEvent(EventRules::EVENT_OPENED);
+
+		boost::chrono::steady_clock::time_point nextWatchdog = boost::chrono::steady_clock::time_point::max();
+		if( notify.watchdogInterval() > boost::chrono::steady_clock::duration::zero() )
+			nextWatchdog = boost::chrono::steady_clock::now();
+
 		do
 		{
 			boost::unique_lock<boost::mutex> libcec_lock(libcec_sync);
 
-			while( running && !commands.empty() )
+			int lane;
+			while( running && (lane = nextLane()) >= 0 )
 			{
-				Command cmd = commands.front();
+				Command cmd = commands[lane].front();
+				commands[lane].pop();
+
+				/* let the callbacks queue more work meanwhile */
+				libcec_lock.unlock();
+				try
+				{
 				switch( cmd.command )
 				{
 					case COMMAND_STANDBY:
-						if( ! onStandbyCommand.empty() )
-						{
-							LOG4CPLUS_DEBUG(logger, "Standby: Running \"" << onStandbyCommand << "\"");
-							int ret = system(onStandbyCommand.c_str());
-                            if( ret )
-                                LOG4CPLUS_ERROR(logger, "Standby command failed: " << ret);
-							
-						}
+						if( standbyEvents.offer(COMMAND_STANDBY, boost::chrono::steady_clock::now()) )
+							onStandby();
 						else
-						{
-							onCecKeyPress( CEC_USER_CONTROL_CODE_POWER );
-						}
+							Metrics::instance().inc(Metrics::EVENTS_COALESCED);
 						break;
 					case COMMAND_ACTIVE:
-						makeActive = true;
-						if( ! onActivateCommand.empty() )
-						{
-							LOG4CPLUS_DEBUG(logger, "Activated: Running \"" << onActivateCommand << "\"");
-							int ret = system(onActivateCommand.c_str());
-                            if( ret )
-                                LOG4CPLUS_ERROR(logger, "Activate command failed: " << ret);
-						}
-						break;
 					case COMMAND_INACTIVE:
-						makeActive = false;
-						if( ! onDeactivateCommand.empty() )
+						if( sourceEvents.offer(cmd.command, boost::chrono::steady_clock::now()) )
+							onSourceState(cmd.command == COMMAND_ACTIVE);
+						else
+							Metrics::instance().inc(Metrics::EVENTS_COALESCED);
+						break;
+					case COMMAND_KEY:
+					{
+						if( ! pointerKey( cmd.key ) && ! mprisKey( cmd.key ) )
+							sendKey( cmd.key );
+						boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+						lastKey = now;
+						status.last_key      = cmd.key.keycode;
+						status.last_key_time = StatusPage::now();
+						if( cmd.key.duration == 0 )
+							status.keys++;
+						statusChanged = true;
+						Metrics::instance().keyLatency(boost::chrono::duration<double>(now - cmd.queued).count());
+						if( ! StartupProfile::instance().done(StartupProfile::PHASE_FIRST_KEY) )
 						{
-							LOG4CPLUS_DEBUG(logger, "Deactivated: Running \"" << onDeactivateCommand << "\"");
-							int ret = system(onDeactivateCommand.c_str());
-                            if( ret )
-                                LOG4CPLUS_ERROR(logger, "Deactivate command failed: " << ret);
+							StartupProfile::instance().span(StartupProfile::PHASE_FIRST_KEY, cmd.queued, now);
+							StartupProfile::instance().report();
 						}
 						break;
+					}
 					case COMMAND_KEYPRESS:
 						onCecKeyPress( cmd.keycode );
 						break;
+					case COMMAND_TRANSMIT:
+						/* somebody is waiting for our reply */
+						cec.transmit( cmd.frame, TransmitQueue::PRIORITY_HIGH );
+						break;
+					case COMMAND_FORWARD:
+						cec.transmitKey( cmd.frame.destination, (cec_user_control_code) cmd.frame.parameters[0] );
+						break;
+					case COMMAND_VENDOR:
+					{
+						/* a vendor frame from a device we don't know yet, the answer comes to onCecCommand */
+						cec_command query;
+						cec_command::Format(query, logicalAddress, cmd.frame.initiator, CEC_OPCODE_GIVE_DEVICE_VENDOR_ID);
+						cec.transmit( query, TransmitQueue::PRIORITY_NORMAL );
+						break;
+					}
+					case COMMAND_RELOAD:
+						reloadSettings();
+						break;
 					case COMMAND_RESTART:
+						FlightRecorder::instance().state(FlightRecorder::STATE_RESTART);
+						Metrics::instance().inc(Metrics::RESTARTS);
+						notify.status("Restarting");
 						running = false;
 						restart = true;
 						break;
 					case COMMAND_EXIT:
+						FlightRecorder::instance().state(FlightRecorder::STATE_EXIT);
 						running = false;
 						break;
 				}
-				commands.pop();
+				}
+				catch( std::exception & e )
+				{
+					/* e.g. a failed uinput write, the stuck key watchdog cleans up after it */
+					LOG4CPLUS_ERROR(logger, "Command " << cmd.command << " failed: " << e.what());
+				}
+				libcec_lock.lock();
 			}
-			while( running && !libcec_cond.timed_wait(libcec_lock, boost::posix_time::seconds(43)) )
+			if( running )
 			{
-				running = cec.ping();
+				libcec_lock.unlock();
+				boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+
+				try
+				{
+					if( now >= releaseAt )
+						releaseKeys();
+
+					/* queued frames go once the bus has room for them */
+					if( now >= cec.transmitDeadline(now) )
+						cec.transmitPending();
+
+					if( now >= pointer.deadline() )
+						pointer.tick(now);
+
+					/* a lost release frame must not leave a key auto-repeating forever */
+					if( maxHold != boost::chrono::steady_clock::duration::zero() && now >= uinput.stuckDeadline(maxHold) )
+						releaseStuckKeys(now);
+
+					/* the final state of a burst of source changes */
+					int state;
+					if( sourceEvents.expire(now, state) )
+						onSourceState(state == COMMAND_ACTIVE);
+					if( standbyEvents.expire(now, state) )
+						onStandby();
+
+					int timer;
+					while( (timer = events->expired(now)) >= 0 )
+					{
+						if( ! runEvent(EventRules::EVENT_TIMER, timer) )
+							LOG4CPLUS_DEBUG(logger, "Timer " << events->timerName(timer) << " ran out, no rule matched");
+					}
+
+					if( statusChanged.exchange(false) )
+						publishStatus();
+				}
+				catch( std::exception & e )
+				{
+					/* as for commands, a failed uinput write must not take the daemon down */
+					LOG4CPLUS_ERROR(logger, "Maintenance failed: " << e.what());
+				}
+
+				if( now >= nextWatchdog )
+				{
+					/* only sent from here, so a stuck hook or libcec call stops the keepalives */
+					notify.watchdog();
+					nextWatchdog = now + notify.watchdogInterval();
+				}
+				libcec_lock.lock();
+
+				if( ! running || hasWork() || statusChanged )
+				{
+					/* work came in, or a held back key press can go now */
+				}
+				else if( pingInterval == boost::chrono::steady_clock::duration::zero() || now < lastTrafficTime() + pingInterval )
+				{
+					/* traffic proves the adapter alive, only ping once the bus went quiet */
+					boost::chrono::steady_clock::time_point deadline = std::min(std::min(nextWatchdog, releaseAt),
+						std::min(sourceEvents.deadline(), standbyEvents.deadline()));
+					if( maxHold != boost::chrono::steady_clock::duration::zero() )
+						deadline = std::min(deadline, uinput.stuckDeadline(maxHold));
+					deadline = std::min(deadline, pointer.deadline());
+					deadline = std::min(deadline, cec.transmitDeadline(now));
+					deadline = std::min(deadline, events->deadline());
+					if( pingInterval != boost::chrono::steady_clock::duration::zero() )
+						deadline = std::min(deadline, lastTrafficTime() + pingInterval);
+
+					if( deadline == boost::chrono::steady_clock::time_point::max() )
+						libcec_cond.wait(libcec_lock);
+					else
+						libcec_cond.wait_until(libcec_lock, deadline);
+				}
+				else
+				{
+					/* don't hold up the callbacks while the adapter is pinged */
+					libcec_lock.unlock();
+					bool alive = cec.ping();
+					libcec_lock.lock();
+
+					if( alive )
+					{
+						onCecTraffic();
+					}
+					else
+					{
+						LOG4CPLUS_ERROR(logger, "Adapter did not answer ping");
+						Metrics::instance().inc(Metrics::PING_FAILURES);
+						FlightRecorder::instance().state(FlightRecorder::STATE_PING_FAILED);
+						notify.status("Adapter did not answer ping, exiting");
+						running = false;
+					}
+				}
 			}
 		}
 		while( running );
@@ -182,18 +413,238 @@ void Main::loop(const string & device) {
 		signal (SIGINT,  SIG_DFL);
 		signal (SIGTERM, SIG_DFL);
 
+		if( ! restart )
+			notify.stopping();
+
+		/* nothing stays held down while the adapter is closed */
+		releaseAllKeys();
 		cec.close(!restart);
+		activeSource.closed(!restart, boost::chrono::steady_clock::now());
+		FlightRecorder::instance().state(FlightRecorder::STATE_CLOSED);
+		publishStatus();
 	}
 	while( restart );
+
+	forwarder.stop();
+	hookProcess.stop();
+	statusPage.close();
+}
+
+void Main::onStandby() {
+	FlightRecorder::instance().state(FlightRecorder::STATE_STANDBY);
+	if( hookProcess.enabled() )
+	{
+		hookProcess.post("standby");
+	}
+	if( runEvent(EventRules::EVENT_STANDBY) )
+	{
+		/* the event rule replaces the hook */
+	}
+	else if( ! onStandbyCommand.empty() )
+	{
+		runHook(Metrics::HOOK_STANDBY, "Standby", onStandbyCommand);
+	}
+	else if( ! hookProcess.enabled() )
+	{
+		onCecKeyPress( CEC_USER_CONTROL_CODE_POWER );
+	}
+}
+
+void Main::onSourceState(bool active) {
+	FlightRecorder::instance().state(active ? FlightRecorder::STATE_ACTIVATED : FlightRecorder::STATE_DEACTIVATED);
+	if( active != makeActive )
+		sourceSince = boost::chrono::steady_clock::now();
+	makeActive = active;
+	statusChanged = true;
+	if( hookProcess.enabled() )
+	{
+		hookProcess.post(active ? "activate" : "deactivate");
+	}
+	if( runEvent(active ? EventRules::EVENT_ACTIVATE : EventRules::EVENT_DEACTIVATE) )
+	{
+		/* the event rule replaces the hook */
+	}
+	else if( active && ! onActivateCommand.empty() )
+	{
+		runHook(Metrics::HOOK_ACTIVATE, "Activate", onActivateCommand);
+	}
+	else if( ! active && ! onDeactivateCommand.empty() )
+	{
+		runHook(Metrics::HOOK_DEACTIVATE, "Deactivate", onDeactivateCommand);
+	}
+	notify.status(active ? "Active" : "Inactive");
+}
+
+/**
+ * Runs the actions of the first event rule for event that matches, returns
+ * false if none did
+ */
+bool Main::runEvent(EventRules::Event event, int timer) {
+	boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+
+	EventState state;
+	state.active      = makeActive;
+	state.sinceSource = now - sourceSince;
+	state.idle        = now - lastKey;
+
+	const EventRule * rule = events->match(event, state, timer);
+	if( ! rule )
+		return false;
+
+	LOG4CPLUS_DEBUG(logger, "Event " << EventRules::eventName(event) << " matched event rule on line " << rule->line);
+	for( vector<EventAction>::const_iterator action = rule->actions.begin(); action != rule->actions.end(); ++action )
+	{
+		switch( action->type )
+		{
+			case EventAction::ACTION_KEY:
+				push(Command(COMMAND_KEYPRESS, action->key));
+				break;
+			case EventAction::ACTION_INPUT:
+				try
+				{
+					uinput.send_event(EV_KEY, action->input, EV_KEY_PRESSED);
+					uinput.sync();
+					uinput.send_event(EV_KEY, action->input, EV_KEY_RELEASED);
+					uinput.sync();
+				}
+				catch( std::exception & e )
+				{
+					LOG4CPLUS_ERROR(logger, "Failed to send key " << action->input << ": " << e.what());
+				}
+				break;
+			case EventAction::ACTION_TRANSMIT:
+			{
+				cec_command frame;
+				cec_command::Format(frame, logicalAddress, action->to, action->opcode);
+				for (vector<uint8_t>::const_iterator b = action->parameters.begin(); b != action->parameters.end(); ++b) {
+					frame.parameters.PushBack(*b);
+				}
+				/* nobody is waiting for it, replies and key presses go first */
+				cec.transmit( frame, TransmitQueue::PRIORITY_LOW );
+				break;
+			}
+			case EventAction::ACTION_TIMER:
+				events->start(action->timer, now + action->delay);
+				break;
+			case EventAction::ACTION_CANCEL:
+				events->cancel(action->timer);
+				break;
+			case EventAction::ACTION_HOOK:
+				switch( action->hook )
+				{
+					case EventAction::HOOK_STANDBY:
+						if( ! onStandbyCommand.empty() )
+							runHook(Metrics::HOOK_STANDBY, "Standby", onStandbyCommand);
+						break;
+					case EventAction::HOOK_ACTIVATE:
+						if( ! onActivateCommand.empty() )
+							runHook(Metrics::HOOK_ACTIVATE, "Activate", onActivateCommand);
+						break;
+					case EventAction::HOOK_DEACTIVATE:
+						if( ! onDeactivateCommand.empty() )
+							runHook(Metrics::HOOK_DEACTIVATE, "Deactivate", onDeactivateCommand);
+						break;
+				}
+				break;
+			case EventAction::ACTION_RUN:
+				runHook(Metrics::HOOK_RUN, EventRules::eventName(event), action->command);
+				break;
+		}
+	}
+	return true;
 }
 
 void Main::push(Command cmd) {
+	Lane lane;
+	switch( cmd.command )
+	{
+		case COMMAND_KEY:
+		case COMMAND_KEYPRESS:
+		case COMMAND_FORWARD:
+			lane = LANE_INPUT;
+			break;
+		case COMMAND_RESTART:
+		case COMMAND_RELOAD:
+		case COMMAND_EXIT:
+			lane = LANE_MAINTENANCE;
+			break;
+		default:
+			lane = LANE_STATE;
+			break;
+	}
+
 	boost::lock_guard<boost::mutex> lock(libcec_sync);
 	if( running )
 	{
-		commands.push(cmd);
-		libcec_cond.notify_one();
+		size_t depth = 0;
+		for( int l = 0; l < LANE_MAX; l++ )
+			depth += commands[l].size();
+		Metrics::instance().queueDepth(depth);
+		if( commands[lane].push(cmd) )
+			libcec_cond.notify_one();
+		else
+			Metrics::instance().inc(Metrics::COMMANDS_DROPPED);
+	}
+}
+
+bool Main::laneReady(int lane) const {
+	if( commands[lane].empty() )
+		return false;
+
+	/* synthetic key presses wait until the previous one has been released */
+	return lane != LANE_INPUT || releaseAt == boost::chrono::steady_clock::time_point::max()
+		|| commands[lane].front().command != COMMAND_KEYPRESS;
+}
+
+bool Main::hasWork() const {
+	for( int lane = 0; lane < LANE_MAX; lane++ )
+	{
+		if( laneReady(lane) )
+			return true;
+	}
+	return false;
+}
+
+/**
+ * Picks the lane to run next, -1 if there is nothing to do. Called with libcec_sync held.
+ */
+int Main::nextLane() {
+	int next = -1;
+	for( int lane = 0; lane < LANE_MAX; lane++ )
+	{
+		if( ! laneReady(lane) )
+			continue;
+
+		/* strict priority, unless a lower lane has been passed over too often */
+		if( next < 0 || (passedOver[lane] >= laneStarvationLimit && passedOver[lane] > passedOver[next]) )
+			next = lane;
 	}
+
+	if( next >= 0 )
+	{
+		for( int lane = 0; lane < LANE_MAX; lane++ )
+		{
+			if( lane != next && laneReady(lane) )
+				passedOver[lane]++;
+		}
+		passedOver[next] = 0;
+	}
+	return next;
+}
+
+void Main::runHook(Metrics::Hook hook, const char *event, const string & command) {
+	LOG4CPLUS_DEBUG(logger, event << ": Running \"" << command << "\"");
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	int ret;
+	{
+		RealTime::Unpinned unpinned(realtime);
+		ret = system(command.c_str());
+	}
+	Metrics::instance().hook(hook, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+
+	if( ret )
+		LOG4CPLUS_ERROR(logger, event << " command failed: " << ret);
 }
 
 void Main::stop() {
@@ -206,6 +657,193 @@ void Main::restart() {
 	push(Command(COMMAND_RESTART));
 }
 
+void Main::reload() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::reload()");
+	push(Command(COMMAND_RELOAD));
+}
+
+/**
+ * Reads the settings again, and applies them if they are valid
+ */
+void Main::reloadSettings() {
+	if( ! settingsLoader )
+		return;
+
+	LOG4CPLUS_INFO(logger, "Reloading configuration");
+	notify.reloading();
+	try
+	{
+		applySettings(settingsLoader(), true);
+	}
+	catch( std::exception & e )
+	{
+		LOG4CPLUS_ERROR(logger, "Failed to reload configuration, keeping the previous one: " << e.what());
+	}
+	notify.ready();
+}
+
+/**
+ * Runs with next from now on. On reload only what changed is touched: the
+ * uinput device stays, and the adapter is only reopened when it or the port
+ * changed. Throws, before changing anything, if next isn't valid.
+ */
+void Main::applySettings(const Settings & next, bool reload) {
+	cec_user_control_code previousToggle = pointerToggle;
+	if( next.pointerKey.empty() )
+		pointerToggle = CEC_USER_CONTROL_CODE_UNKNOWN;
+	else if( ! setPointerKey(next.pointerKey) )
+		throw std::runtime_error("Unknown CEC key " + next.pointerKey);
+
+	/* the device is only a mouse too when there is a pointer mode */
+	try
+	{
+		uinput.setPointer(pointerToggle != CEC_USER_CONTROL_CODE_UNKNOWN);
+	}
+	catch( ... )
+	{
+		pointerToggle = previousToggle;
+		throw;
+	}
+
+	Settings previous = settings;
+	settings = next;
+
+	if( reload )
+	{
+		/* nothing stays held down by a key mapping that may be gone */
+		releaseAllKeys();
+	}
+
+	onStandbyCommand    = next.onStandby;
+	onActivateCommand   = next.onActivate;
+	onDeactivateCommand = next.onDeactivate;
+
+	if( reload && next.hookProcess != previous.hookProcess )
+	{
+		hookProcess.stop();
+		if( ! next.hookProcess.empty() )
+		{
+			RealTime::Unpinned unpinned(realtime);
+			hookProcess.start(next.hookProcess);
+		}
+	}
+	hookProcessCommand = next.hookProcess;
+
+	statusChanged = true;
+	if( ! next.keymap.empty() )
+	{
+		/* the mapping is only swapped once the whole file loaded */
+		if( ! loadKeyMappingFromFile(next.keymap) && reload )
+		{
+			LOG4CPLUS_WARN(logger, "Keeping the previous keymap");
+			settings.keymap = previous.keymap;
+		}
+	}
+	else if( ! previous.keymap.empty() )
+		const_cast<std::vector<list<uint16_t>>&>(uinputCecMap) = createDefaultUinputMap();
+
+	/* a file that fails to load on reload leaves the running rules alone */
+	std::shared_ptr<CommandRules> loadedRules = std::make_shared<CommandRules>();
+	loadedRules->loadDefaults();
+	if( next.rules.empty() || loadedRules->loadFromFile(next.rules) || ! reload )
+		std::atomic_store(&rules, std::shared_ptr<const CommandRules>(loadedRules));
+	else
+		LOG4CPLUS_WARN(logger, "Keeping the previous rules");
+
+	/* timers carry on, as long as the new rules still have them */
+	std::unique_ptr<EventRules> loadedEvents(new EventRules(&Main::keyCode));
+	if( next.events.empty() || loadedEvents->loadFromFile(next.events) || ! reload )
+	{
+		loadedEvents->adopt(*events);
+		events = std::move(loadedEvents);
+	}
+	else
+		LOG4CPLUS_WARN(logger, "Keeping the previous event rules");
+
+	std::shared_ptr<VendorDecoders> loadedDecoders = std::make_shared<VendorDecoders>();
+	if( next.vendors.empty() || loadedDecoders->load(next.vendors) || ! reload )
+		std::atomic_store(&vendorDecoders, std::shared_ptr<const VendorDecoders>(loadedDecoders));
+	else
+		LOG4CPLUS_WARN(logger, "Keeping the previous vendor decoders");
+
+	setCoalesceWindow(next.coalesce);
+	repeatLimiter.setLimit(next.repeatLimit, next.repeatBurst);
+	setMaxHold(next.maxHold);
+	pingInterval = boost::chrono::seconds(next.pingInterval);
+	cec.setBusBudget(next.busBudget);
+
+	timerSlack = next.timerSlack;
+	if( reload && next.timerSlack != previous.timerSlack )
+		applyTimerSlack();
+
+	bool reopen = reload && ! next.sameAdapter(previous);
+	if( next.hasPort && (! reload || reopen) )
+		cec.setTargetAddress(next.port);
+	else if( reopen && (previous.hasPort || portPinned) )
+		cec.resetTargetAddress();
+
+	if( reopen )
+	{
+		/* possibly on another bus, or another port */
+		topology.reset();
+		portPinned = false;
+	}
+
+	if( ! reload )
+	{
+		makeActive = next.activate;
+	}
+	else if( next.activate != previous.activate )
+	{
+		makeActive  = next.activate;
+		sourceSince = boost::chrono::steady_clock::now();
+		if( makeActive && ! reopen && ! activeSource.active() )
+		{
+			cec.makeActive();
+			activeSource.activated(true);
+		}
+	}
+
+	if( reopen )
+	{
+		LOG4CPLUS_INFO(logger, "Adapter settings changed, reopening the adapter");
+		push(Command(COMMAND_RESTART));
+	}
+}
+
+/**
+ * Gives libcec the port we were found on, unless one is configured, or
+ * takes it back when it turned out wrong
+ */
+void Main::pinDetectedPort() {
+	if( settings.hasPort )
+		return;
+
+	HDMI::address detected;
+	if( topology.ourPort(detected) )
+	{
+		if( ! portPinned )
+		{
+			LOG4CPLUS_INFO(logger, "Reopening on HDMI port " << detected << ", as detected before");
+			cec.setTargetAddress(detected);
+			portPinned = true;
+		}
+	}
+	else if( portPinned )
+	{
+		LOG4CPLUS_INFO(logger, "Reopening to detect the HDMI port again");
+		cec.resetTargetAddress();
+		portPinned = false;
+	}
+}
+
+void Main::applyTimerSlack() {
+	/* let the kernel coalesce our wakeups with others, 0 puts back its default */
+	unsigned long slack = timerSlack >= 0 ? (unsigned long) timerSlack * 1000000UL : 0;
+	if( prctl(PR_SET_TIMERSLACK, slack) < 0 )
+		LOG4CPLUS_WARN(logger, "Failed to set timer slack: " << strerror(errno));
+}
+
 void Main::listDevices() {
 	LOG4CPLUS_TRACE_STR(logger, "Main::listDevices()");
 	cec.listDevices(cout);
@@ -216,7 +854,7 @@ void Main::signalHandler(int sigNum) {
 	switch( sigNum )
 	{
 		case SIGHUP:
-			Main::instance().restart();
+			Main::instance().reload();
 			break;
 		default:
 			Main::instance().stop();
@@ -356,6 +994,8 @@ void Main::initializeKeyMaps() {
 		keyNameToCode["9"] = KEY_9;
 		keyNameToCode["BACKSPACE"] = KEY_BACKSPACE;
 		keyNameToCode["POWER"] = KEY_POWER;
+		keyNameToCode["SLEEP"] = KEY_SLEEP;
+		keyNameToCode["WAKEUP"] = KEY_WAKEUP;
 		keyNameToCode["CHANNELUP"] = KEY_CHANNELUP;
 		keyNameToCode["CHANNELDOWN"] = KEY_CHANNELDOWN;
 		keyNameToCode["PAGEUP"] = KEY_PAGEUP;
@@ -449,6 +1089,17 @@ void Main::initializeKeyMaps() {
 	}
 }
 
+bool Main::keyCode(const string& name, uint16_t& code) {
+	initializeKeyMaps();
+
+	map<string, uint16_t>::const_iterator it = keyNameToCode.find(name);
+	if( it == keyNameToCode.end() )
+		return false;
+
+	code = it->second;
+	return true;
+}
+
 bool Main::loadKeyMappingFromFile(const string& filename) {
 	LOG4CPLUS_INFO(logger, "Loading key mapping from: " << filename);
 	
@@ -461,7 +1112,7 @@ bool Main::loadKeyMappingFromFile(const string& filename) {
 	}
 
 	// Create a new mapping based on the default
-	static std::vector<list<uint16_t>> customUinputCecMap = createDefaultUinputMap();
+	std::vector<list<uint16_t>> customUinputCecMap = createDefaultUinputMap();
 	
 	string line;
 	int lineNumber = 0;
@@ -530,6 +1181,101 @@ bool Main::loadKeyMappingFromFile(const string& filename) {
 	}
 }
 
+/**
+ * Loads the keys forwarded from local input devices, as UINPUT_KEY=CEC_KEY[@ADDR]
+ * lines, ADDR being the device to send the key to (AUDIO if not given)
+ */
+bool Main::loadForwardMapFromFile(const string& filename) {
+	LOG4CPLUS_INFO(logger, "Loading forwarded keys from: " << filename);
+
+	initializeKeyMaps();
+
+	std::ifstream file(filename.c_str());
+	if (!file.is_open()) {
+		LOG4CPLUS_ERROR(logger, "Failed to open forwarded key file: " << filename);
+		return false;
+	}
+
+	string line;
+	int lineNumber = 0;
+	int mappingsLoaded = 0;
+
+	while (std::getline(file, line)) {
+		lineNumber++;
+
+		// Trim whitespace, skip empty lines and comments
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		size_t equalPos = line.find('=');
+		if (equalPos == string::npos) {
+			LOG4CPLUS_WARN(logger, "Invalid line " << lineNumber << " in " << filename << ": " << line);
+			continue;
+		}
+
+		string uinputKeyName = line.substr(0, equalPos);
+		string cecKeyName = line.substr(equalPos + 1);
+		string addressName = "AUDIO";
+
+		size_t atPos = cecKeyName.find('@');
+		if (atPos != string::npos) {
+			addressName = cecKeyName.substr(atPos + 1);
+			cecKeyName.erase(atPos);
+		}
+
+		uinputKeyName.erase(uinputKeyName.find_last_not_of(" \t") + 1);
+		cecKeyName.erase(0, cecKeyName.find_first_not_of(" \t"));
+		cecKeyName.erase(cecKeyName.find_last_not_of(" \t") + 1);
+
+		map<string, uint16_t>::const_iterator uinputIt = keyNameToCode.find(uinputKeyName);
+		if (uinputIt == keyNameToCode.end()) {
+			LOG4CPLUS_WARN(logger, "Unknown uinput key '" << uinputKeyName << "' on line " << lineNumber);
+			continue;
+		}
+
+		map<string, cec_user_control_code>::const_iterator cecIt = cecKeyNameToCode.find(cecKeyName);
+		if (cecIt == cecKeyNameToCode.end()) {
+			LOG4CPLUS_WARN(logger, "Unknown CEC key '" << cecKeyName << "' on line " << lineNumber);
+			continue;
+		}
+
+		cec_logical_address address;
+		if (!CommandRules::parseAddress(addressName, address)) {
+			LOG4CPLUS_WARN(logger, "Unknown address '" << addressName << "' on line " << lineNumber);
+			continue;
+		}
+
+		forwarder.map(uinputIt->second, cecIt->second, address);
+		mappingsLoaded++;
+		LOG4CPLUS_DEBUG(logger, "Forwarding " << uinputKeyName << " as " << cecKeyName << " to " << addressName);
+	}
+
+	if (mappingsLoaded == 0) {
+		LOG4CPLUS_ERROR(logger, "No valid forwarded keys found in " << filename);
+		return false;
+	}
+	LOG4CPLUS_INFO(logger, "Loaded " << mappingsLoaded << " forwarded keys from " << filename);
+	return true;
+}
+
+/**
+ * The keys the uinput device is created with: the default ones, and every
+ * key a key mapping may use, so a reloaded mapping works on the same device
+ */
+std::vector<list<uint16_t>> Main::uinputKeys() {
+	initializeKeyMaps();
+
+	std::vector<list<uint16_t>> keys = uinputCecMap;
+	list<uint16_t> mappable;
+	for (map<string, uint16_t>::const_iterator it = keyNameToCode.begin(); it != keyNameToCode.end(); ++it)
+		mappable.push_back(it->second);
+	keys.push_back(mappable);
+	return keys;
+}
+
 std::vector<list<uint16_t>> Main::createDefaultUinputMap() {
 	std::vector<list<uint16_t>> defaultMap;
 	defaultMap.resize(CEC_USER_CONTROL_CODE_MAX + 1, {});
@@ -619,13 +1365,135 @@ std::vector<list<uint16_t>> Main::createDefaultUinputMap() {
 	return defaultMap;
 }
 
+void Main::onCecTraffic() {
+	lastTraffic.store(boost::chrono::steady_clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+}
+
+boost::chrono::steady_clock::time_point Main::lastTrafficTime() const {
+	return boost::chrono::steady_clock::time_point(boost::chrono::steady_clock::duration(lastTraffic.load(std::memory_order_relaxed)));
+}
+
 int Main::onCecLogMessage(const cec_log_message &message) {
+	onCecTraffic();
 	LOG4CPLUS_DEBUG(logger, "Main::onCecLogMessage(" << message << ")");
 	return 1;
 }
 
 int Main::onCecKeyPress(const cec_keypress &key) {
 	LOG4CPLUS_DEBUG(logger, "Main::onCecKeyPress(" << key << ")");
+	Metrics::instance().key(key.keycode);
+	onCecTraffic();
+
+	/* uinput is only written from the main loop */
+	push(Command(COMMAND_KEY, key));
+	return 1;
+}
+
+void Main::releaseKeys() {
+	if( releaseAt == boost::chrono::steady_clock::time_point::max() )
+		return;
+
+	// Not retried on failure, the stuck key watchdog releases what is still held
+	try {
+		for (const uint16_t *ukeys = lastUInputKeys.begin(); ukeys != lastUInputKeys.end(); ++ukeys) {
+			LOG4CPLUS_DEBUG(logger, "release " << *ukeys);
+			uinput.send_event(EV_KEY, *ukeys, EV_KEY_RELEASED);
+		}
+		uinput.sync();
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to release keys: " << e.what());
+	}
+
+	lastUInputKeys.clear();
+	releaseAt = boost::chrono::steady_clock::time_point::max();
+}
+
+void Main::releaseStuckKeys(boost::chrono::steady_clock::time_point now) {
+	try {
+		size_t released = uinput.releaseStuck(now, maxHold);
+		if( released )
+		{
+			Metrics::instance().inc(Metrics::STUCK_KEYS_RELEASED, released);
+			lastUInputKeys.clear();
+			releaseAt = boost::chrono::steady_clock::time_point::max();
+		}
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to release stuck keys: " << e.what());
+	}
+}
+
+void Main::releaseAllKeys() {
+	try {
+		pointer.reset();
+		uinput.releaseAll();
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to release keys: " << e.what());
+	}
+	lastUInputKeys.clear();
+	releaseAt = boost::chrono::steady_clock::time_point::max();
+}
+
+/**
+ * Handles the pointer mode toggle, and the keys that drive the pointer while
+ * in pointer mode. Returns false for keys that are sent on as usual.
+ */
+bool Main::pointerKey(const cec_keypress &key) {
+	if( pointerToggle == CEC_USER_CONTROL_CODE_UNKNOWN )
+		return false;
+
+	if( key.keycode == pointerToggle )
+	{
+		/* toggled on release, as the press may repeat */
+		if( key.duration != 0 )
+		{
+			releaseAllKeys();
+			pointer.toggle();
+		}
+		return true;
+	}
+
+	return pointer.enabled() && pointer.key(key.keycode, key.duration == 0, boost::chrono::steady_clock::now());
+}
+
+/**
+ * Sends the media keys to the MPRIS player while there is one, repeats and
+ * the release of a key that went there go nowhere. Returns false for keys
+ * that are sent on as usual.
+ */
+bool Main::mprisKey(const cec_keypress &key) {
+	if( key.keycode == mprisHeld )
+	{
+		if( key.duration != 0 )
+			mprisHeld = CEC_USER_CONTROL_CODE_UNKNOWN;
+		return true;
+	}
+	mprisHeld = CEC_USER_CONTROL_CODE_UNKNOWN;
+
+	if( ! mpris.handles(key.keycode) )
+		return false;
+
+	/* a release alone means the press was missed */
+	releaseKeys();
+	mpris.post(key.keycode);
+	if( key.duration == 0 )
+		mprisHeld = key.keycode;
+	return true;
+}
+
+bool Main::setPointerKey(const string &name) {
+	initializeKeyMaps();
+
+	map<string, cec_user_control_code>::const_iterator it = cecKeyNameToCode.find(name);
+	if( it == cecKeyNameToCode.end() )
+		return false;
+
+	pointerToggle = it->second;
+	return true;
+}
+
+void Main::sendKey(const cec_keypress &key) {
+	/* a press that is still held for a while is released before anything else */
+	releaseKeys();
 
 	// Enhanced logging: Show human-readable key name and mapping info
 	std::map<cec_user_control_code, const char *>::const_iterator keyNameIt = Cec::cecUserControlCodeName.find(key.keycode);
@@ -640,7 +1508,8 @@ int Main::onCecKeyPress(const cec_keypress &key) {
 		// Log the mapping information
 		if (uinputKeys.empty()) {
 			LOG4CPLUS_DEBUG(logger, "  -> No mapping defined for this key");
-		} else {
+		} else if (logger.isEnabledFor(DEBUG_LOG_LEVEL)) {
+			// Only built when it is going to be logged, this is the key path
 			string mappingInfo = "  -> Mapped to uinput keys: ";
 			bool first = true;
 			for (std::list<uint16_t>::const_iterator ukeys = uinputKeys.begin(); ukeys != uinputKeys.end(); ++ukeys) {
@@ -653,11 +1522,14 @@ int Main::onCecKeyPress(const cec_keypress &key) {
 
 		if ( !uinputKeys.empty() ) {
 			if( key.duration == 0 ) {
-				if( uinputKeys == lastUInputKeys )
+				if( lastUInputKeys == uinputKeys )
 				{
 					/*
 					** KEY REPEAT
 					*/
+					if( ! repeatLimiter.repeat(key.keycode, boost::chrono::steady_clock::now()) )
+						return;
+
 					for (std::list<uint16_t>::const_iterator ukeys = uinputKeys.begin(); ukeys != uinputKeys.end(); ++ukeys) {
 						uint16_t ukey = *ukeys;
 
@@ -674,7 +1546,7 @@ int Main::onCecKeyPress(const cec_keypress &key) {
 					if( ! lastUInputKeys.empty() )
 					{
 						/* what happened with the last key release ? */
-						for (std::list<uint16_t>::const_iterator ukeys = lastUInputKeys.begin(); ukeys != lastUInputKeys.end(); ++ukeys) {
+						for (const uint16_t *ukeys = lastUInputKeys.begin(); ukeys != lastUInputKeys.end(); ++ukeys) {
 							uint16_t ukey = *ukeys;
 
 							LOG4CPLUS_DEBUG(logger, "release " << ukey);
@@ -689,14 +1561,15 @@ int Main::onCecKeyPress(const cec_keypress &key) {
 
 						uinput.send_event(EV_KEY, ukey, EV_KEY_PRESSED);
 					}
-					lastUInputKeys = uinputKeys;
+					lastUInputKeys.assign(uinputKeys);
+					repeatLimiter.pressed(key.keycode, boost::chrono::steady_clock::now());
 				}
 			}
 			else {
 				if( lastUInputKeys != uinputKeys ) {
 					if( ! lastUInputKeys.empty() ) {
 						/* what happened with the last key release ? */
-						for (std::list<uint16_t>::const_iterator ukeys = lastUInputKeys.begin(); ukeys != lastUInputKeys.end(); ++ukeys) {
+						for (const uint16_t *ukeys = lastUInputKeys.begin(); ukeys != lastUInputKeys.end(); ++ukeys) {
 							uint16_t ukey = *ukeys;
 
 							LOG4CPLUS_DEBUG(logger, "release " << ukey);
@@ -711,7 +1584,12 @@ int Main::onCecKeyPress(const cec_keypress &key) {
 
 						uinput.send_event(EV_KEY, ukey, EV_KEY_PRESSED);
 					}
-					boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+					uinput.sync();
+
+					/* missed the press, so hold it for a while rather than blocking the loop */
+					lastUInputKeys.assign(uinputKeys);
+					releaseAt = boost::chrono::steady_clock::now() + keyPressDuration;
+					return;
 				}
 				/*
 				** KEY RELEASED
@@ -725,6 +1603,7 @@ int Main::onCecKeyPress(const cec_keypress &key) {
 
 				}
 				lastUInputKeys.clear();
+				repeatLimiter.released(key.keycode);
 			}
 			uinput.sync();
 		}
@@ -732,8 +1611,6 @@ int Main::onCecKeyPress(const cec_keypress &key) {
 	else {
 		LOG4CPLUS_WARN(logger, "CEC Key code " << key.keycode << " is outside valid range (0-" << CEC_USER_CONTROL_CODE_MAX << ")");
 	}
-
-	return 1;
 }
 
 int Main::onCecKeyPress(const cec_user_control_code & keycode) {
@@ -741,81 +1618,244 @@ int Main::onCecKeyPress(const cec_user_control_code & keycode) {
 
 	/* PUSH KEY */
 	key.duration = 0;
-	onCecKeyPress( key );
-
-	/* simulate delay */
-	key.duration = 100;
-	boost::this_thread::sleep(boost::posix_time::milliseconds(key.duration));
+	sendKey( key );
 
-	/* RELEASE KEY */
-	onCecKeyPress( key );
+	/* RELEASE KEY, later on from the main loop */
+	if( ! lastUInputKeys.empty() )
+		releaseAt = boost::chrono::steady_clock::now() + keyPressDuration;
 
 	return 1;
 }
 
 int Main::onCecCommand(const cec_command & command) {
 	LOG4CPLUS_DEBUG(logger, "Main::onCecCommand(" << command << ")");
+	Metrics::instance().opcode(command.opcode);
+	onCecTraffic();
+	cec.observed(command);
+	activeSource.observed(command);
+	topology.observed(command);
+	statusObserved(command);
+
+	if( command.opcode == CEC_OPCODE_DEVICE_VENDOR_ID && command.parameters.size >= 3 )
+	{
+		int address = command.initiator & 0xF;
+		vendorIds[address] = (uint32_t) command.parameters[0] << 16
+			| (uint32_t) command.parameters[1] << 8 | command.parameters[2];
+
+		/* the button that made us ask, unless the answer took so long it would be a surprise */
+		boost::chrono::steady_clock::time_point asked = vendorPendingAt[address];
+		vendorPendingAt[address] = boost::chrono::steady_clock::time_point();
+		if( asked != boost::chrono::steady_clock::time_point() && boost::chrono::steady_clock::now() - asked < boost::chrono::seconds(1)
+			&& ! decodeVendorCommand(vendorPending[address]) )
+			LOG4CPLUS_DEBUG(logger, "No vendor decoder for " << vendorPending[address]);
+	}
+
+	if( ! std::atomic_load(&vendorDecoders)->empty() && decodeVendorCommand(command) )
+		return 1;
+
+	/* held on to, a reload may swap the rules meanwhile */
+	std::shared_ptr<const CommandRules> current = std::atomic_load(&rules);
+	const CommandRule * rule = current->match(command, logicalAddress, makeActive);
+	if( rule )
+	{
+		LOG4CPLUS_TRACE(logger, "  -> matched rule on line " << rule->line);
+		runAction(rule->action, command);
+	}
+	return 1;
+}
+
+/**
+ * Follows the TV's power and the active source for the status page
+ */
+void Main::statusObserved(const cec_command & command) {
+	if( ! statusPage.enabled() || ! command.opcode_set )
+		return;
+
+	int power = tvPower;
 	switch( command.opcode )
 	{
 		case CEC_OPCODE_STANDBY:
-			if( (command.initiator == CECDEVICE_TV)
-                         && ( (command.destination == CECDEVICE_BROADCAST) || (command.destination == logicalAddress))  )
+			if( command.initiator == CECDEVICE_TV )
+				power = CEC_DAEMON_STATUS_POWER_STANDBY;
+			break;
+		case CEC_OPCODE_REPORT_POWER_STATUS:
+			if( command.initiator == CECDEVICE_TV && command.parameters.size >= 1 )
+				power = command.parameters[0] == CEC_POWER_STATUS_ON || command.parameters[0] == CEC_POWER_STATUS_IN_TRANSITION_STANDBY_TO_ON
+					? CEC_DAEMON_STATUS_POWER_ON : CEC_DAEMON_STATUS_POWER_STANDBY;
+			break;
+		case CEC_OPCODE_ACTIVE_SOURCE:
+		case CEC_OPCODE_SET_STREAM_PATH:
+		case CEC_OPCODE_ROUTING_CHANGE:
+		case CEC_OPCODE_REPORT_PHYSICAL_ADDRESS:
+		case CEC_OPCODE_USER_CONTROL_PRESSED:
+			/* a TV switching inputs, announcing itself as it wakes up or passing on keys is on */
+			if( command.initiator == CECDEVICE_TV )
+				power = CEC_DAEMON_STATUS_POWER_ON;
+			break;
+		default:
+			return;
+	}
+	tvPower = power;
+
+	/* published from the main loop, which may be waiting */
+	statusChanged = true;
+	boost::lock_guard<boost::mutex> lock(libcec_sync);
+	libcec_cond.notify_one();
+}
+
+/**
+ * Copies the daemon's state to the status page, only called from the main loop
+ */
+void Main::publishStatus() {
+	if( ! statusPage.enabled() )
+		return;
+
+	status.state            = running ? CEC_DAEMON_STATUS_OPEN : CEC_DAEMON_STATUS_CLOSED;
+	status.active           = activeSource.active();
+	status.tv_power         = tvPower;
+	status.logical_address  = logicalAddress == CECDEVICE_UNKNOWN ? CECDEVICE_BROADCAST : logicalAddress;
+	status.physical_address = activeSource.getPhysicalAddress();
+	memset(status.keymap, 0, sizeof(status.keymap));
+	settings.keymap.copy(status.keymap, sizeof(status.keymap) - 1);
+	statusPage.publish(status);
+}
+
+void Main::forwardKey(cec_logical_address destination, cec_user_control_code key) {
+	/* the adapter is only used from the main loop */
+	cec_command frame;
+	cec_command::Format(frame, logicalAddress, destination, CEC_OPCODE_USER_CONTROL_PRESSED);
+	frame.parameters.PushBack((uint8_t) key);
+	push(Command(COMMAND_FORWARD, frame));
+}
+
+/**
+ * Turns vendor specific remote frames into key presses, returns false if the
+ * frame isn't one or isn't known. The first frame from a device whose vendor
+ * is unknown makes the main loop ask it, and is decoded once it answered.
+ */
+bool Main::decodeVendorCommand(const cec_command & command) {
+	VendorDecoders::Kind kind;
+	uint32_t vendor = vendorIds[command.initiator & 0xF];
+	const uint8_t *payload = command.parameters.data;
+	size_t size = command.parameters.size;
+
+	switch( command.opcode )
+	{
+		case CEC_OPCODE_VENDOR_REMOTE_BUTTON_DOWN:
+			kind = VendorDecoders::KIND_BUTTON;
+			break;
+		case CEC_OPCODE_VENDOR_REMOTE_BUTTON_UP:
+			if( vendorButton == CEC_USER_CONTROL_CODE_UNKNOWN )
+				return false;
 			{
-				push(Command(COMMAND_STANDBY));
+				cec_keypress key;
+				key.keycode  = (cec_user_control_code) vendorButton.exchange(CEC_USER_CONTROL_CODE_UNKNOWN);
+				key.duration = 1;
+				push(Command(COMMAND_KEY, key));
 			}
+			return true;
+		case CEC_OPCODE_VENDOR_COMMAND:
+			kind = VendorDecoders::KIND_COMMAND;
 			break;
-		case CEC_OPCODE_REQUEST_ACTIVE_SOURCE:
-			if( (command.initiator == CECDEVICE_TV)
-                         && ( (command.destination == CECDEVICE_BROADCAST) || (command.destination == logicalAddress))  )
-			{
-                if( makeActive )
-                {
-                    /* remind TV we are active */
-                    push(Command(COMMAND_ACTIVE));
-                }
+		case CEC_OPCODE_VENDOR_COMMAND_WITH_ID:
+			/* carries its own vendor ID */
+			if( size < 3 )
+				return false;
+			kind   = VendorDecoders::KIND_COMMAND_WITH_ID;
+			vendor = (uint32_t) payload[0] << 16 | (uint32_t) payload[1] << 8 | payload[2];
+			payload += 3;
+			size    -= 3;
+			break;
+		default:
+			return false;
+	}
+
+	if( vendor == CEC_VENDOR_UNKNOWN )
+	{
+		/* asked once per open, a device that never answers isn't asked again for every button */
+		int address = command.initiator & 0xF;
+		if( vendorAsked[address].exchange(true) )
+			return false;
+
+		vendorPending[address]   = command;
+		vendorPendingAt[address] = boost::chrono::steady_clock::now();
+		push(Command(COMMAND_VENDOR, command));
+		return true;
+	}
+
+	cec_user_control_code keycode = std::atomic_load(&vendorDecoders)->decode(vendor, kind, payload, size);
+	if( keycode == CEC_USER_CONTROL_CODE_UNKNOWN )
+		return false;
+
+	LOG4CPLUS_DEBUG(logger, "  -> vendor " << std::hex << vendor << std::dec << " key " << keycode);
+	if( kind == VendorDecoders::KIND_BUTTON )
+	{
+		/* held until VENDOR_REMOTE_BUTTON_UP */
+		cec_keypress key;
+		key.keycode  = keycode;
+		key.duration = 0;
+		vendorButton = keycode;
+		push(Command(COMMAND_KEY, key));
+	}
+	else
+	{
+		push(Command(COMMAND_KEYPRESS, keycode));
+	}
+	return true;
+}
+
+void Main::runAction(const RuleAction & action, const cec_command & command) {
+	switch( action.type )
+	{
+		case RuleAction::ACTION_IGNORE:
+			break;
+		case RuleAction::ACTION_KEY:
+		case RuleAction::ACTION_MACRO:
+			for (vector<cec_user_control_code>::const_iterator key = action.keys.begin(); key != action.keys.end(); ++key) {
+				push(Command(COMMAND_KEYPRESS, *key));
 			}
-		case CEC_OPCODE_SET_MENU_LANGUAGE:
-			if( (command.initiator == CECDEVICE_TV) && (command.parameters.size == 3)
-                         && ( (command.destination == CECDEVICE_BROADCAST) || (command.destination == logicalAddress))  )
+			break;
+		case RuleAction::ACTION_HOOK:
+			switch( action.hook )
 			{
-				/* TODO */
+				case RuleAction::HOOK_STANDBY:    push(Command(COMMAND_STANDBY));  break;
+				case RuleAction::HOOK_ACTIVATE:   push(Command(COMMAND_ACTIVE));   break;
+				case RuleAction::HOOK_DEACTIVATE: push(Command(COMMAND_INACTIVE)); break;
 			}
 			break;
-		case CEC_OPCODE_DECK_CONTROL:
-			if( (command.initiator == CECDEVICE_TV) && (command.parameters.size == 1)
-                         && ( (command.destination == CECDEVICE_BROADCAST) || (command.destination == logicalAddress))  )
-			{
-				if( command.parameters[0] == CEC_DECK_CONTROL_MODE_STOP ) {
-					push(Command(COMMAND_KEYPRESS, CEC_USER_CONTROL_CODE_STOP));
-				}
-				else if( command.parameters[0] == CEC_DECK_CONTROL_MODE_SKIP_FORWARD_WIND ) {
-					push(Command(COMMAND_KEYPRESS, CEC_USER_CONTROL_CODE_FAST_FORWARD));
-				}
-				else if( command.parameters[0] == CEC_DECK_CONTROL_MODE_SKIP_REVERSE_REWIND ) {
-					push(Command(COMMAND_KEYPRESS, CEC_USER_CONTROL_CODE_REWIND));
-				}
+		case RuleAction::ACTION_REPLY:
+		{
+			/* transmitting from within a libcec callback may block it, leave it to the main loop */
+			cec_command reply;
+			cec_command::Format(reply, logicalAddress,
+				action.replyTo == CECDEVICE_UNKNOWN ? command.initiator : action.replyTo,
+				action.replyOpcode);
+			for (vector<uint8_t>::const_iterator b = action.replyParameters.begin(); b != action.replyParameters.end(); ++b) {
+				reply.parameters.PushBack(*b);
 			}
+			push(Command(COMMAND_TRANSMIT, reply));
 			break;
-		case CEC_OPCODE_PLAY:
-			if( (command.initiator == CECDEVICE_TV) && (command.parameters.size == 1)
-                         && ( (command.destination == CECDEVICE_BROADCAST) || (command.destination == logicalAddress))  )
+		}
+		case RuleAction::ACTION_ANNOUNCE:
+			/* only the active source answers, and we know whether that's us without asking */
+			if( activeSource.active() )
 			{
-				if( command.parameters[0] == CEC_PLAY_MODE_PLAY_FORWARD ) {
-					push(Command(COMMAND_KEYPRESS, CEC_USER_CONTROL_CODE_PLAY));
-				}
-				else if( command.parameters[0] == CEC_PLAY_MODE_PLAY_STILL ) {
-					push(Command(COMMAND_KEYPRESS, CEC_USER_CONTROL_CODE_PAUSE));
-				}
+				uint16_t physical = activeSource.getPhysicalAddress();
+				cec_command announce;
+				cec_command::Format(announce, logicalAddress, CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE);
+				announce.parameters.PushBack((uint8_t) (physical >> 8));
+				announce.parameters.PushBack((uint8_t) (physical & 0xFF));
+				push(Command(COMMAND_TRANSMIT, announce));
+				push(Command(COMMAND_ACTIVE));
 			}
 			break;
-		default:
-			break;
 	}
-	return 1;
 }
 
 int Main::onCecAlert(const CEC::libcec_alert alert, const CEC::libcec_parameter & param) {
 	LOG4CPLUS_ERROR(logger, "Main::onCecAlert(alert=" << alert << ")");
+	Metrics::instance().alert(alert);
+	onCecTraffic();
 	switch( alert )
 	{
 		case CEC_ALERT_SERVICE_DEVICE:
@@ -836,21 +1876,29 @@ int Main::onCecAlert(const CEC::libcec_alert alert, const CEC::libcec_parameter
 int Main::onCecConfigurationChanged(const libcec_configuration & configuration) {
 	//LOG4CPLUS_DEBUG(logger, "Main::onCecConfigurationChanged(" << configuration << ")");
 	LOG4CPLUS_DEBUG(logger, "Main::onCecConfigurationChanged(logicalAddress=" << configuration.logicalAddresses.primary << ")");
+	onCecTraffic();
 	logicalAddress = configuration.logicalAddresses.primary;
+	activeSource.setPhysicalAddress(configuration.iPhysicalAddress);
+	topology.setOurAddress(logicalAddress, configuration.iPhysicalAddress);
+	if( logicalAddress != CECDEVICE_UNKNOWN )
+		StartupProfile::instance().end(StartupProfile::PHASE_NEGOTIATE);
 	return 1;
 }
 
 
 int Main::onCecMenuStateChanged(const cec_menu_state & menu_state) {
 	LOG4CPLUS_DEBUG(logger, "Main::onCecMenuStateChanged(" << menu_state << ")");
+	onCecTraffic();
 
 	return onCecKeyPress(CEC_USER_CONTROL_CODE_CONTENTS_MENU);
 }
 
 void Main::onCecSourceActivated(const cec_logical_address & address, bool bActivated) {
 	LOG4CPLUS_DEBUG(logger, "Main::onCecSourceActivated(logicalAddress " << address << " = " << bActivated << ")");
+	onCecTraffic();
 	if( logicalAddress == address )
 	{
+		activeSource.activated(bActivated);
 		push(Command(bActivated ? COMMAND_ACTIVE : COMMAND_INACTIVE));
 	}
 }
@@ -884,14 +1932,76 @@ template<class T> typed_value_name<T> *value(T *my_value = new T()) { return new
 
 #endif
 
+namespace po = boost::program_options;
+
+/**
+ * Parses the command line, then the --config file. The first value stored
+ * for an option is kept, so the command line overrides the file.
+ */
+static void parseOptions(int argc, char *argv[], const po::options_description & desc,
+		const po::positional_options_description & p, po::variables_map & vm) {
+	po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+	if (vm.count("config")) {
+		po::store(po::parse_config_file<char>(vm["config"].as< string >().c_str(), desc), vm);
+	}
+	po::notify(vm);
+}
+
+static string stringOption(const po::variables_map & vm, const char *name) {
+	return vm.count(name) ? vm[name].as< string >() : string();
+}
+
+/**
+ * The options SIGHUP applies again, see Settings
+ */
+static Settings readSettings(const po::variables_map & vm) {
+	Settings settings;
+
+	settings.activate = !vm.count("donotactivate");
+	settings.adapter  = stringOption(vm, "usb");
+	if (vm.count("port")) {
+		settings.port    = vm["port"].as< HDMI::address >();
+		/* 0 asks for autodetection, just like no port at all */
+		settings.hasPort = (uint16_t) settings.port.physical != 0 || settings.port.logical != CECDEVICE_UNKNOWN;
+	}
+
+	settings.onStandby    = stringOption(vm, "onstandby");
+	settings.onActivate   = stringOption(vm, "onactivate");
+	settings.onDeactivate = stringOption(vm, "ondeactivate");
+	settings.hookProcess  = stringOption(vm, "hook-process");
+	settings.keymap       = stringOption(vm, "keymap");
+	settings.rules        = stringOption(vm, "rules");
+	settings.events       = stringOption(vm, "events");
+	settings.vendors      = stringOption(vm, "vendors");
+	settings.pointerKey   = stringOption(vm, "pointer-key");
+
+	settings.coalesce     = vm["coalesce"].as< int >();
+	settings.maxHold      = vm["max-hold"].as< int >();
+	settings.repeatLimit  = vm["repeat-limit"].as< int >();
+	settings.repeatBurst  = vm["repeat-burst"].as< int >();
+	settings.pingInterval = vm["ping-interval"].as< int >();
+
+	settings.busBudget = vm["bus-budget"].as< int >();
+	if (settings.busBudget < 1 || settings.busBudget > 100) {
+		throw std::runtime_error("--bus-budget must be between 1 and 100");
+	}
+
+	if (vm.count("timer-slack")) {
+		settings.timerSlack = vm["timer-slack"].as< int >();
+	}
+	return settings;
+}
+
 int main (int argc, char *argv[]) {
 
-    BasicConfigurator config;
-    config.configure();
+    /* startup phases are timed from here */
+    StartupProfile::instance();
 
-    int loglevel = 0;
+    /* logging never blocks the threads that log, the queue writes it out */
+    LogQueue *logQueue = new LogQueue(STDOUT_FILENO);
+    Logger::getRoot().addAppender(SharedAppenderPtr(logQueue));
 
-	namespace po = boost::program_options;
+    int loglevel = 0;
 
 	po::options_description desc("Allowed options");
 	desc.add_options()
@@ -901,14 +2011,42 @@ int main (int argc, char *argv[]) {
 	    ("list,l",    "list available CEC adapters and devices")
 	    ("verbose,v", accumulator<int>(&loglevel)->implicit_value(1), "verbose output (use -vv for more)")
 	    ("quiet,q",   "quiet output (print almost nothing)")
+	    ("config,c", value<string>()->value_name("<file>"), "read options from file, read again on SIGHUP")
 	    ("donotactivate,a", "do not activate device on startup")
 	    ("keymap,k", value<string>()->value_name("<file>"), "load key mapping from file")
+	    ("vendors", value<string>()->value_name("<path>"), "load vendor remote decoders from a file or directory")
+	    ("rules", value<string>()->value_name("<file>"), "load CEC command rules from file")
+	    ("events", value<string>()->value_name("<file>"), "load event rules from file, run instead of the hooks")
+	    ("metrics", value<string>()->value_name("<port|path>"), "serve Prometheus metrics on a loopback port or unix socket")
+	    ("flight-recorder", value<size_t>()->value_name("<MB>"), "keep the last MB of CEC traffic in memory, dumped on SIGUSR2 or crash")
+	    ("flight-recorder-file", value<string>()->value_name("<path>")->default_value("/run/libcec-daemon/flight-recorder.rec"), "where to dump the flight recorder")
+	    ("decode", value<string>()->value_name("<path>"), "print a flight recorder dump (and exit)")
+	    ("status-page", value<string>()->value_name("<path>")->implicit_value(CEC_DAEMON_STATUS_PATH), "publish the daemon's state in this file, for --status and other readers")
+	    ("status", "print the state published by a running daemon (and exit)")
+	    ("startup-profile", value<string>()->value_name("<file>")->implicit_value(""), "log how long each startup phase took, and write them to file as a Chrome trace")
+	    ("simulate", value<string>()->value_name("<scenario>"), "run the scenario on a simulated CEC bus instead of an adapter, exit 1 if it fails")
 
 	    ("onstandby", value<string>()->value_name("<path>"),  "command to run on standby")
 	    ("onactivate", value<string>()->value_name("<path>"),  "command to run on activation")
 	    ("ondeactivate", value<string>()->value_name("<path>"),  "command to run on deactivation")
+	    ("hook-process", value<string>()->value_name("<cmd>"),  "long running command that is sent events on its stdin")
+	    ("max-hold", value<int>()->value_name("<ms>")->default_value(10000), "release keys not pressed or repeated for this long (0 to never)")
+	    ("forward", value< vector<string> >()->value_name("<device>")->composing(), "grab an input device and send its volume keys over CEC (repeatable)")
+	    ("forward-socket", value<string>()->value_name("<path>"), "also send keys written as input events to this unix socket over CEC")
+	    ("forward-keymap", value<string>()->value_name("<file>"), "load the keys to send over CEC from file")
+	    ("mpris", value<string>()->value_name("<bus>")->implicit_value("session"), "send PLAY, PAUSE, STOP, FORWARD and BACKWARD to the active MPRIS player on the session bus, or the bus at this D-Bus address")
+	    ("pointer-key", value<string>()->value_name("<key>"), "CEC key that toggles driving a mouse pointer with the arrow keys")
+	    ("coalesce", value<int>()->value_name("<ms>")->default_value(500), "collapse standby and activation changes this close together (0 to disable)")
+	    ("repeat-limit", value<int>()->value_name("<n>")->default_value(20), "leave out key repeats beyond this many a second per key (0 to disable)")
+	    ("repeat-burst", value<int>()->value_name("<n>")->default_value(10), "key repeats let through at once before --repeat-limit applies")
 	    ("port,p", value<HDMI::address>()->value_name("[a[.b.c.d]>"),  "HDMI port A or address A.B.C.D (overrides autodetected value)")
 	    ("usb", value<string>()->value_name("<path>"), "USB adapter path (as shown by --list)")
+	    ("ping-interval", value<int>()->value_name("<s>")->default_value(43), "ping the adapter after this long without traffic (0 to never ping)")
+	    ("bus-budget", value<int>()->value_name("<%>")->default_value(50), "hold our commands back while the bus was busy for this much of the last second")
+	    ("timer-slack", value<int>()->value_name("<ms>"), "timer slack, lets the kernel batch our wakeups with others")
+	    ("realtime", value<int>()->value_name("<prio>"), "lock memory and dispatch keys at this real-time priority")
+	    ("realtime-policy", value<string>()->value_name("<fifo|rr>")->default_value("fifo"), "real-time scheduling policy")
+	    ("cpu", value<int>()->value_name("<n>"), "pin key dispatching to this CPU")
 	;
 
 	po::positional_options_description p;
@@ -917,7 +2055,7 @@ int main (int argc, char *argv[]) {
     po::variables_map vm;
     try
     {
-        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+        parseOptions(argc, argv, desc, p, vm);
     }
     catch( po::error &e )
     {
@@ -925,7 +2063,6 @@ int main (int argc, char *argv[]) {
         cerr << "Type \"" << argv[0] << " --help\" for more information." << endl;
         return 1;
     }
-    po::notify(vm);
 
 	if (vm.count("help")) {
 		cout << "Usage: " << argv[0] << " [options] [usb]" << endl << endl;
@@ -938,6 +2075,21 @@ int main (int argc, char *argv[]) {
 		return 0;
 	}
 
+	if (vm.count("decode")) {
+		ifstream in(vm["decode"].as< string >().c_str(), std::ios::binary);
+		return FlightRecorder::decode(in, cout) ? 0 : 1;
+	}
+
+	if (vm.count("status")) {
+		return StatusPage::print(vm.count("status-page") ? vm["status-page"].as< string >() : CEC_DAEMON_STATUS_PATH, cout) ? 0 : 1;
+	}
+
+	// Forking would report ready for a pid systemd doesn't watch, before the adapter is open
+	if (vm.count("daemon") && getenv("NOTIFY_SOCKET")) {
+		cerr << argv[0] << ": -d can't be used when started by systemd with Type=notify" << endl;
+		return 1;
+	}
+
 	if(vm.count("quiet")) {
 		loglevel = -1;
 	} else {
@@ -953,49 +2105,90 @@ int main (int argc, char *argv[]) {
 	}
 
 	try {
+		// uinput goes to the simulator, so it has to come before the main
+		std::shared_ptr<SimulatedBus> bus;
+		if (vm.count("simulate")) {
+			bus = std::make_shared<SimulatedBus>(vm["simulate"].as< string >(), &Main::keyCode);
+			UInput::setSink(bus->sink());
+		}
+
 		// Create the main
 		Main & main = Main::instance();
-        string device = "";
+
+		if (bus) {
+			main.setAdapterFactory([bus](const libcec_configuration & config) { return bus->adapter(config); });
+			bus->onFinished([&main](bool passed) { main.stop(); });
+		}
 
 		if (vm.count("list")) {
 			main.listDevices();
 			return 0;
 		}
 
-		if (vm.count("donotactivate")) {
-			main.setMakeActive(false);
-		}
-
-		if (vm.count("usb")) {
-			device = vm["usb"].as< string >();
+		if (vm.count("forward")) {
+			const vector<string> & devices = vm["forward"].as< vector<string> >();
+			for (vector<string>::const_iterator device = devices.begin(); device != devices.end(); ++device)
+				main.addForwardDevice(*device);
 		}
 
-		if (vm.count("onstandby")) {
-			main.setOnStandbyCommand(vm["onstandby"].as< string >());
+		if (vm.count("forward-socket")) {
+			main.setForwardSocket(vm["forward-socket"].as< string >());
 		}
 
-		if (vm.count("onactivate")) {
-			main.setOnActivateCommand(vm["onactivate"].as< string >());
+		main.getRealTime().setPolicy(vm["realtime-policy"].as< string >());
+		if (vm.count("realtime")) {
+			main.getRealTime().setPriority(vm["realtime"].as< int >());
 		}
 
-		if (vm.count("ondeactivate")) {
-			main.setOnDeactivateCommand(vm["ondeactivate"].as< string >());
+		if (vm.count("cpu")) {
+			main.getRealTime().setCpu(vm["cpu"].as< int >());
 		}
 
-		if (vm.count("port")) {
-            main.setTargetAddress(vm["port"].as< HDMI::address >());
-        }
+		main.configure(readSettings(vm), [argc, argv, &desc, &p]() {
+			po::variables_map reloaded;
+			parseOptions(argc, argv, desc, p, reloaded);
+			return readSettings(reloaded);
+		});
 
         if (vm.count("daemon")) {
             if( daemon(0, 0) )
                 return -1;
+            logQueue->forked();
         }
 
-		if (vm.count("keymap")) {
-			main.loadKeyMappingFromFile(vm["keymap"].as< string >());
+		if (vm.count("forward-keymap")) {
+			main.loadForwardMapFromFile(vm["forward-keymap"].as< string >());
+		}
+
+		if (vm.count("flight-recorder")) {
+			FlightRecorder::instance().setup(vm["flight-recorder"].as< size_t >(), vm["flight-recorder-file"].as< string >());
+		}
+
+		if (vm.count("startup-profile")) {
+			StartupProfile::instance().enable(vm["startup-profile"].as< string >());
+		}
+
+		if (vm.count("metrics")) {
+			Metrics::instance().serve(vm["metrics"].as< string >());
 		}
 
-		main.loop(device);
+		if (vm.count("mpris")) {
+			main.startMpris(vm["mpris"].as< string >());
+		}
+
+		if (vm.count("status-page")) {
+			main.openStatusPage(vm["status-page"].as< string >());
+		}
+
+		main.loop();
+
+		Metrics::instance().stop();
+
+		if (bus) {
+			bus->stop();
+			if (!bus->passed())
+				return 1;
+		}
 
 	} catch (std::exception & e) {
 		cerr << e.what() << endl;
@@ -1,24 +1,161 @@
 #include "uinput.h"
 #include "libcec.h"
+#include "hdmi.h"
+#include "rules.h"
+#include "events.h"
+#include "metrics.h"
+#include "sdnotify.h"
+#include "hookprocess.h"
+#include "coalescer.h"
+#include "realtime.h"
+#include "pointer.h"
+#include "vendor.h"
+#include "forwarder.h"
+#include "activesource.h"
+#include "topology.h"
+#include "ratelimit.h"
+#include "mpris.h"
+#include "statuspage.h"
 #include <limits.h>
 #include <string>
-#include <queue>
+#include <algorithm>
+#include <new>
+#include <type_traits>
 #include <list>
 #include <map>
+#include <atomic>
 #include <cstdint>
+#include <functional>
+#include <memory>
+
+#include <boost/chrono.hpp>
 
 class Command
 {
 	public:
-		Command(int command, CEC::cec_user_control_code keycode=CEC::CEC_USER_CONTROL_CODE_UNKNOWN) : command(command), keycode(keycode) {};
+		Command(int command, CEC::cec_user_control_code keycode=CEC::CEC_USER_CONTROL_CODE_UNKNOWN) : command(command), keycode(keycode), queued(boost::chrono::steady_clock::now()) {};
+		Command(int command, const CEC::cec_keypress & key) : command(command), key(key), queued(boost::chrono::steady_clock::now()) {};
+		Command(int command, const CEC::cec_command & frame) : command(command), frame(frame), queued(boost::chrono::steady_clock::now()) {};
 		~Command() {};
 
 		const int command;
 		union
 		{
 			const CEC::cec_user_control_code keycode;
+			const CEC::cec_keypress key;
+			const CEC::cec_command frame;
+		};
+		const boost::chrono::steady_clock::time_point queued;
+
+};
+
+/**
+ * Fixed capacity FIFO of commands, so queueing a command never allocates
+ */
+#define COMMAND_QUEUE_SIZE 64
+
+class CommandQueue
+{
+	public:
+		CommandQueue() : head(0), tail(0) {};
+		~CommandQueue() { while( ! empty() ) pop(); };
+
+		bool empty() const { return head == tail; };
+		size_t size() const { return tail - head; };
+
+		/**
+		 * Returns false, without queueing, when full
+		 */
+		bool push(const Command & cmd) {
+			if( size() == COMMAND_QUEUE_SIZE )
+				return false;
+			new (&slots[tail++ % COMMAND_QUEUE_SIZE]) Command(cmd);
+			return true;
+		};
+
+		const Command & front() const { return *reinterpret_cast<const Command *>(&slots[head % COMMAND_QUEUE_SIZE]); };
+		void pop() { front().~Command(); head++; };
+
+	private:
+		std::aligned_storage<sizeof(Command), alignof(Command)>::type slots[COMMAND_QUEUE_SIZE];
+		size_t head;
+		size_t tail;
+
+		// Not implemented
+		CommandQueue(CommandQueue const&);
+		void operator=(CommandQueue const&);
+};
+
+/**
+ * Fixed size copy of the uinput keys a CEC key is mapped to, so remembering
+ * the keys that are held down doesn't allocate
+ */
+#define KEYSET_MAX 8
+
+class KeySet
+{
+	public:
+		KeySet() : count(0) {};
+
+		void assign(const std::list<uint16_t> & keys) {
+			count = 0;
+			for (std::list<uint16_t>::const_iterator key = keys.begin(); key != keys.end() && count < KEYSET_MAX; ++key)
+				this->keys[count++] = *key;
+		};
+		bool operator==(const std::list<uint16_t> & keys) const {
+			return keys.size() == count && std::equal(keys.begin(), keys.end(), this->keys);
 		};
+		bool operator!=(const std::list<uint16_t> & keys) const { return !(*this == keys); };
+
+		bool empty() const { return count == 0; };
+		void clear() { count = 0; };
 
+		const uint16_t *begin() const { return keys; };
+		const uint16_t *end() const { return keys + count; };
+
+	private:
+		uint16_t keys[KEYSET_MAX];
+		size_t count;
+};
+
+/**
+ * The options read from the command line and the --config file, all of
+ * which SIGHUP applies again without recreating the uinput device. Only a
+ * changed adapter or port reopens the adapter.
+ */
+class Settings
+{
+	public:
+		Settings() : hasPort(false), activate(true), coalesce(500), maxHold(10000),
+			repeatLimit(20), repeatBurst(10), pingInterval(43), busBudget(50), timerSlack(-1) {};
+
+		std::string adapter;
+		bool hasPort;
+		HDMI::address port;
+
+		bool activate;
+		std::string onStandby;
+		std::string onActivate;
+		std::string onDeactivate;
+		std::string hookProcess;
+		std::string keymap;
+		std::string rules;
+		std::string events;
+		std::string vendors;
+		std::string pointerKey;
+		int coalesce;     // ms
+		int maxHold;      // ms
+		int repeatLimit;  // key repeats a second
+		int repeatBurst;
+		int pingInterval; // s
+		int busBudget;    // %
+		int timerSlack;   // ms, -1 for the kernel default
+
+		bool sameAdapter(const Settings & other) const {
+			return adapter == other.adapter && hasPort == other.hasPort && (!hasPort
+				|| ((uint16_t) port.physical == (uint16_t) other.port.physical
+					&& port.logical == other.port.logical && port.port == other.port.port));
+		};
 };
 
 class Main : public CecCallback {
@@ -28,14 +165,18 @@ class Main : public CecCallback {
 		// Main controls
 		Cec cec;
 		UInput uinput;
+		Pointer pointer;
+		CEC::cec_user_control_code pointerToggle; // CEC_USER_CONTROL_CODE_UNKNOWN when there is no pointer mode
 		static char cec_name[HOST_NAME_MAX];
 
 		// Some config params
 		bool makeActive;
-		bool running; // TODO Change this to be threadsafe!. Voiatile or better
+		std::atomic<bool> running;
 
 		//
-		std::list<uint16_t> lastUInputKeys; // for key(s) repetition
+		KeySet lastUInputKeys; // for key(s) repetition
+		boost::chrono::steady_clock::time_point releaseAt; // when lastUInputKeys are released, max() if held by the remote
+		RepeatLimiter repeatLimiter;
 
 		//
 		Main();
@@ -48,23 +189,114 @@ class Main : public CecCallback {
 		static void signalHandler(int sigNum);
 
 		static const std::vector<std::list<uint16_t>> & setupUinputMap();
-		std::queue<Command> commands;
+
+		// Dispatch lanes, in order of priority
+		enum Lane
+		{
+			LANE_INPUT,       // key presses
+			LANE_STATE,       // standby, source changes, replies on the bus
+			LANE_MAINTENANCE, // restart, exit
+			LANE_MAX,
+		};
+		CommandQueue commands[LANE_MAX];
+		unsigned passedOver[LANE_MAX]; // times a lane had work but a higher one went first
+		int nextLane();
+		bool laneReady(int lane) const;
+		bool hasWork() const;
 
 		std::string onStandbyCommand;
 		std::string onActivateCommand;
 		std::string onDeactivateCommand;
+		std::string hookProcessCommand;
+		HookProcess hookProcess;
+
+		// Flapping standby and source state changes
+		Coalescer standbyEvents;
+		Coalescer sourceEvents;
 
 		CEC::cec_logical_address logicalAddress;
+		ActiveSource activeSource;
+
+		// The HDMI tree, and the port found in it that reopening gives libcec
+		Topology topology;
+		bool portPinned;
+		void pinDetectedPort();
+
+		// Swapped on reload while the libcec callbacks use them
+		std::shared_ptr<const CommandRules> rules;
+
+		// Reactions to our own events, run instead of the hooks
+		std::unique_ptr<EventRules> events;
+		boost::chrono::steady_clock::time_point sourceSince; // when makeActive last changed
+		boost::chrono::steady_clock::time_point lastKey;     // last key from the remote
+		bool runEvent(EventRules::Event event, int timer = -1);
+
+		// Vendor specific remote buttons
+		std::shared_ptr<const VendorDecoders> vendorDecoders;
+		std::atomic<uint32_t> vendorIds[16]; // per logical address, 0 while unknown
+		std::atomic<bool> vendorAsked[16];   // per logical address, asked for its vendor ID since the adapter was opened
+		std::atomic<int> vendorButton;       // held VENDOR_REMOTE_BUTTON_DOWN key, CEC_USER_CONTROL_CODE_UNKNOWN if none
+		// The frame that made us ask, decoded once the answer comes, only used from the callbacks
+		CEC::cec_command vendorPending[16];
+		boost::chrono::steady_clock::time_point vendorPendingAt[16]; // time_point() if none
+		bool decodeVendorCommand(const CEC::cec_command &command);
+
+		// Media keys sent to the MPRIS player rather than uinput
+		MprisBridge mpris;
+		CEC::cec_user_control_code mprisHeld; // pressed key that went to the player, CEC_USER_CONTROL_CODE_UNKNOWN if none
+		bool mprisKey(const CEC::cec_keypress &key);
+
+		// Local keys sent on to other devices
+		InputForwarder forwarder;
+		void forwardKey(CEC::cec_logical_address destination, CEC::cec_user_control_code key);
+
+		// systemd service notifications, a no-op when not run by systemd
+		SdNotify notify;
+
+		// The state published for --status and other readers, only written by the main loop
+		StatusPage statusPage;
+		cec_daemon_status status;
+		std::atomic<bool> statusChanged;
+		std::atomic<int> tvPower; // cec_daemon_status_power, followed from the bus
+		void statusObserved(const CEC::cec_command &command);
+		void publishStatus();
+
+		// What the daemon runs with, and how to read it again on SIGHUP
+		Settings settings;
+		std::function<Settings ()> settingsLoader;
+		void applySettings(const Settings & settings, bool reload);
+		void reloadSettings();
+		void applyTimerSlack();
+
+		// Health checking
+		boost::chrono::steady_clock::duration pingInterval;
+		int timerSlack; // ms, -1 for the kernel default
+		RealTime realtime;
+		boost::chrono::steady_clock::duration maxHold; // zero to never release held keys
+		std::atomic<boost::chrono::steady_clock::rep> lastTraffic;
+
+		void onCecTraffic();
+		boost::chrono::steady_clock::time_point lastTrafficTime() const;
 
 		char *getCecName();
 
 		void push(Command command);
+		void runAction(const RuleAction & action, const CEC::cec_command & command);
+		void runHook(Metrics::Hook hook, const char *event, const std::string & command);
+		void onStandby();
+		void sendKey(const CEC::cec_keypress &key);
+		void releaseKeys();
+		void releaseStuckKeys(boost::chrono::steady_clock::time_point now);
+		void releaseAllKeys();
+		bool pointerKey(const CEC::cec_keypress &key);
+		void onSourceState(bool active);
 
 		// Key mapping configuration
 		static std::map<std::string, uint16_t> keyNameToCode;
 		static std::map<std::string, CEC::cec_user_control_code> cecKeyNameToCode;
 		static void initializeKeyMaps();
 		static std::vector<std::list<uint16_t>> createDefaultUinputMap();
+		static std::vector<std::list<uint16_t>> uinputKeys();
 
 	public:
 
@@ -81,20 +313,36 @@ class Main : public CecCallback {
 
 		static Main & instance();
 
-		void loop(const std::string &device = "");
+		void loop();
 		void stop();
 		void restart();
+		void reload();
 
 		void listDevices();
 
-		void setMakeActive(bool active) {this->makeActive = active;};
+		/**
+		 * Applies the settings the daemon starts with, loader reads them again on SIGHUP
+		 */
+		void configure(const Settings & settings, std::function<Settings ()> loader) {
+			applySettings(settings, false);
+			this->settingsLoader = loader;
+		};
 
-		void setOnStandbyCommand(const std::string &cmd) {this->onStandbyCommand = cmd;};
-		void setOnActivateCommand(const std::string &cmd) {this->onActivateCommand = cmd;};
-		void setOnDeactivateCommand(const std::string &cmd) {this->onDeactivateCommand = cmd;};
-		void setTargetAddress(const HDMI::address & address) {cec.setTargetAddress(address);};
+		RealTime & getRealTime() {return realtime;};
+		void setMaxHold(int ms) {this->maxHold = boost::chrono::milliseconds(ms); pointer.setMaxHold(this->maxHold);};
+		bool setPointerKey(const std::string &name);
+		void setCoalesceWindow(int ms) {standbyEvents.setWindow(boost::chrono::milliseconds(ms)); sourceEvents.setWindow(boost::chrono::milliseconds(ms));};
 		
 		// Key mapping configuration
 		static bool loadKeyMappingFromFile(const std::string& filename);
+		static bool keyCode(const std::string& name, uint16_t& code);
+
+		void setAdapterFactory(std::function<CecAdapter * (const CEC::libcec_configuration & config)> factory) {cec.setAdapterFactory(factory);};
+
+		void addForwardDevice(const std::string& path) {forwarder.addDevice(path);};
+		void setForwardSocket(const std::string& path) {forwarder.setSocket(path);};
+		void startMpris(const std::string& bus) {mpris.start(bus);};
+		void openStatusPage(const std::string& path) {statusPage.open(path); publishStatus();};
+		bool loadForwardMapFromFile(const std::string& filename);
 };
 
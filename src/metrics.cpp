@@ -0,0 +1,463 @@
+/**
+ * metrics.cpp
+ *
+ * Per thread counters, summed and written out in the Prometheus text
+ * exposition format when scraped.
+ */
+#include "metrics.h"
+#include "libcec.h"
+#include "profile.h"
+#include "recorder.h"
+
+#include <cerrno>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::map;
+using std::ostream;
+using std::string;
+
+static Logger logger = Logger::getInstance("metrics");
+
+#define ALERT_MAX 7
+
+static const char *counterNames[Metrics::COUNTER_MAX][2] = {
+	{ "libcec_daemon_restarts_total",      "Number of adapter restarts" },
+	{ "libcec_daemon_ping_failures_total", "Number of failed adapter pings" },
+	{ "libcec_daemon_uinput_errors_total", "Number of failed uinput writes" },
+	{ "libcec_daemon_hook_process_restarts_total", "Number of times the hook process had to be restarted" },
+	{ "libcec_daemon_hook_events_dropped_total",   "Number of events the hook process was too slow to take" },
+	{ "libcec_daemon_events_coalesced_total",      "Number of standby and source changes held back while flapping" },
+	{ "libcec_daemon_commands_dropped_total",      "Number of commands dropped because the dispatch queue was full" },
+	{ "libcec_daemon_stuck_keys_released_total",   "Number of keys released because they were held for too long" },
+	{ "libcec_daemon_transmits_total",             "Number of CEC commands sent" },
+	{ "libcec_daemon_transmit_retries_total",      "Number of CEC commands sent again after not being acknowledged" },
+	{ "libcec_daemon_transmit_nacks_total",        "Number of CEC commands given up on after not being acknowledged" },
+	{ "libcec_daemon_transmits_coalesced_total",   "Number of CEC commands merged with one already queued, or dropped" },
+	{ "libcec_daemon_log_messages_dropped_total",  "Number of log messages dropped because the log writer fell behind" },
+	{ "libcec_daemon_key_repeats_suppressed_total", "Number of key repeats left out because they came faster than --repeat-limit" },
+};
+
+static const char *hookNames[Metrics::HOOK_MAX] = { "standby", "activate", "deactivate", "run" };
+
+static const char *alertNames[ALERT_MAX] = {
+	"service_device", "connection_lost", "permission_error", "port_busy",
+	"physical_address_error", "tv_poll_failed", "unknown",
+};
+
+// Histogram bucket upper bounds, in seconds
+static const double hookBounds[]    = { 0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30 };
+static const double latencyBounds[] = { 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05, 0.1, 0.25, 0.5 };
+static const double depthBounds[]   = { 0, 1, 2, 4, 8, 16, 32, 64 };
+
+#define BOUNDS(b) (sizeof(b) / sizeof(b[0]))
+
+/**
+ * Only ever written by the thread owning the shard, so plain loads and stores
+ * are enough; atomics just keep the scraping thread's reads well defined.
+ */
+static inline void add(std::atomic<uint64_t> & counter, uint64_t value) {
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+template<size_t N>
+struct Histogram {
+	std::atomic<uint64_t> buckets[N + 1]; // the last one is +Inf
+	std::atomic<uint64_t> sum;            // in micro units
+
+	void observe(const double (&bounds)[N], double value) {
+		size_t i = 0;
+		while (i < N && value > bounds[i])
+			i++;
+		add(buckets[i], 1);
+		add(sum, (uint64_t) (value * 1e6));
+	}
+};
+
+struct MetricsShard {
+	std::atomic<bool> inUse;
+	MetricsShard *next;
+
+	std::atomic<uint64_t> counters[Metrics::COUNTER_MAX];
+	std::atomic<uint64_t> keys[256];
+	std::atomic<uint64_t> opcodes[256];
+	std::atomic<uint64_t> alerts[ALERT_MAX];
+	std::atomic<uint64_t> hookRuns[Metrics::HOOK_MAX];
+
+	Histogram<BOUNDS(hookBounds)> hookDuration[Metrics::HOOK_MAX];
+	Histogram<BOUNDS(latencyBounds)> keyLatency;
+	Histogram<BOUNDS(depthBounds)> queueDepth;
+};
+
+/**
+ * Hands the shard back when its thread exits, so the next thread can pick it
+ * up (the counts are cumulative, so they are kept)
+ */
+struct MetricsShardHandle {
+	MetricsShard *shard;
+
+	MetricsShardHandle() : shard(NULL) {}
+	~MetricsShardHandle() {
+		if (shard)
+			shard->inUse.store(false);
+	}
+};
+
+static thread_local MetricsShardHandle threadShard;
+
+Metrics & Metrics::instance() {
+	static Metrics metrics;
+	return metrics;
+}
+
+Metrics::Metrics() : shards(NULL), depth(0), occupancy(0), listenFd(-1), http(false) {}
+
+Metrics::~Metrics() {
+	stop();
+}
+
+MetricsShard & Metrics::shard() {
+	if (threadShard.shard)
+		return *threadShard.shard;
+
+	boost::lock_guard<boost::mutex> lock(shardsLock);
+
+	MetricsShard *s;
+	for (s = shards; s != NULL; s = s->next) {
+		bool free = false;
+		if (s->inUse.compare_exchange_strong(free, true))
+			break;
+	}
+
+	if (s == NULL) {
+		// value-initialised, so every counter starts at zero
+		s = new MetricsShard();
+		s->inUse = true;
+		s->next = shards;
+		shards = s;
+	}
+
+	threadShard.shard = s;
+	return *s;
+}
+
+void Metrics::inc(Counter counter, uint64_t value) {
+	add(shard().counters[counter], value);
+}
+
+void Metrics::key(cec_user_control_code keycode) {
+	add(shard().keys[keycode & 0xFF], 1);
+}
+
+void Metrics::opcode(cec_opcode opcode) {
+	add(shard().opcodes[opcode & 0xFF], 1);
+}
+
+void Metrics::alert(libcec_alert alert) {
+	add(shard().alerts[(alert >= 0 && alert < ALERT_MAX) ? alert : ALERT_MAX - 1], 1);
+}
+
+void Metrics::hook(Hook hook, double seconds) {
+	MetricsShard & s = shard();
+	add(s.hookRuns[hook], 1);
+	s.hookDuration[hook].observe(hookBounds, seconds);
+}
+
+void Metrics::keyLatency(double seconds) {
+	shard().keyLatency.observe(latencyBounds, seconds);
+}
+
+void Metrics::queueDepth(size_t depth) {
+	this->depth.store(depth, std::memory_order_relaxed);
+	shard().queueDepth.observe(depthBounds, (double) depth);
+}
+
+void Metrics::busOccupancy(double fraction) {
+	occupancy.store(fraction, std::memory_order_relaxed);
+}
+
+/**
+ * Sums field over every shard
+ */
+#define SUM(total, field) \
+	do { \
+		total = 0; \
+		for (const MetricsShard *s = shards; s != NULL; s = s->next) \
+			total += (s->field).load(std::memory_order_relaxed); \
+	} while (0)
+
+/**
+ * Writes out a histogram summed over every shard, get() picks it out of a shard
+ */
+template<size_t N, typename Get>
+static void writeHistogram(ostream & out, const MetricsShard *shards, const char *name, const string & labels,
+		const double (&bounds)[N], Get get) {
+	uint64_t cumulative = 0, sum = 0;
+
+	for (size_t i = 0; i <= N; i++) {
+		for (const MetricsShard *s = shards; s != NULL; s = s->next)
+			cumulative += get(*s).buckets[i].load(std::memory_order_relaxed);
+
+		out << name << "_bucket{" << labels << (labels.empty() ? "" : ",") << "le=\"";
+		if (i < N)
+			out << bounds[i];
+		else
+			out << "+Inf";
+		out << "\"} " << cumulative << "\n";
+	}
+
+	for (const MetricsShard *s = shards; s != NULL; s = s->next)
+		sum += get(*s).sum.load(std::memory_order_relaxed);
+
+	string braces = labels.empty() ? "" : "{" + labels + "}";
+	out << name << "_sum" << braces << " " << (sum / 1e6) << "\n";
+	out << name << "_count" << braces << " " << cumulative << "\n";
+}
+
+ostream & Metrics::write(ostream & out) const {
+	boost::lock_guard<boost::mutex> lock(shardsLock);
+	uint64_t total;
+
+	for (int c = 0; c < COUNTER_MAX; c++) {
+		SUM(total, counters[c]);
+		out << "# HELP " << counterNames[c][0] << " " << counterNames[c][1] << "\n"
+		    << "# TYPE " << counterNames[c][0] << " counter\n"
+		    << counterNames[c][0] << " " << total << "\n";
+	}
+
+	out << "# HELP libcec_daemon_keys_total Number of CEC key presses, by key\n"
+	    << "# TYPE libcec_daemon_keys_total counter\n";
+	for (int k = 0; k < 256; k++) {
+		SUM(total, keys[k]);
+		if (total == 0)
+			continue;
+
+		map<cec_user_control_code, const char *>::const_iterator name = Cec::cecUserControlCodeName.find((cec_user_control_code) k);
+		out << "libcec_daemon_keys_total{key=\"";
+		if (name != Cec::cecUserControlCodeName.end())
+			out << name->second;
+		else
+			out << "0x" << std::hex << k << std::dec;
+		out << "\"} " << total << "\n";
+	}
+
+	out << "# HELP libcec_daemon_opcodes_total Number of CEC commands received, by opcode\n"
+	    << "# TYPE libcec_daemon_opcodes_total counter\n";
+	for (int o = 0; o < 256; o++) {
+		SUM(total, opcodes[o]);
+		if (total == 0)
+			continue;
+		out << "libcec_daemon_opcodes_total{opcode=\"0x" << std::hex << std::setw(2) << std::setfill('0') << o
+		    << std::dec << std::setfill(' ') << "\"} " << total << "\n";
+	}
+
+	out << "# HELP libcec_daemon_alerts_total Number of libcec alerts, by type\n"
+	    << "# TYPE libcec_daemon_alerts_total counter\n";
+	for (int a = 0; a < ALERT_MAX; a++) {
+		SUM(total, alerts[a]);
+		out << "libcec_daemon_alerts_total{alert=\"" << alertNames[a] << "\"} " << total << "\n";
+	}
+
+	out << "# HELP libcec_daemon_hook_runs_total Number of hook commands run\n"
+	    << "# TYPE libcec_daemon_hook_runs_total counter\n";
+	for (int h = 0; h < HOOK_MAX; h++) {
+		SUM(total, hookRuns[h]);
+		out << "libcec_daemon_hook_runs_total{hook=\"" << hookNames[h] << "\"} " << total << "\n";
+	}
+
+	out << "# HELP libcec_daemon_hook_duration_seconds Time spent running hook commands\n"
+	    << "# TYPE libcec_daemon_hook_duration_seconds histogram\n";
+	for (int h = 0; h < HOOK_MAX; h++) {
+		writeHistogram(out, shards, "libcec_daemon_hook_duration_seconds", string("hook=\"") + hookNames[h] + "\"",
+			hookBounds, [h](const MetricsShard & s) -> const Histogram<BOUNDS(hookBounds)> & { return s.hookDuration[h]; });
+	}
+
+	out << "# HELP libcec_daemon_key_latency_seconds Time from a CEC key press to the uinput event\n"
+	    << "# TYPE libcec_daemon_key_latency_seconds histogram\n";
+	writeHistogram(out, shards, "libcec_daemon_key_latency_seconds", "", latencyBounds,
+		[](const MetricsShard & s) -> const Histogram<BOUNDS(latencyBounds)> & { return s.keyLatency; });
+
+	out << "# HELP libcec_daemon_queue_depth Number of commands waiting to be dispatched\n"
+	    << "# TYPE libcec_daemon_queue_depth gauge\n"
+	    << "libcec_daemon_queue_depth " << depth.load(std::memory_order_relaxed) << "\n";
+
+	out << "# HELP libcec_daemon_queue_depth_observed Dispatch queue depth seen by each new command\n"
+	    << "# TYPE libcec_daemon_queue_depth_observed histogram\n";
+	writeHistogram(out, shards, "libcec_daemon_queue_depth_observed", "", depthBounds,
+		[](const MetricsShard & s) -> const Histogram<BOUNDS(depthBounds)> & { return s.queueDepth; });
+
+	out << "# HELP libcec_daemon_bus_occupancy_ratio Fraction of the last second the CEC bus was busy, as far as we saw\n"
+	    << "# TYPE libcec_daemon_bus_occupancy_ratio gauge\n"
+	    << "libcec_daemon_bus_occupancy_ratio " << occupancy.load(std::memory_order_relaxed) << "\n";
+
+	StartupProfile::instance().writeMetrics(out);
+
+	return out;
+}
+
+/**
+ * Removes a socket left behind by an earlier run, anything else at the path
+ * is left for bind() to fail on
+ */
+static void removeStaleSocket(const string & path) {
+	struct stat st;
+	if (lstat(path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path.c_str());
+}
+
+void Metrics::serve(const string & endpoint) {
+	int fd;
+
+	if (!endpoint.empty() && endpoint[0] == '/') {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (endpoint.size() >= sizeof(addr.sun_path)) {
+			throw std::runtime_error("Metrics socket path is too long");
+		}
+		strncpy(addr.sun_path, endpoint.c_str(), sizeof(addr.sun_path) - 1);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		removeStaleSocket(endpoint);
+		if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			LOG4CPLUS_ERROR(logger, "Failed to bind " << endpoint << ": " << strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			throw std::runtime_error("Failed to open metrics socket");
+		}
+		socketPath = endpoint;
+		http = false;
+	} else {
+		char *end;
+		long port = strtol(endpoint.c_str(), &end, 10);
+		if (endpoint.empty() || *end != '\0' || port <= 0 || port > 65535) {
+			throw std::runtime_error("Metrics endpoint must be a unix socket path or a port number");
+		}
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((uint16_t) port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		int one = 1;
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+			LOG4CPLUS_ERROR(logger, "Failed to bind 127.0.0.1:" << port << ": " << strerror(errno));
+			if (fd >= 0)
+				close(fd);
+			throw std::runtime_error("Failed to open metrics socket");
+		}
+		http = true;
+	}
+
+	if (listen(fd, 4) < 0) {
+		close(fd);
+		throw std::runtime_error("Failed to listen on metrics socket");
+	}
+
+	listenFd = fd;
+	server = boost::thread(&Metrics::run, this);
+
+	LOG4CPLUS_INFO(logger, "Serving metrics on " << (http ? "127.0.0.1:" : "") << endpoint);
+}
+
+void Metrics::stop() {
+	if (listenFd < 0)
+		return;
+
+	// wakes up accept()
+	shutdown(listenFd, SHUT_RDWR);
+	server.join();
+
+	close(listenFd);
+	listenFd = -1;
+
+	if (!socketPath.empty())
+		unlink(socketPath.c_str());
+}
+
+void Metrics::run() {
+	for (;;) {
+		int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			break;
+		}
+
+		try {
+			reply(fd);
+		} catch (...) {}
+
+		close(fd);
+	}
+}
+
+void Metrics::reply(int fd) {
+	std::ostringstream body;
+	write(body);
+
+	string response;
+	if (http) {
+		// Don't wait forever on a client that never sends its request
+		struct timeval timeout = { 1, 0 };
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+		char request[1024];
+		ssize_t len = recv(fd, request, sizeof(request) - 1, 0);
+		if (len <= 0)
+			return;
+		request[len] = '\0';
+
+		// The flight recorder can be dumped on request too, but a GET, which
+		// anything crawling the port sends, must not write files
+		const char *status = "200 OK";
+		if (strncmp(request, "POST /flight-recorder ", 22) == 0) {
+			body.str("");
+			if (FlightRecorder::instance().dump())
+				body << "Dumped to " << FlightRecorder::instance().filename() << "\n";
+			else
+				body << "Failed to dump the flight recorder\n";
+		} else if (strncmp(request, "GET /flight-recorder ", 21) == 0) {
+			status = "405 Method Not Allowed";
+			body.str("");
+			body << "POST to dump the flight recorder\n";
+		}
+
+		std::ostringstream header;
+		header << "HTTP/1.0 " << status << "\r\n"
+		       << "Content-Type: text/plain; version=0.0.4\r\n"
+		       << "Content-Length: " << body.str().size() << "\r\n"
+		       << "Connection: close\r\n\r\n";
+		response = header.str();
+	}
+	response += body.str();
+
+	const char *p = response.data();
+	size_t left = response.size();
+	while (left > 0) {
+		ssize_t ret = send(fd, p, left, MSG_NOSIGNAL);
+		if (ret <= 0)
+			break;
+		p += ret;
+		left -= ret;
+	}
+}
@@ -0,0 +1,97 @@
+#include <libcec/cectypes.h>
+
+#include <atomic>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+struct MetricsShard;
+
+/**
+ * Daemon counters, exposed in the Prometheus text format.
+ *
+ * Every thread updates its own shard of counters, so recording a value never
+ * contends with other threads; the shards are only summed when scraped.
+ */
+class Metrics {
+
+	public:
+
+		enum Counter
+		{
+			RESTARTS,
+			PING_FAILURES,
+			UINPUT_ERRORS,
+			HOOK_PROCESS_RESTARTS,
+			HOOK_EVENTS_DROPPED,
+			EVENTS_COALESCED,
+			COMMANDS_DROPPED,
+			STUCK_KEYS_RELEASED,
+			TRANSMITS,
+			TRANSMIT_RETRIES,
+			TRANSMIT_NACKS,
+			TRANSMITS_COALESCED,
+			LOG_MESSAGES_DROPPED,
+			KEY_REPEATS_SUPPRESSED,
+			COUNTER_MAX,
+		};
+
+		enum Hook
+		{
+			HOOK_STANDBY,
+			HOOK_ACTIVATE,
+			HOOK_DEACTIVATE,
+			HOOK_RUN, // the run action of an event rule
+			HOOK_MAX,
+		};
+
+		static Metrics & instance();
+
+		void inc(Counter counter, uint64_t value = 1);
+		void key(CEC::cec_user_control_code keycode);
+		void opcode(CEC::cec_opcode opcode);
+		void alert(CEC::libcec_alert alert);
+		void hook(Hook hook, double seconds);
+		void keyLatency(double seconds);
+		void queueDepth(size_t depth);
+		void busOccupancy(double fraction);
+
+		/**
+		 * Serves the metrics on endpoint, either a unix socket path (starting
+		 * with '/') or a TCP port number on the loopback interface
+		 */
+		void serve(const std::string & endpoint);
+		void stop();
+
+		std::ostream & write(std::ostream & out) const;
+
+	private:
+
+		Metrics();
+		~Metrics();
+
+		// Not implemented to avoid copying the singleton
+		Metrics(Metrics const&);
+		void operator=(Metrics const&);
+
+		MetricsShard & shard();
+
+		mutable boost::mutex shardsLock;
+		MetricsShard * shards; // linked list, never freed
+
+		std::atomic<size_t> depth;
+		std::atomic<double> occupancy;
+
+		int listenFd;
+		bool http;
+		std::string socketPath;
+		boost::thread server;
+
+		void run();
+		void reply(int fd);
+
+	friend struct MetricsShardHandle;
+};
@@ -0,0 +1,560 @@
+/**
+ * mpris.cpp
+ *
+ * The thread runs its own poll loop over the connection's watches, plus a
+ * pipe the main loop writes to when it posts a call, so libdbus is only ever
+ * used from that one thread.
+ */
+#include "mpris.h"
+#include "config.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <boost/thread/lock_guard.hpp>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+#ifdef HAVE_DBUS
+#include <dbus/dbus.h>
+#endif
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("mpris");
+
+static const char *method(cec_user_control_code key) {
+	switch (key) {
+		case CEC_USER_CONTROL_CODE_PLAY:     return "Play";
+		case CEC_USER_CONTROL_CODE_PAUSE:    return "Pause";
+		case CEC_USER_CONTROL_CODE_STOP:     return "Stop";
+		case CEC_USER_CONTROL_CODE_FORWARD:  return "Next";
+		case CEC_USER_CONTROL_CODE_BACKWARD: return "Previous";
+		default:                             return NULL;
+	}
+}
+
+MprisBridge::MprisBridge() : havePlayer(false), stopping(false), connection(NULL), activity(0) {
+	wake[0] = wake[1] = -1;
+}
+
+MprisBridge::~MprisBridge() {
+	stop();
+}
+
+bool MprisBridge::handles(cec_user_control_code key) const {
+	return havePlayer && method(key) != NULL;
+}
+
+#ifdef HAVE_DBUS
+
+static const char *busName        = "org.freedesktop.DBus";
+static const char *busPath        = "/org/freedesktop/DBus";
+static const char *playerPrefix   = "org.mpris.MediaPlayer2.";
+static const char *playerPath     = "/org/mpris/MediaPlayer2";
+static const char *playerIface    = "org.mpris.MediaPlayer2.Player";
+static const char *propertiesIface = "org.freedesktop.DBus.Properties";
+
+// Calls queued while the thread is behind
+static const size_t maxQueued = 16;
+
+static const int callTimeout = 2000; // ms
+
+static const boost::chrono::seconds minBackoff(1);
+static const boost::chrono::seconds maxBackoff(30);
+
+static bool isPlayer(const char *name) {
+	return strncmp(name, playerPrefix, strlen(playerPrefix)) == 0;
+}
+
+/**
+ * The C callbacks libdbus calls from dispatch(), on the thread
+ */
+struct MprisCallbacks
+{
+	struct Pending
+	{
+		MprisBridge *bridge;
+		MprisBridge::ReplyHandler handler;
+		string name;
+	};
+
+	static dbus_bool_t addWatch(DBusWatch *watch, void *data) {
+		static_cast<MprisBridge *>(data)->watches.push_back(watch);
+		return TRUE;
+	}
+
+	static void removeWatch(DBusWatch *watch, void *data) {
+		std::vector<DBusWatch *> & watches = static_cast<MprisBridge *>(data)->watches;
+		for (std::vector<DBusWatch *>::iterator it = watches.begin(); it != watches.end(); ++it) {
+			if (*it == watch) {
+				watches.erase(it);
+				break;
+			}
+		}
+	}
+
+	static void toggleWatch(DBusWatch *watch, void *data) {
+		// enabled or not is looked at before every poll
+	}
+
+	static dbus_bool_t addTimeout(DBusTimeout *timeout, void *data) {
+		toggleTimeout(timeout, data);
+		return TRUE;
+	}
+
+	static void removeTimeout(DBusTimeout *timeout, void *data) {
+		static_cast<MprisBridge *>(data)->timeouts.erase(timeout);
+	}
+
+	static void toggleTimeout(DBusTimeout *timeout, void *data) {
+		MprisBridge *bridge = static_cast<MprisBridge *>(data);
+		if (dbus_timeout_get_enabled(timeout))
+			bridge->timeouts[timeout] = boost::chrono::steady_clock::now() + boost::chrono::milliseconds(dbus_timeout_get_interval(timeout));
+		else
+			bridge->timeouts.erase(timeout);
+	}
+
+	static DBusHandlerResult filter(DBusConnection *connection, DBusMessage *message, void *data) {
+		static_cast<MprisBridge *>(data)->onSignal(message);
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+	}
+
+	static void notify(DBusPendingCall *call, void *data) {
+		Pending *pending = static_cast<Pending *>(data);
+		DBusMessage *reply = dbus_pending_call_steal_reply(call);
+		if (reply == NULL)
+			return;
+		(pending->bridge->*pending->handler)(pending->name, reply);
+		dbus_message_unref(reply);
+	}
+
+	static void freePending(void *data) {
+		delete static_cast<Pending *>(data);
+	}
+};
+
+void MprisBridge::start(const string & bus) {
+	if (pipe2(wake, O_CLOEXEC | O_NONBLOCK) < 0)
+		throw std::runtime_error(string("Failed to create the MPRIS wakeup pipe: ") + strerror(errno));
+
+	this->bus = bus;
+	stopping = false;
+	thread = boost::thread(&MprisBridge::run, this);
+	LOG4CPLUS_INFO(logger, "Sending media keys to MPRIS players on the " << (bus == "session" ? "session bus" : bus));
+}
+
+void MprisBridge::stop() {
+	if (!thread.joinable())
+		return;
+
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		stopping = true;
+	}
+	if (write(wake[1], "", 1) < 0 && errno != EAGAIN)
+		LOG4CPLUS_WARN(logger, "Failed to wake the MPRIS thread: " << strerror(errno));
+	thread.join();
+
+	close(wake[0]);
+	close(wake[1]);
+	wake[0] = wake[1] = -1;
+	queue.clear();
+	bus.clear();
+}
+
+void MprisBridge::post(cec_user_control_code key) {
+	const char *name = method(key);
+	if (name == NULL)
+		return;
+
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		if (queue.size() >= maxQueued) {
+			LOG4CPLUS_WARN(logger, "MPRIS calls are not going out, dropped " << name);
+			return;
+		}
+		queue.push_back(name);
+	}
+	if (write(wake[1], "", 1) < 0 && errno != EAGAIN)
+		LOG4CPLUS_WARN(logger, "Failed to wake the MPRIS thread: " << strerror(errno));
+}
+
+void MprisBridge::run() {
+	boost::chrono::steady_clock::duration backoff = boost::chrono::steady_clock::duration::zero();
+
+	for (;;) {
+		{
+			boost::lock_guard<boost::mutex> guard(lock);
+			if (stopping)
+				break;
+		}
+
+		if (connection == NULL) {
+			if (connect()) {
+				backoff = boost::chrono::steady_clock::duration::zero();
+			} else {
+				backoff = std::min<boost::chrono::steady_clock::duration>(std::max<boost::chrono::steady_clock::duration>(backoff * 2, minBackoff), maxBackoff);
+				LOG4CPLUS_WARN(logger, "Connecting again in " << boost::chrono::duration_cast<boost::chrono::seconds>(backoff).count() << "s");
+			}
+		}
+
+		int timeout = -1;
+		if (connection == NULL) {
+			timeout = (int) boost::chrono::duration_cast<boost::chrono::milliseconds>(backoff).count();
+		} else {
+			boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+			for (std::map<DBusTimeout *, boost::chrono::steady_clock::time_point>::const_iterator it = timeouts.begin(); it != timeouts.end(); ++it) {
+				int left = std::max<int>(0, (int) boost::chrono::duration_cast<boost::chrono::milliseconds>(it->second - now).count() + 1);
+				if (timeout < 0 || left < timeout)
+					timeout = left;
+			}
+		}
+		dispatch(timeout);
+	}
+
+	disconnect();
+}
+
+bool MprisBridge::connect() {
+	DBusError error;
+	dbus_error_init(&error);
+
+	if (bus == "session") {
+		connection = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+	} else {
+		connection = dbus_connection_open_private(bus.c_str(), &error);
+		if (connection != NULL && !dbus_bus_register(connection, &error)) {
+			dbus_connection_close(connection);
+			dbus_connection_unref(connection);
+			connection = NULL;
+		}
+	}
+
+	if (connection == NULL) {
+		LOG4CPLUS_WARN(logger, "Failed to connect to D-Bus: " << (dbus_error_is_set(&error) ? error.message : "unknown error"));
+		dbus_error_free(&error);
+		return false;
+	}
+
+	dbus_connection_set_exit_on_disconnect(connection, FALSE);
+	dbus_connection_set_watch_functions(connection, &MprisCallbacks::addWatch, &MprisCallbacks::removeWatch,
+		&MprisCallbacks::toggleWatch, this, NULL);
+	dbus_connection_set_timeout_functions(connection, &MprisCallbacks::addTimeout, &MprisCallbacks::removeTimeout,
+		&MprisCallbacks::toggleTimeout, this, NULL);
+	dbus_connection_add_filter(connection, &MprisCallbacks::filter, this, NULL);
+
+	// without an error, the matches are added without waiting
+	dbus_bus_add_match(connection, "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',"
+		"member='NameOwnerChanged',arg0namespace='org.mpris.MediaPlayer2'", NULL);
+	dbus_bus_add_match(connection, "type='signal',interface='org.freedesktop.DBus.Properties',"
+		"member='PropertiesChanged',path='/org/mpris/MediaPlayer2',arg0='org.mpris.MediaPlayer2.Player'", NULL);
+
+	LOG4CPLUS_INFO(logger, "Connected to D-Bus");
+
+	// the players there already
+	call(dbus_message_new_method_call(busName, busPath, busName, "ListNames"), &MprisBridge::onNames, "");
+	return true;
+}
+
+void MprisBridge::disconnect() {
+	if (connection == NULL)
+		return;
+
+	dbus_connection_close(connection);
+	dbus_connection_unref(connection);
+	connection = NULL;
+
+	watches.clear();
+	timeouts.clear();
+	players.clear();
+	havePlayer = false;
+}
+
+void MprisBridge::dispatch(int timeout) {
+	std::vector<struct pollfd> fds;
+	std::vector<DBusWatch *> polled;
+
+	struct pollfd pfd = { wake[0], POLLIN, 0 };
+	fds.push_back(pfd);
+
+	for (std::vector<DBusWatch *>::const_iterator it = watches.begin(); it != watches.end(); ++it) {
+		if (!dbus_watch_get_enabled(*it))
+			continue;
+		unsigned int flags = dbus_watch_get_flags(*it);
+		pfd.fd = dbus_watch_get_unix_fd(*it);
+		pfd.events = (flags & DBUS_WATCH_READABLE ? POLLIN : 0) | (flags & DBUS_WATCH_WRITABLE ? POLLOUT : 0);
+		fds.push_back(pfd);
+		polled.push_back(*it);
+	}
+
+	if (poll(fds.data(), fds.size(), timeout) < 0) {
+		if (errno != EINTR)
+			LOG4CPLUS_ERROR(logger, "poll failed: " << strerror(errno));
+		return;
+	}
+
+	if (fds[0].revents) {
+		char buf[64];
+		while (read(wake[0], buf, sizeof(buf)) > 0)
+			;
+	}
+
+	if (connection == NULL)
+		return;
+
+	for (size_t i = 0; i < polled.size(); i++) {
+		short revents = fds[i + 1].revents;
+		if (!revents)
+			continue;
+
+		// an earlier one may have removed it
+		bool known = false;
+		for (std::vector<DBusWatch *>::const_iterator it = watches.begin(); it != watches.end() && !known; ++it)
+			known = *it == polled[i];
+		if (!known)
+			continue;
+
+		unsigned int flags = (revents & POLLIN ? DBUS_WATCH_READABLE : 0) | (revents & POLLOUT ? DBUS_WATCH_WRITABLE : 0)
+			| (revents & POLLERR ? DBUS_WATCH_ERROR : 0) | (revents & POLLHUP ? DBUS_WATCH_HANGUP : 0);
+		dbus_watch_handle(polled[i], flags);
+	}
+
+	boost::chrono::steady_clock::time_point now = boost::chrono::steady_clock::now();
+	std::vector<DBusTimeout *> expired;
+	for (std::map<DBusTimeout *, boost::chrono::steady_clock::time_point>::iterator it = timeouts.begin(); it != timeouts.end(); ++it) {
+		if (it->second <= now) {
+			expired.push_back(it->first);
+			it->second = now + boost::chrono::milliseconds(dbus_timeout_get_interval(it->first));
+		}
+	}
+	for (std::vector<DBusTimeout *>::const_iterator it = expired.begin(); it != expired.end(); ++it) {
+		if (timeouts.count(*it))
+			dbus_timeout_handle(*it);
+	}
+
+	while (dbus_connection_dispatch(connection) == DBUS_DISPATCH_DATA_REMAINS)
+		;
+
+	std::deque<const char *> posted;
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		posted.swap(queue);
+	}
+	for (std::deque<const char *>::const_iterator it = posted.begin(); it != posted.end(); ++it)
+		call(*it);
+
+	if (!dbus_connection_get_is_connected(connection)) {
+		LOG4CPLUS_WARN(logger, "Lost the D-Bus connection");
+		disconnect();
+	}
+}
+
+const string * MprisBridge::active() const {
+	const string *best = NULL;
+	const Player *bestPlayer = NULL;
+
+	// the player playing, else the one that did something last
+	for (std::map<string, Player>::const_iterator it = players.begin(); it != players.end(); ++it) {
+		const Player & player = it->second;
+		if (bestPlayer == NULL || player.playing > bestPlayer->playing
+			|| (player.playing == bestPlayer->playing && player.seen > bestPlayer->seen)) {
+			best = &it->first;
+			bestPlayer = &player;
+		}
+	}
+	return best;
+}
+
+void MprisBridge::call(const char *method) {
+	const string *name = active();
+	if (name == NULL) {
+		LOG4CPLUS_DEBUG(logger, "No MPRIS player for " << method);
+		return;
+	}
+
+	LOG4CPLUS_DEBUG(logger, method << " on " << *name);
+	players[*name].seen = ++activity;
+	call(dbus_message_new_method_call(name->c_str(), playerPath, playerIface, method), &MprisBridge::onCalled, *name);
+}
+
+void MprisBridge::call(DBusMessage *message, ReplyHandler handler, const string & name) {
+	if (message == NULL)
+		return;
+
+	DBusPendingCall *pending = NULL;
+	if (dbus_connection_send_with_reply(connection, message, &pending, callTimeout) && pending != NULL) {
+		MprisCallbacks::Pending *data = new MprisCallbacks::Pending();
+		data->bridge  = this;
+		data->handler = handler;
+		data->name    = name;
+		dbus_pending_call_set_notify(pending, &MprisCallbacks::notify, data, &MprisCallbacks::freePending);
+		dbus_pending_call_unref(pending);
+	} else {
+		LOG4CPLUS_WARN(logger, "Failed to send a D-Bus call");
+	}
+	dbus_message_unref(message);
+}
+
+void MprisBridge::discovered(const string & name, const string & owner) {
+	Player & player = players[name];
+	if (player.owner == owner)
+		return;
+
+	LOG4CPLUS_INFO(logger, "MPRIS player " << name << " appeared");
+	player.owner   = owner;
+	player.playing = false;
+	player.seen    = ++activity;
+	havePlayer = true;
+
+	DBusMessage *get = dbus_message_new_method_call(name.c_str(), playerPath, propertiesIface, "Get");
+	const char *iface = playerIface;
+	const char *property = "PlaybackStatus";
+	if (get != NULL && dbus_message_append_args(get, DBUS_TYPE_STRING, &iface, DBUS_TYPE_STRING, &property, DBUS_TYPE_INVALID))
+		call(get, &MprisBridge::onStatus, name);
+	else if (get != NULL)
+		dbus_message_unref(get);
+}
+
+void MprisBridge::vanished(const string & name) {
+	if (players.erase(name))
+		LOG4CPLUS_INFO(logger, "MPRIS player " << name << " went away");
+	havePlayer = !players.empty();
+}
+
+void MprisBridge::onNames(const string & name, DBusMessage *reply) {
+	DBusMessageIter it, names;
+	if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN || !dbus_message_iter_init(reply, &it)
+		|| dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_ARRAY) {
+		LOG4CPLUS_WARN(logger, "Failed to list the D-Bus names");
+		return;
+	}
+
+	for (dbus_message_iter_recurse(&it, &names); dbus_message_iter_get_arg_type(&names) == DBUS_TYPE_STRING; dbus_message_iter_next(&names)) {
+		const char *found;
+		dbus_message_iter_get_basic(&names, &found);
+		if (!isPlayer(found))
+			continue;
+
+		DBusMessage *get = dbus_message_new_method_call(busName, busPath, busName, "GetNameOwner");
+		if (get != NULL && dbus_message_append_args(get, DBUS_TYPE_STRING, &found, DBUS_TYPE_INVALID))
+			call(get, &MprisBridge::onOwner, found);
+		else if (get != NULL)
+			dbus_message_unref(get);
+	}
+}
+
+void MprisBridge::onOwner(const string & name, DBusMessage *reply) {
+	const char *owner;
+	if (dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN
+		&& dbus_message_get_args(reply, NULL, DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID))
+		discovered(name, owner);
+}
+
+/**
+ * Reads a string out of a variant
+ */
+static bool variantString(DBusMessageIter *it, const char *& value) {
+	DBusMessageIter variant;
+	if (dbus_message_iter_get_arg_type(it) != DBUS_TYPE_VARIANT)
+		return false;
+	dbus_message_iter_recurse(it, &variant);
+	if (dbus_message_iter_get_arg_type(&variant) != DBUS_TYPE_STRING)
+		return false;
+	dbus_message_iter_get_basic(&variant, &value);
+	return true;
+}
+
+void MprisBridge::onStatus(const string & name, DBusMessage *reply) {
+	DBusMessageIter it;
+	const char *status;
+	if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_METHOD_RETURN || !dbus_message_iter_init(reply, &it)
+		|| !variantString(&it, status))
+		return;
+
+	std::map<string, Player>::iterator player = players.find(name);
+	if (player != players.end())
+		player->second.playing = strcmp(status, "Playing") == 0;
+}
+
+void MprisBridge::onCalled(const string & name, DBusMessage *reply) {
+	if (dbus_message_get_type(reply) != DBUS_MESSAGE_TYPE_ERROR)
+		return;
+
+	const char *error = dbus_message_get_error_name(reply);
+	LOG4CPLUS_WARN(logger, "MPRIS call on " << name << " failed: " << (error ? error : "unknown error"));
+
+	// it went away before we heard so
+	if (error && (strcmp(error, "org.freedesktop.DBus.Error.ServiceUnknown") == 0
+		|| strcmp(error, "org.freedesktop.DBus.Error.NameHasNoOwner") == 0))
+		vanished(name);
+}
+
+void MprisBridge::onSignal(DBusMessage *message) {
+	if (dbus_message_is_signal(message, busName, "NameOwnerChanged")) {
+		const char *name, *previous, *owner;
+		if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &name, DBUS_TYPE_STRING, &previous,
+			DBUS_TYPE_STRING, &owner, DBUS_TYPE_INVALID) || !isPlayer(name))
+			return;
+
+		if (*owner)
+			discovered(name, owner);
+		else
+			vanished(name);
+		return;
+	}
+
+	if (!dbus_message_is_signal(message, propertiesIface, "PropertiesChanged"))
+		return;
+
+	// interface, changed properties, invalidated properties
+	DBusMessageIter it, changed;
+	const char *iface;
+	const char *sender = dbus_message_get_sender(message);
+	if (sender == NULL || !dbus_message_iter_init(message, &it) || dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_STRING)
+		return;
+	dbus_message_iter_get_basic(&it, &iface);
+	if (strcmp(iface, playerIface) != 0 || !dbus_message_iter_next(&it) || dbus_message_iter_get_arg_type(&it) != DBUS_TYPE_ARRAY)
+		return;
+
+	for (dbus_message_iter_recurse(&it, &changed); dbus_message_iter_get_arg_type(&changed) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&changed)) {
+		DBusMessageIter entry;
+		const char *property, *status;
+		dbus_message_iter_recurse(&changed, &entry);
+		dbus_message_iter_get_basic(&entry, &property);
+		if (strcmp(property, "PlaybackStatus") != 0 || !dbus_message_iter_next(&entry) || !variantString(&entry, status))
+			continue;
+
+		for (std::map<string, Player>::iterator player = players.begin(); player != players.end(); ++player) {
+			if (player->second.owner != sender)
+				continue;
+			player->second.playing = strcmp(status, "Playing") == 0;
+			player->second.seen    = ++activity;
+			LOG4CPLUS_DEBUG(logger, "MPRIS player " << player->first << " is " << status);
+		}
+	}
+}
+
+#else
+
+void MprisBridge::start(const string & bus) {
+	throw std::runtime_error("--mpris needs D-Bus, which libcec-daemon was built without");
+}
+
+void MprisBridge::stop() {
+}
+
+void MprisBridge::post(cec_user_control_code key) {
+}
+
+#endif
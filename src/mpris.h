@@ -0,0 +1,105 @@
+#include <libcec/cectypes.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+struct DBusConnection;
+struct DBusMessage;
+struct DBusWatch;
+struct DBusTimeout;
+
+/**
+ * Sends PLAY, PAUSE, STOP, FORWARD and BACKWARD straight to the active MPRIS
+ * player over D-Bus, rather than as keys that only reach the focused window.
+ *
+ * A background thread keeps one connection to the bus, and follows the
+ * players coming and going and which of them plays from the bus' own signals,
+ * so nothing is looked up when a key comes in. Calls don't wait for their
+ * reply. The connection is made again, with backoff, when it is lost.
+ */
+class MprisBridge {
+
+	public:
+
+		MprisBridge();
+		virtual ~MprisBridge();
+
+		/**
+		 * Connects to bus, "session" for the session bus or else a D-Bus
+		 * address, throws std::runtime_error if built without D-Bus
+		 */
+		void start(const std::string & bus);
+		void stop();
+
+		bool enabled() const { return !bus.empty(); };
+
+		/**
+		 * Whether key goes to a player, false while there is none
+		 */
+		bool handles(CEC::cec_user_control_code key) const;
+
+		/**
+		 * Calls the method for key on the active player, without waiting
+		 */
+		void post(CEC::cec_user_control_code key);
+
+	private:
+
+		// Not implemented
+		MprisBridge(MprisBridge const&);
+		void operator=(MprisBridge const&);
+
+		std::string bus;
+		std::atomic<bool> havePlayer;
+
+		// Methods to call, guarded by lock
+		boost::mutex lock;
+		std::deque<const char *> queue;
+		bool stopping;
+		int wake[2]; // wakes the thread from poll
+
+		boost::thread thread;
+		void run();
+
+		// Only used by the thread
+		DBusConnection *connection;
+		std::vector<DBusWatch *> watches;
+		std::map<DBusTimeout *, boost::chrono::steady_clock::time_point> timeouts;
+
+		bool connect();
+		void disconnect();
+		void dispatch(int timeout);
+
+		struct Player
+		{
+			Player() : playing(false), seen(0) {};
+
+			std::string owner;
+			bool playing;
+			unsigned long seen; // when it last did something, the latest wins
+		};
+		std::map<std::string, Player> players; // by well known name
+		unsigned long activity;
+
+		const std::string * active() const;
+		void discovered(const std::string & name, const std::string & owner);
+		void vanished(const std::string & name);
+		void call(const char *method);
+
+		typedef void (MprisBridge::*ReplyHandler)(const std::string & name, DBusMessage *reply);
+		void call(DBusMessage *message, ReplyHandler handler, const std::string & name);
+		void onNames(const std::string & name, DBusMessage *reply);
+		void onOwner(const std::string & name, DBusMessage *reply);
+		void onStatus(const std::string & name, DBusMessage *reply);
+		void onCalled(const std::string & name, DBusMessage *reply);
+		void onSignal(DBusMessage *message);
+
+		friend struct MprisCallbacks;
+};
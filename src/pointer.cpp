@@ -0,0 +1,164 @@
+/**
+ * pointer.cpp
+ *
+ * Virtual pointer mode, moving a relative mouse with the remote's arrow keys.
+ */
+#include "pointer.h"
+#include "uinput.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+static Logger logger = Logger::getInstance("pointer");
+
+// 120 Hz
+const Pointer::clock::duration Pointer::period = boost::chrono::microseconds(8333);
+
+// Speed curve, in pixels per second: starts slow for precise positioning, and
+// speeds up at a constant rate while a direction is held
+static const double startSpeed   = 150.0;
+static const double acceleration = 1200.0;
+static const double maxSpeed     = 1800.0;
+
+struct Direction {
+	cec_user_control_code keycode;
+	int x;
+	int y;
+};
+
+static const Direction directions[] = {
+	{ CEC_USER_CONTROL_CODE_UP,          0, -1 },
+	{ CEC_USER_CONTROL_CODE_DOWN,        0,  1 },
+	{ CEC_USER_CONTROL_CODE_LEFT,       -1,  0 },
+	{ CEC_USER_CONTROL_CODE_RIGHT,       1,  0 },
+	{ CEC_USER_CONTROL_CODE_RIGHT_UP,    1, -1 },
+	{ CEC_USER_CONTROL_CODE_RIGHT_DOWN,  1,  1 },
+	{ CEC_USER_CONTROL_CODE_LEFT_UP,    -1, -1 },
+	{ CEC_USER_CONTROL_CODE_LEFT_DOWN,  -1,  1 },
+};
+
+#define DIRECTIONS (sizeof(directions) / sizeof(directions[0]))
+
+Pointer::Pointer(UInput & uinput) : uinput(uinput), active(false), held(0), button(false),
+	maxHold(clock::duration::zero()), remainderX(0), remainderY(0) {}
+
+void Pointer::toggle() {
+	reset();
+	active = !active;
+	LOG4CPLUS_INFO(logger, "Pointer mode " << (active ? "on" : "off"));
+}
+
+void Pointer::reset() {
+	held = 0;
+	remainderX = remainderY = 0;
+
+	if (button) {
+		button = false;
+		uinput.send_event(EV_KEY, BTN_LEFT, EV_KEY_RELEASED);
+		uinput.sync();
+	}
+}
+
+bool Pointer::key(cec_user_control_code keycode, bool pressed, clock::time_point now) {
+	if (keycode == CEC_USER_CONTROL_CODE_SELECT) {
+		if (pressed != button) {
+			button = pressed;
+			uinput.send_event(EV_KEY, BTN_LEFT, pressed ? EV_KEY_PRESSED : EV_KEY_RELEASED);
+			uinput.sync();
+		}
+		return true;
+	}
+
+	for (size_t i = 0; i < DIRECTIONS; i++) {
+		if (directions[i].keycode != keycode)
+			continue;
+
+		if (pressed && !held) {
+			// Start moving, the speed curve starts over
+			heldSince = lastTick = now;
+			remainderX = remainderY = 0;
+		}
+
+		if (pressed) {
+			held |= 1u << i;
+			lastPress = now;
+		} else {
+			held &= ~(1u << i);
+		}
+		return true;
+	}
+
+	return false;
+}
+
+void Pointer::tick(clock::time_point now) {
+	if (!held)
+		return;
+
+	if (maxHold != clock::duration::zero() && now - lastPress >= maxHold) {
+		LOG4CPLUS_WARN(logger, "Direction held for too long, stopping the pointer");
+		held = 0;
+		return;
+	}
+
+	// Don't jump after a long stall
+	double dt   = std::min(boost::chrono::duration<double>(now - lastTick).count(), 0.1);
+	double time = boost::chrono::duration<double>(now - heldSince).count();
+	double speed = std::min(startSpeed + acceleration * time, maxSpeed);
+	lastTick = now;
+
+	int x = 0, y = 0;
+	for (size_t i = 0; i < DIRECTIONS; i++) {
+		if (held & (1u << i)) {
+			x += directions[i].x;
+			y += directions[i].y;
+		}
+	}
+	x = std::max(-1, std::min(x, 1));
+	y = std::max(-1, std::min(y, 1));
+
+	remainderX += x * speed * dt;
+	remainderY += y * speed * dt;
+	int dx = (int) remainderX;
+	int dy = (int) remainderY;
+	remainderX -= dx;
+	remainderY -= dy;
+
+	if (dx == 0 && dy == 0)
+		return;
+
+	// The whole tick goes out in a single write
+	struct input_event events[3];
+	size_t count = 0;
+	memset(events, 0, sizeof(events));
+	if (dx) {
+		events[count].type  = EV_REL;
+		events[count].code  = REL_X;
+		events[count].value = dx;
+		count++;
+	}
+	if (dy) {
+		events[count].type  = EV_REL;
+		events[count].code  = REL_Y;
+		events[count].value = dy;
+		count++;
+	}
+	events[count].type  = EV_SYN;
+	events[count].code  = SYN_REPORT;
+	count++;
+
+	try {
+		uinput.send_events(events, count);
+	} catch (std::runtime_error &) {
+		// Rather than failing again 120 times a second, the next press starts it again
+		held = 0;
+		throw;
+	}
+}
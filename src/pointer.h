@@ -0,0 +1,75 @@
+#include <libcec/cectypes.h>
+
+#include <boost/chrono.hpp>
+
+class UInput;
+
+/**
+ * Drives a relative pointer from the CEC arrow keys: while a direction is held,
+ * the pointer moves at a fixed tick rate and speeds up the longer it is held.
+ * SELECT is the left mouse button.
+ */
+class Pointer {
+
+	public:
+
+		typedef boost::chrono::steady_clock clock;
+
+		Pointer(UInput & uinput);
+
+		bool enabled() const { return active; };
+
+		/**
+		 * Stop moving when a direction hasn't been pressed or repeated for
+		 * this long, as its release may have been lost. Zero to never.
+		 */
+		void setMaxHold(clock::duration maxHold) {this->maxHold = maxHold;};
+
+		/**
+		 * Switches pointer mode on or off, releasing anything held
+		 */
+		void toggle();
+
+		/**
+		 * Handles a CEC key press (or repeat) or release, returns false when
+		 * the key has nothing to do with the pointer
+		 */
+		bool key(CEC::cec_user_control_code keycode, bool pressed, clock::time_point now);
+
+		/**
+		 * Moves the pointer, call once deadline() has passed. Stops it and
+		 * throws when the move can't be written.
+		 */
+		void tick(clock::time_point now);
+
+		/**
+		 * When the next tick is due, time_point::max() when not moving
+		 */
+		clock::time_point deadline() const { return held ? lastTick + period : clock::time_point::max(); };
+
+		/**
+		 * Stops moving and lets go of the button
+		 */
+		void reset();
+
+	private:
+
+		UInput & uinput;
+		bool active;
+
+		unsigned held;   // bit per direction key that is down
+		bool button;
+
+		clock::time_point heldSince;
+		clock::time_point lastPress;
+		clock::duration maxHold;
+		clock::time_point lastTick;
+		double remainderX;  // sub pixel motion carried over to the next tick
+		double remainderY;
+
+		static const clock::duration period;
+
+		// Not implemented
+		Pointer(Pointer const&);
+		void operator=(Pointer const&);
+};
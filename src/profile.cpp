@@ -0,0 +1,204 @@
+/**
+ * profile.cpp
+ *
+ * The trace puts the phases the main thread runs one after the other on one
+ * track, and the ones overlapping them (negotiation runs alongside Open, the
+ * first key long after) on tracks of their own, so every track nests.
+ */
+#include "profile.h"
+
+#include <fstream>
+#include <sstream>
+
+#include <unistd.h>
+
+#include <boost/thread/lock_guard.hpp>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace log4cplus;
+
+using std::ostream;
+using std::string;
+
+static Logger logger = Logger::getInstance("profile");
+
+static const char *phaseNames[StartupProfile::PHASE_MAX][2] = {
+	{ "libcec_init",  "LibCecInitialise" },
+	{ "video_init",   "InitVideoStandalone" },
+	{ "detect",       "DetectAdapters" },
+	{ "open",         "ICECAdapter::Open" },
+	{ "negotiate",    "logical address negotiation" },
+	{ "uinput",       "UInput" },
+	{ "make_active",  "makeActive" },
+	{ "first_key",    "first key" },
+};
+
+// Trace track of each phase
+static const int phaseTracks[StartupProfile::PHASE_MAX] = { 1, 1, 1, 1, 2, 1, 1, 3 };
+static const char *trackNames[] = { "", "startup", "negotiation", "keys" };
+
+StartupProfile & StartupProfile::instance() {
+	static StartupProfile profile;
+	return profile;
+}
+
+StartupProfile::StartupProfile() : origin(clock::now()), readyAt(clock::time_point::min()), enabled(false), reported(0) {
+	for (int p = 0; p < PHASE_MAX; p++) {
+		begins[p] = clock::time_point::min();
+		recorded[p] = false;
+	}
+}
+
+void StartupProfile::begin(Phase phase) {
+	if (done(phase))
+		return;
+
+	clock::time_point now = clock::now();
+	boost::lock_guard<boost::mutex> guard(lock);
+	begins[phase] = now;
+}
+
+void StartupProfile::end(Phase phase) {
+	if (done(phase))
+		return;
+
+	clock::time_point now = clock::now();
+	boost::lock_guard<boost::mutex> guard(lock);
+	if (begins[phase] == clock::time_point::min() || recorded[phase])
+		return;
+	ends[phase] = now;
+	recorded[phase].store(true, std::memory_order_release);
+}
+
+void StartupProfile::span(Phase phase, clock::time_point begin, clock::time_point end) {
+	if (done(phase))
+		return;
+
+	boost::lock_guard<boost::mutex> guard(lock);
+	if (recorded[phase])
+		return;
+	begins[phase] = begin;
+	ends[phase] = end;
+	recorded[phase].store(true, std::memory_order_release);
+}
+
+void StartupProfile::ready() {
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		if (readyAt != clock::time_point::min())
+			return;
+		readyAt = clock::now();
+	}
+	report();
+}
+
+void StartupProfile::enable(const string & filename) {
+	boost::lock_guard<boost::mutex> guard(lock);
+	enabled = true;
+	traceFile = filename;
+}
+
+double StartupProfile::millis(clock::time_point t) const {
+	return boost::chrono::duration<double, boost::milli>(t - origin).count();
+}
+
+void StartupProfile::report() {
+	std::ostringstream summary;
+	summary.setf(std::ios::fixed);
+	summary.precision(1);
+
+	string filename;
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+
+		size_t count = readyAt != clock::time_point::min();
+		for (int p = 0; p < PHASE_MAX; p++)
+			count += recorded[p];
+		if (count <= reported)
+			return;
+		reported = count;
+
+		const char *separator = "";
+		for (int p = 0; p < PHASE_FIRST_KEY; p++) {
+			if (!recorded[p])
+				continue;
+			summary << separator << phaseNames[p][1] << " " << millis(ends[p]) - millis(begins[p]) << "ms";
+			separator = ", ";
+		}
+		if (readyAt != clock::time_point::min()) {
+			summary << separator << "ready at " << millis(readyAt) << "ms";
+			separator = ", ";
+		}
+		if (recorded[PHASE_FIRST_KEY]) {
+			summary << separator << phaseNames[PHASE_FIRST_KEY][1] << " " << millis(ends[PHASE_FIRST_KEY]) - millis(begins[PHASE_FIRST_KEY])
+			        << "ms at " << millis(ends[PHASE_FIRST_KEY]) << "ms";
+		}
+
+		if (enabled)
+			filename = traceFile;
+	}
+
+	if (enabled)
+		LOG4CPLUS_INFO(logger, "Startup: " << summary.str());
+	else
+		LOG4CPLUS_DEBUG(logger, "Startup: " << summary.str());
+
+	if (filename.empty())
+		return;
+
+	std::ofstream out(filename.c_str());
+	writeTrace(out);
+	if (!out)
+		LOG4CPLUS_ERROR(logger, "Failed to write startup trace to " << filename);
+}
+
+ostream & StartupProfile::writeTrace(ostream & out) const {
+	boost::lock_guard<boost::mutex> guard(lock);
+	int pid = getpid();
+
+	// Chrome trace event format, timestamps and durations in microseconds
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":1,\"args\":{\"name\":\"libcec-daemon\"}}";
+	for (int t = 1; t < (int) (sizeof(trackNames) / sizeof(trackNames[0])); t++) {
+		out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":" << pid << ",\"tid\":" << t
+		    << ",\"args\":{\"name\":\"" << trackNames[t] << "\"}}";
+	}
+
+	for (int p = 0; p < PHASE_MAX; p++) {
+		if (!recorded[p])
+			continue;
+		out << ",\n{\"name\":\"" << phaseNames[p][1] << "\",\"cat\":\"startup\",\"ph\":\"X\",\"pid\":" << pid
+		    << ",\"tid\":" << phaseTracks[p]
+		    << ",\"ts\":" << boost::chrono::duration_cast<boost::chrono::microseconds>(begins[p] - origin).count()
+		    << ",\"dur\":" << boost::chrono::duration_cast<boost::chrono::microseconds>(ends[p] - begins[p]).count() << "}";
+	}
+
+	if (readyAt != clock::time_point::min()) {
+		out << ",\n{\"name\":\"ready\",\"cat\":\"startup\",\"ph\":\"i\",\"s\":\"p\",\"pid\":" << pid << ",\"tid\":1"
+		    << ",\"ts\":" << boost::chrono::duration_cast<boost::chrono::microseconds>(readyAt - origin).count() << "}";
+	}
+
+	return out << "\n]}\n";
+}
+
+ostream & StartupProfile::writeMetrics(ostream & out) const {
+	boost::lock_guard<boost::mutex> guard(lock);
+
+	out << "# HELP libcec_daemon_startup_phase_seconds Time the first run of each startup phase took\n"
+	    << "# TYPE libcec_daemon_startup_phase_seconds gauge\n";
+	for (int p = 0; p < PHASE_MAX; p++) {
+		if (!recorded[p])
+			continue;
+		out << "libcec_daemon_startup_phase_seconds{phase=\"" << phaseNames[p][0] << "\"} "
+		    << boost::chrono::duration<double>(ends[p] - begins[p]).count() << "\n";
+	}
+
+	if (readyAt != clock::time_point::min()) {
+		out << "# HELP libcec_daemon_startup_ready_seconds Time from starting until the remote worked\n"
+		    << "# TYPE libcec_daemon_startup_ready_seconds gauge\n"
+		    << "libcec_daemon_startup_ready_seconds " << boost::chrono::duration<double>(readyAt - origin).count() << "\n";
+	}
+	return out;
+}
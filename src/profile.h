@@ -0,0 +1,97 @@
+#include <atomic>
+#include <ostream>
+#include <string>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ * Monotonic durations of the startup phases, from libcec being initialised
+ * up to the first key press reaching uinput. Only the first run of each phase
+ * is kept, so reopening the adapter later doesn't overwrite them.
+ *
+ * Always recorded, it's a handful of clock reads. Reported as one log line,
+ * optionally as a Chrome trace event file (chrome://tracing or Perfetto), and
+ * in the metrics.
+ */
+class StartupProfile {
+
+	public:
+
+		enum Phase
+		{
+			PHASE_LIBCEC_INIT, // LibCecInitialise
+			PHASE_VIDEO_INIT,  // InitVideoStandalone
+			PHASE_DETECT,      // DetectAdapters
+			PHASE_OPEN,        // ICECAdapter::Open
+			PHASE_NEGOTIATE,   // from opening until we have a logical address
+			PHASE_UINPUT,      // uinput device opened, set up and created
+			PHASE_ACTIVATE,    // makeActive
+			PHASE_FIRST_KEY,   // first key press, from libcec to uinput
+			PHASE_MAX,
+		};
+
+		typedef boost::chrono::steady_clock clock;
+
+		/**
+		 * Times are relative to the first call
+		 */
+		static StartupProfile & instance();
+
+		void begin(Phase phase);
+		void end(Phase phase);
+		void span(Phase phase, clock::time_point begin, clock::time_point end);
+		bool done(Phase phase) const { return recorded[phase].load(std::memory_order_acquire); };
+
+		/**
+		 * Times a phase for as long as it is in scope
+		 */
+		class Scope
+		{
+			public:
+				Scope(Phase phase) : phase(phase) { StartupProfile::instance().begin(phase); };
+				~Scope() { StartupProfile::instance().end(phase); };
+			private:
+				Phase phase;
+		};
+
+		/**
+		 * The daemon is up and the remote works
+		 */
+		void ready();
+
+		/**
+		 * Logs the summary at INFO rather than DEBUG, and writes the trace
+		 * to filename too unless it is empty
+		 */
+		void enable(const std::string & filename);
+
+		/**
+		 * Logs the summary, and writes the trace, if anything was recorded since last time
+		 */
+		void report();
+
+		std::ostream & writeTrace(std::ostream & out) const;
+		std::ostream & writeMetrics(std::ostream & out) const;
+
+	private:
+
+		StartupProfile();
+
+		// Not implemented to avoid copying the singleton
+		StartupProfile(StartupProfile const&);
+		void operator=(StartupProfile const&);
+
+		mutable boost::mutex lock;
+		clock::time_point origin;
+		clock::time_point begins[PHASE_MAX]; // min() until begun
+		clock::time_point ends[PHASE_MAX];
+		clock::time_point readyAt;           // min() until ready
+		std::atomic<bool> recorded[PHASE_MAX];
+
+		bool enabled;
+		std::string traceFile;
+		size_t reported; // phases recorded, and ready, at the last report
+
+		double millis(clock::time_point t) const;
+};
@@ -0,0 +1,73 @@
+/**
+ * ratelimit.cpp
+ */
+#include "ratelimit.h"
+#include "libcec.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <map>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+static Logger logger = Logger::getInstance("ratelimit");
+
+static const char * keyName(cec_user_control_code key) {
+	std::map<cec_user_control_code, const char *>::const_iterator it = Cec::cecUserControlCodeName.find(key);
+	return it != Cec::cecUserControlCodeName.end() ? it->second : "UNKNOWN";
+}
+
+RepeatLimiter::RepeatLimiter() : rate(0), burst(0) {}
+
+void RepeatLimiter::setLimit(int rate, int burst) {
+	this->rate  = rate > 0 ? rate : 0;
+	this->burst = burst > 1 ? burst : 1;
+}
+
+void RepeatLimiter::pressed(cec_user_control_code key, clock::time_point now) {
+	if (key < 0 || key > CEC_USER_CONTROL_CODE_MAX)
+		return;
+
+	report(key);
+	Bucket & bucket = buckets[key];
+	bucket.tokens   = burst;
+	bucket.refilled = now;
+}
+
+bool RepeatLimiter::repeat(cec_user_control_code key, clock::time_point now) {
+	if (rate == 0 || key < 0 || key > CEC_USER_CONTROL_CODE_MAX)
+		return true;
+
+	Bucket & bucket = buckets[key];
+	bucket.tokens = std::min(burst, bucket.tokens + rate * boost::chrono::duration<double>(now - bucket.refilled).count());
+	bucket.refilled = now;
+
+	if (bucket.tokens >= 1) {
+		bucket.tokens -= 1;
+		return true;
+	}
+
+	if (bucket.suppressed++ == 0)
+		LOG4CPLUS_WARN(logger, keyName(key) << " repeats faster than " << rate << " a second, collapsing the repeats");
+	Metrics::instance().inc(Metrics::KEY_REPEATS_SUPPRESSED);
+	return false;
+}
+
+void RepeatLimiter::released(cec_user_control_code key) {
+	if (key < 0 || key > CEC_USER_CONTROL_CODE_MAX)
+		return;
+
+	report(key);
+}
+
+void RepeatLimiter::report(cec_user_control_code key) {
+	Bucket & bucket = buckets[key];
+	if (bucket.suppressed) {
+		LOG4CPLUS_INFO(logger, "Left out " << bucket.suppressed << " repeats of " << keyName(key));
+		bucket.suppressed = 0;
+	}
+}
@@ -0,0 +1,53 @@
+#include <libcec/cectypes.h>
+
+#include <boost/chrono.hpp>
+
+/**
+ * Collapses runaway key repeats, some TVs send hundreds a second for a key
+ * that isn't even held.
+ *
+ * Every CEC key has a bucket of burst repeats, refilled at rate a second. A
+ * repeat takes one, and is left out while the bucket is empty. A press fills
+ * the bucket again, and presses and releases are never left out.
+ *
+ * Only used from the main loop.
+ */
+class RepeatLimiter {
+
+	public:
+
+		typedef boost::chrono::steady_clock clock;
+
+		RepeatLimiter();
+
+		/**
+		 * Repeats a second, and how many may come at once, a rate of 0 lets all through
+		 */
+		void setLimit(int rate, int burst);
+
+		void pressed(CEC::cec_user_control_code key, clock::time_point now);
+
+		/**
+		 * Returns false when the repeat is to be left out
+		 */
+		bool repeat(CEC::cec_user_control_code key, clock::time_point now);
+
+		void released(CEC::cec_user_control_code key);
+
+	private:
+
+		struct Bucket
+		{
+			Bucket() : tokens(0), suppressed(0) {};
+
+			double tokens;
+			clock::time_point refilled;
+			unsigned suppressed; // since the key was pressed
+		};
+
+		Bucket buckets[CEC::CEC_USER_CONTROL_CODE_MAX + 1];
+		double rate;
+		double burst;
+
+		void report(CEC::cec_user_control_code key);
+};
@@ -0,0 +1,120 @@
+/**
+ * realtime.cpp
+ */
+#include "realtime.h"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("realtime");
+
+// Stack that is faulted in up front, so the dispatch thread never page faults on it
+#define PREFAULT_STACK (256 * 1024)
+
+RealTime::RealTime() : policy(SCHED_FIFO), priority(0), cpu(-1), pinned(false) {
+	CPU_ZERO(&original);
+}
+
+void RealTime::setPolicy(const string & name) {
+	if (name == "fifo")
+		policy = SCHED_FIFO;
+	else if (name == "rr")
+		policy = SCHED_RR;
+	else
+		throw std::runtime_error("Unknown real-time policy " + name + ", use fifo or rr");
+}
+
+void RealTime::setPriority(int priority) {
+	int min = sched_get_priority_min(policy);
+	int max = sched_get_priority_max(policy);
+	if (priority != 0 && (priority < min || priority > max)) {
+		throw std::runtime_error("Real-time priority must be between " + std::to_string(min) + " and " + std::to_string(max));
+	}
+	this->priority = priority;
+}
+
+void RealTime::apply() {
+	if (cpu >= 0)
+		pin();
+
+	if (!enabled())
+		return;
+
+	lockMemory();
+	schedule();
+}
+
+static void prefaultStack() {
+	volatile char stack[PREFAULT_STACK];
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+void RealTime::lockMemory() {
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		struct rlimit limit;
+		getrlimit(RLIMIT_MEMLOCK, &limit);
+		LOG4CPLUS_WARN(logger, "Failed to lock memory (" << strerror(errno) << "), memory lock limit is "
+			<< limit.rlim_cur << " bytes; needs CAP_IPC_LOCK or LimitMEMLOCK=infinity");
+		return;
+	}
+
+	prefaultStack();
+	LOG4CPLUS_DEBUG(logger, "Memory locked");
+}
+
+void RealTime::schedule() {
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+
+	// Hooks and helper threads started later must not inherit real-time priority
+	if (sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param) < 0) {
+		LOG4CPLUS_WARN(logger, "Failed to switch to real-time priority " << priority << " (" << strerror(errno)
+			<< "), staying at normal priority; needs CAP_SYS_NICE or LimitRTPRIO");
+		return;
+	}
+
+	LOG4CPLUS_INFO(logger, "Running with " << (policy == SCHED_RR ? "SCHED_RR" : "SCHED_FIFO") << " priority " << priority);
+}
+
+void RealTime::pin() {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	if (sched_getaffinity(0, sizeof(original), &original) < 0 || sched_setaffinity(0, sizeof(set), &set) < 0) {
+		LOG4CPLUS_WARN(logger, "Failed to pin to CPU " << cpu << ": " << strerror(errno));
+		return;
+	}
+
+	pinned = true;
+	LOG4CPLUS_INFO(logger, "Pinned to CPU " << cpu);
+}
+
+RealTime::Unpinned::Unpinned(RealTime & realtime) : realtime(realtime) {
+	if (realtime.pinned)
+		sched_setaffinity(0, sizeof(realtime.original), &realtime.original);
+}
+
+RealTime::Unpinned::~Unpinned() {
+	if (!realtime.pinned)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(realtime.cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
@@ -0,0 +1,63 @@
+#include <string>
+
+#include <sched.h>
+
+/**
+ * Opt-in real-time mode for the thread that dispatches key presses to uinput:
+ * locked memory, a real-time scheduling policy and CPU pinning. Every step
+ * just warns when the process lacks the privileges for it.
+ */
+class RealTime {
+
+	private:
+
+		int policy;
+		int priority; // 0 when disabled
+		int cpu;      // -1 for any
+		bool pinned;
+		cpu_set_t original; // the CPUs we could run on before pin()
+
+		void lockMemory();
+		void schedule();
+		void pin();
+
+	public:
+
+		RealTime();
+
+		/**
+		 * "fifo" or "rr"
+		 */
+		void setPolicy(const std::string & name);
+		void setPriority(int priority);
+		void setCpu(int cpu) {this->cpu = cpu;};
+
+		bool enabled() const { return priority > 0; };
+
+		/**
+		 * Applies the settings to the calling thread
+		 */
+		void apply();
+
+		/**
+		 * Threads and processes inherit the CPU pin, so while one of these
+		 * exists the calling thread may run on any CPU again, for whatever
+		 * it starts meanwhile. The real-time policy needs no such care, it is
+		 * reset for them anyway.
+		 */
+		class Unpinned {
+
+			public:
+
+				Unpinned(RealTime & realtime);
+				~Unpinned();
+
+			private:
+
+				RealTime & realtime;
+
+				// Not implemented
+				Unpinned(Unpinned const&);
+				void operator=(Unpinned const&);
+		};
+};
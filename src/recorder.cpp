@@ -0,0 +1,315 @@
+/**
+ * recorder.cpp
+ *
+ * Flight recorder: always on, fixed size record of recent CEC activity that is
+ * written out on SIGUSR2, on request or when the daemon crashes.
+ */
+#include "recorder.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::endl;
+using std::string;
+
+static Logger logger = Logger::getInstance("recorder");
+
+static const char recorderMagic[8] = { 'C', 'E', 'C', 'F', 'R', 0, 0, 1 };
+
+struct FlightRecorderHeader {
+	char     magic[8];
+	uint32_t recordSize;
+	uint32_t records;
+	uint64_t head;
+	uint64_t monotonic; // CLOCK_MONOTONIC and CLOCK_REALTIME at dump time, in nanoseconds
+	uint64_t realtime;
+};
+
+static const int fatalSignals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+
+static uint64_t now(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+FlightRecorder & FlightRecorder::instance() {
+	static FlightRecorder recorder;
+	return recorder;
+}
+
+FlightRecorder::FlightRecorder() : ring(NULL), mask(0), head(0) {
+	path[0] = '\0';
+	tmpPath[0] = '\0';
+}
+
+void FlightRecorder::setup(size_t megabytes, const string & filename) {
+	size_t records = (megabytes << 20) / sizeof(FlightRecord);
+	if (records == 0) {
+		throw std::runtime_error("Flight recorder size must be at least 1MB");
+	}
+
+	// The dump is written next to it first, see dump()
+	if (filename.size() + 4 >= sizeof(tmpPath)) {
+		throw std::runtime_error("Flight recorder file name is too long");
+	}
+
+	// The default directory in /run doesn't exist until the first start
+	size_t slash = filename.rfind('/');
+	if (slash != string::npos && slash > 0 && mkdir(filename.substr(0, slash).c_str(), 0700) < 0 && errno != EEXIST) {
+		LOG4CPLUS_WARN(logger, "Failed to create " << filename.substr(0, slash) << ": " << strerror(errno));
+	}
+
+	// Round down to a power of two, so the ring index is a mask
+	size_t size = 1;
+	while (size * 2 <= records)
+		size *= 2;
+
+	// Value initialised, so every page is touched now rather than on the key path
+	ring = new FlightRecord[size]();
+	mask = size - 1;
+	strncpy(path, filename.c_str(), sizeof(path) - 1);
+	strncpy(tmpPath, (filename + ".tmp").c_str(), sizeof(tmpPath) - 1);
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = &FlightRecorder::signalHandler;
+	sigemptyset(&action.sa_mask);
+
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR2, &action, NULL);
+
+	// Fatal signals: dump once, then let the default action take over
+	action.sa_flags = SA_RESETHAND;
+	for (size_t i = 0; i < sizeof(fatalSignals) / sizeof(fatalSignals[0]); i++)
+		sigaction(fatalSignals[i], &action, NULL);
+
+	LOG4CPLUS_INFO(logger, "Recording the last " << size << " events, dumped to " << path);
+}
+
+void FlightRecorder::record(Type type, const uint8_t *data, size_t size) {
+	if (!ring)
+		return;
+
+	uint64_t n = head.fetch_add(1, std::memory_order_relaxed);
+	FlightRecord & r = ring[n & mask];
+
+	__atomic_store_n(&r.seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	r.time = now(CLOCK_MONOTONIC);
+	r.type = type;
+	r.size = std::min(size, sizeof(r.data));
+	memcpy(r.data, data, r.size);
+
+	__atomic_store_n(&r.seq, (uint32_t) (n + 1), __ATOMIC_RELEASE);
+}
+
+void FlightRecorder::frame(const cec_command & command) {
+	uint8_t data[sizeof(((FlightRecord *) 0)->data)];
+	size_t size = 0;
+
+	data[size++] = (uint8_t) ((command.initiator & 0xF) << 4 | (command.destination & 0xF));
+	if (command.opcode_set)
+		data[size++] = (uint8_t) command.opcode;
+	for (uint8_t i = 0; i < command.parameters.size && size < sizeof(data); i++)
+		data[size++] = command.parameters.data[i];
+
+	record(RECORD_FRAME, data, size);
+}
+
+void FlightRecorder::key(const cec_keypress & key) {
+	uint8_t data[5];
+	uint32_t duration = key.duration;
+
+	data[0] = (uint8_t) key.keycode;
+	memcpy(data + 1, &duration, sizeof(duration));
+	record(RECORD_KEY, data, sizeof(data));
+}
+
+void FlightRecorder::alert(libcec_alert alert) {
+	uint8_t data = (uint8_t) alert;
+	record(RECORD_ALERT, &data, 1);
+}
+
+void FlightRecorder::state(State state) {
+	uint8_t data = (uint8_t) state;
+	record(RECORD_STATE, &data, 1);
+}
+
+/**
+ * write() everything, retrying on short writes. Async signal safe.
+ */
+static bool writeAll(int fd, const void *buf, size_t len) {
+	const char *p = (const char *) buf;
+	while (len > 0) {
+		ssize_t ret = write(fd, p, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return false;
+		p += ret;
+		len -= ret;
+	}
+	return true;
+}
+
+bool FlightRecorder::dump() {
+	if (!ring)
+		return false;
+
+	int saved = errno;
+
+	FlightRecorderHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, recorderMagic, sizeof(header.magic));
+	header.recordSize = sizeof(FlightRecord);
+	header.records    = (uint32_t) (mask + 1);
+	header.head       = head.load(std::memory_order_relaxed);
+	header.monotonic  = now(CLOCK_MONOTONIC);
+	header.realtime   = now(CLOCK_REALTIME);
+
+	// Written to a new file and renamed over the dump, so whatever someone put
+	// at either path beforehand, a symlink included, is replaced rather than written to
+	bool ok = false;
+	int fd = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (fd < 0 && errno == EEXIST) {
+		// Left by a dump that was cut short
+		unlink(tmpPath);
+		fd = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+	}
+	if (fd >= 0) {
+		ok = writeAll(fd, &header, sizeof(header))
+		  && writeAll(fd, ring, (mask + 1) * sizeof(FlightRecord));
+		close(fd);
+		ok = ok && rename(tmpPath, path) == 0;
+		if (!ok)
+			unlink(tmpPath);
+	}
+
+	errno = saved;
+	return ok;
+}
+
+void FlightRecorder::signalHandler(int sigNum) {
+	FlightRecorder::instance().dump();
+
+	if (sigNum != SIGUSR2) {
+		// SA_RESETHAND put the default action back, so this terminates us
+		raise(sigNum);
+	}
+}
+
+static const char *typeName(uint8_t type) {
+	switch (type) {
+		case FlightRecorder::RECORD_FRAME: return "frame";
+		case FlightRecorder::RECORD_KEY:   return "key";
+		case FlightRecorder::RECORD_ALERT: return "alert";
+		case FlightRecorder::RECORD_STATE: return "state";
+	}
+	return "unknown";
+}
+
+static const char *stateName(uint8_t state) {
+	switch (state) {
+		case FlightRecorder::STATE_OPENING:     return "opening";
+		case FlightRecorder::STATE_OPENED:      return "opened";
+		case FlightRecorder::STATE_ACTIVATED:   return "activated";
+		case FlightRecorder::STATE_DEACTIVATED: return "deactivated";
+		case FlightRecorder::STATE_STANDBY:     return "standby";
+		case FlightRecorder::STATE_RESTART:     return "restart";
+		case FlightRecorder::STATE_EXIT:        return "exit";
+		case FlightRecorder::STATE_CLOSED:      return "closed";
+		case FlightRecorder::STATE_PING_FAILED: return "ping-failed";
+	}
+	return "unknown";
+}
+
+static bool bySeq(const FlightRecord & a, const FlightRecord & b) {
+	return a.time < b.time || (a.time == b.time && a.seq < b.seq);
+}
+
+bool FlightRecorder::decode(std::istream & in, std::ostream & out) {
+	FlightRecorderHeader header;
+
+	if (!in.read((char *) &header, sizeof(header)) || memcmp(header.magic, recorderMagic, sizeof(header.magic)) != 0
+			|| header.recordSize != sizeof(FlightRecord)) {
+		LOG4CPLUS_ERROR(logger, "Not a flight recorder dump");
+		return false;
+	}
+
+	// dump() always writes a whole ring, whose size is a power of two
+	if (header.records == 0 || (header.records & (header.records - 1)) != 0) {
+		LOG4CPLUS_ERROR(logger, "Corrupt flight recorder dump, ring of " << header.records << " records");
+		return false;
+	}
+
+	// Grown as records are read, so a bad count can't allocate more than the file holds
+	std::vector<FlightRecord> records;
+	FlightRecord record;
+	while (records.size() < header.records && in.read((char *) &record, sizeof(record)))
+		records.push_back(record);
+	if (records.size() < header.records) {
+		LOG4CPLUS_ERROR(logger, "Truncated flight recorder dump");
+		return false;
+	}
+
+	records.erase(std::remove_if(records.begin(), records.end(),
+		[](const FlightRecord & r) { return r.seq == 0; }), records.end());
+	std::sort(records.begin(), records.end(), bySeq);
+
+	out << records.size() << " records, " << header.head << " recorded in total" << endl;
+
+	for (std::vector<FlightRecord>::const_iterator r = records.begin(); r != records.end(); ++r) {
+		// Convert to wall clock time using the clocks sampled at dump time
+		double seconds = ((double) header.realtime - ((double) header.monotonic - (double) r->time)) / 1e9;
+		time_t whole = (time_t) seconds;
+		struct tm tm;
+		char stamp[32];
+		localtime_r(&whole, &tm);
+		strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+
+		out << stamp << "." << std::setw(6) << std::setfill('0') << (int) ((seconds - whole) * 1e6) << std::setfill(' ')
+		    << " " << std::setw(5) << std::left << typeName(r->type) << std::right;
+
+		switch (r->type) {
+			case RECORD_FRAME:
+				out << std::hex << std::setfill('0');
+				for (uint8_t i = 0; i < r->size; i++)
+					out << (i ? ":" : " ") << std::setw(2) << (int) r->data[i];
+				out << std::dec << std::setfill(' ');
+				break;
+			case RECORD_KEY: {
+				uint32_t duration;
+				memcpy(&duration, r->data + 1, sizeof(duration));
+				out << " 0x" << std::hex << (int) r->data[0] << std::dec << " for " << duration << "ms";
+				break;
+			}
+			case RECORD_ALERT:
+				out << " " << (int) r->data[0];
+				break;
+			case RECORD_STATE:
+				out << " " << stateName(r->data[0]);
+				break;
+		}
+		out << endl;
+	}
+
+	return true;
+}
@@ -0,0 +1,95 @@
+#include <libcec/cectypes.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <istream>
+#include <ostream>
+#include <string>
+
+/**
+ * A single entry in the flight recorder, 32 bytes so they pack neatly
+ */
+struct FlightRecord {
+	uint64_t time;     // CLOCK_MONOTONIC, in nanoseconds
+	uint32_t seq;      // low bits of the sequence number + 1, 0 while being written
+	uint8_t  type;
+	uint8_t  size;     // bytes used in data
+	uint8_t  data[18];
+};
+
+/**
+ * Fixed size ring buffer of the most recent CEC traffic, key presses, alerts
+ * and daemon state changes. Recording is lock free and never allocates, and the
+ * ring can be dumped from a signal handler.
+ */
+class FlightRecorder {
+
+	public:
+
+		enum Type
+		{
+			RECORD_FRAME = 1, // data: initiator/destination, opcode, parameters
+			RECORD_KEY,       // data: keycode, duration (ms, 32 bits)
+			RECORD_ALERT,     // data: alert
+			RECORD_STATE,     // data: state
+		};
+
+		enum State
+		{
+			STATE_OPENING = 1,
+			STATE_OPENED,
+			STATE_ACTIVATED,
+			STATE_DEACTIVATED,
+			STATE_STANDBY,
+			STATE_RESTART,
+			STATE_EXIT,
+			STATE_CLOSED,
+			STATE_PING_FAILED,
+		};
+
+		static FlightRecorder & instance();
+
+		/**
+		 * Allocates a ring of megabytes MB, and dumps it to filename on
+		 * SIGUSR2 and on fatal signals
+		 */
+		void setup(size_t megabytes, const std::string & filename);
+
+		void frame(const CEC::cec_command & command);
+		void key(const CEC::cec_keypress & key);
+		void alert(CEC::libcec_alert alert);
+		void state(State state);
+
+		/**
+		 * Writes the ring to the dump file, replacing it. Only uses async
+		 * signal safe calls.
+		 */
+		bool dump();
+
+		const char *filename() const { return path; };
+
+		/**
+		 * Prints a dump file in a human readable form
+		 */
+		static bool decode(std::istream & in, std::ostream & out);
+
+	private:
+
+		FlightRecorder();
+
+		// Not implemented to avoid copying the singleton
+		FlightRecorder(FlightRecorder const&);
+		void operator=(FlightRecorder const&);
+
+		void record(Type type, const uint8_t *data, size_t size);
+
+		static void signalHandler(int sigNum);
+
+		FlightRecord *ring;
+		size_t mask;  // number of records - 1
+		std::atomic<uint64_t> head;
+
+		char path[256];
+		char tmpPath[260]; // path.tmp, made up front as dump() can't allocate
+};
@@ -0,0 +1,500 @@
+/**
+ * rules.cpp
+ *
+ * Maps received CEC commands to actions. Each line of a rules file has the form
+ *
+ *   OPCODE [from=ADDR[,ADDR..]] [to=self|any|ADDR[,ADDR..]] [size=N] [params=XX[:XX..]] [if=active] = ACTION
+ *
+ * where ACTION is one of
+ *
+ *   ignore
+ *   key CEC_KEY
+ *   macro CEC_KEY[,CEC_KEY..]
+ *   hook standby|activate|deactivate
+ *   reply [ADDR] OPCODE[:XX..]
+ *   announce
+ *
+ * announce broadcasts ACTIVE_SOURCE, if we are the active source, and runs the
+ * activate hook.
+ *
+ * Parameter bytes are hexadecimal, "xx" matches any value.
+ */
+#include "rules.h"
+#include "libcec.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::map;
+using std::string;
+using std::vector;
+
+static Logger logger = Logger::getInstance("rules");
+
+// Rules reproducing the behaviour of the original hand written command switch
+static const char *defaultRules[] = {
+	"STANDBY               from=TV to=self                      = hook standby",
+	"REQUEST_ACTIVE_SOURCE from=TV to=self if=active            = announce",
+	"DECK_CONTROL          from=TV to=self size=1 params=03     = key STOP",
+	"DECK_CONTROL          from=TV to=self size=1 params=01     = key FAST_FORWARD",
+	"DECK_CONTROL          from=TV to=self size=1 params=02     = key REWIND",
+	"PLAY                  from=TV to=self size=1 params=24     = key PLAY",
+	"PLAY                  from=TV to=self size=1 params=25     = key PAUSE",
+};
+
+static const map<string, cec_opcode> & opcodeNames() {
+	static map<string, cec_opcode> names;
+
+	if (names.empty()) {
+		names["FEATURE_ABORT"] = CEC_OPCODE_FEATURE_ABORT;
+		names["IMAGE_VIEW_ON"] = CEC_OPCODE_IMAGE_VIEW_ON;
+		names["TEXT_VIEW_ON"] = CEC_OPCODE_TEXT_VIEW_ON;
+		names["RECORD_ON"] = CEC_OPCODE_RECORD_ON;
+		names["RECORD_OFF"] = CEC_OPCODE_RECORD_OFF;
+		names["GIVE_DECK_STATUS"] = CEC_OPCODE_GIVE_DECK_STATUS;
+		names["DECK_STATUS"] = CEC_OPCODE_DECK_STATUS;
+		names["SET_MENU_LANGUAGE"] = CEC_OPCODE_SET_MENU_LANGUAGE;
+		names["STANDBY"] = CEC_OPCODE_STANDBY;
+		names["PLAY"] = CEC_OPCODE_PLAY;
+		names["DECK_CONTROL"] = CEC_OPCODE_DECK_CONTROL;
+		names["USER_CONTROL_PRESSED"] = CEC_OPCODE_USER_CONTROL_PRESSED;
+		names["USER_CONTROL_RELEASE"] = CEC_OPCODE_USER_CONTROL_RELEASE;
+		names["GIVE_OSD_NAME"] = CEC_OPCODE_GIVE_OSD_NAME;
+		names["SET_OSD_NAME"] = CEC_OPCODE_SET_OSD_NAME;
+		names["SYSTEM_AUDIO_MODE_REQUEST"] = CEC_OPCODE_SYSTEM_AUDIO_MODE_REQUEST;
+		names["GIVE_AUDIO_STATUS"] = CEC_OPCODE_GIVE_AUDIO_STATUS;
+		names["SET_SYSTEM_AUDIO_MODE"] = CEC_OPCODE_SET_SYSTEM_AUDIO_MODE;
+		names["REPORT_AUDIO_STATUS"] = CEC_OPCODE_REPORT_AUDIO_STATUS;
+		names["ROUTING_CHANGE"] = CEC_OPCODE_ROUTING_CHANGE;
+		names["ROUTING_INFORMATION"] = CEC_OPCODE_ROUTING_INFORMATION;
+		names["ACTIVE_SOURCE"] = CEC_OPCODE_ACTIVE_SOURCE;
+		names["GIVE_PHYSICAL_ADDRESS"] = CEC_OPCODE_GIVE_PHYSICAL_ADDRESS;
+		names["REPORT_PHYSICAL_ADDRESS"] = CEC_OPCODE_REPORT_PHYSICAL_ADDRESS;
+		names["REQUEST_ACTIVE_SOURCE"] = CEC_OPCODE_REQUEST_ACTIVE_SOURCE;
+		names["SET_STREAM_PATH"] = CEC_OPCODE_SET_STREAM_PATH;
+		names["DEVICE_VENDOR_ID"] = CEC_OPCODE_DEVICE_VENDOR_ID;
+		names["VENDOR_COMMAND"] = CEC_OPCODE_VENDOR_COMMAND;
+		names["VENDOR_REMOTE_BUTTON_DOWN"] = CEC_OPCODE_VENDOR_REMOTE_BUTTON_DOWN;
+		names["VENDOR_REMOTE_BUTTON_UP"] = CEC_OPCODE_VENDOR_REMOTE_BUTTON_UP;
+		names["GIVE_DEVICE_VENDOR_ID"] = CEC_OPCODE_GIVE_DEVICE_VENDOR_ID;
+		names["MENU_REQUEST"] = CEC_OPCODE_MENU_REQUEST;
+		names["MENU_STATUS"] = CEC_OPCODE_MENU_STATUS;
+		names["GIVE_DEVICE_POWER_STATUS"] = CEC_OPCODE_GIVE_DEVICE_POWER_STATUS;
+		names["REPORT_POWER_STATUS"] = CEC_OPCODE_REPORT_POWER_STATUS;
+		names["INACTIVE_SOURCE"] = CEC_OPCODE_INACTIVE_SOURCE;
+		names["CEC_VERSION"] = CEC_OPCODE_CEC_VERSION;
+		names["GET_CEC_VERSION"] = CEC_OPCODE_GET_CEC_VERSION;
+		names["VENDOR_COMMAND_WITH_ID"] = CEC_OPCODE_VENDOR_COMMAND_WITH_ID;
+		names["ABORT"] = CEC_OPCODE_ABORT;
+	}
+
+	return names;
+}
+
+static const map<string, cec_logical_address> & addressNames() {
+	static map<string, cec_logical_address> names;
+
+	if (names.empty()) {
+		names["TV"] = CECDEVICE_TV;
+		names["RECORDER1"] = CECDEVICE_RECORDINGDEVICE1;
+		names["RECORDER2"] = CECDEVICE_RECORDINGDEVICE2;
+		names["TUNER1"] = CECDEVICE_TUNER1;
+		names["PLAYER1"] = CECDEVICE_PLAYBACKDEVICE1;
+		names["AUDIO"] = CECDEVICE_AUDIOSYSTEM;
+		names["TUNER2"] = CECDEVICE_TUNER2;
+		names["TUNER3"] = CECDEVICE_TUNER3;
+		names["PLAYER2"] = CECDEVICE_PLAYBACKDEVICE2;
+		names["RECORDER3"] = CECDEVICE_RECORDINGDEVICE3;
+		names["TUNER4"] = CECDEVICE_TUNER4;
+		names["PLAYER3"] = CECDEVICE_PLAYBACKDEVICE3;
+		names["FREEUSE"] = CECDEVICE_FREEUSE;
+		names["BROADCAST"] = CECDEVICE_BROADCAST;
+	}
+
+	return names;
+}
+
+static bool parseNumber(const string & s, int base, int max, int & value) {
+	char *end;
+
+	if (s.empty())
+		return false;
+
+	long v = strtol(s.c_str(), &end, base);
+	if (*end != '\0' || v < 0 || v > max)
+		return false;
+
+	value = (int) v;
+	return true;
+}
+
+static bool parseOpcode(const string & s, cec_opcode & opcode) {
+	map<string, cec_opcode>::const_iterator it = opcodeNames().find(s);
+	if (it != opcodeNames().end()) {
+		opcode = it->second;
+		return true;
+	}
+
+	int value;
+	if (s.compare(0, 2, "0x") == 0 && parseNumber(s.substr(2), 16, 255, value)) {
+		opcode = (cec_opcode) value;
+		return true;
+	}
+	return false;
+}
+
+static bool parseAddress(const string & s, cec_logical_address & address) {
+	map<string, cec_logical_address>::const_iterator it = addressNames().find(s);
+	if (it != addressNames().end()) {
+		address = it->second;
+		return true;
+	}
+
+	int value;
+	if (parseNumber(s, 10, 15, value)) {
+		address = (cec_logical_address) value;
+		return true;
+	}
+	return false;
+}
+
+static bool parseAddressMask(const string & s, uint16_t & mask) {
+	std::istringstream ss(s);
+	string item;
+
+	mask = 0;
+	while (std::getline(ss, item, ',')) {
+		cec_logical_address address;
+		if (!parseAddress(item, address))
+			return false;
+		mask |= 1 << address;
+	}
+	return mask != 0;
+}
+
+static bool parseKey(const string & s, cec_user_control_code & key) {
+	for (map<cec_user_control_code, const char *>::const_iterator it = Cec::cecUserControlCodeName.begin();
+			it != Cec::cecUserControlCodeName.end(); ++it) {
+		if (s == it->second && it->first != CEC_USER_CONTROL_CODE_UNKNOWN) {
+			key = it->first;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * Parses "XX:XX:.." into bytes, "xx" is a wildcard
+ */
+static bool parseBytes(const string & s, vector<uint8_t> & value, vector<uint8_t> & mask) {
+	std::istringstream ss(s);
+	string item;
+
+	while (std::getline(ss, item, ':')) {
+		int v;
+		if (item == "xx" || item == "XX") {
+			value.push_back(0);
+			mask.push_back(0);
+		} else if (item.size() <= 2 && parseNumber(item, 16, 255, v)) {
+			value.push_back((uint8_t) v);
+			mask.push_back(0xFF);
+		} else {
+			return false;
+		}
+	}
+	return !value.empty() && value.size() <= RULE_MAX_PARAMETERS;
+}
+
+static bool parseAction(std::istringstream & ss, RuleAction & action, string & error) {
+	string type, arg;
+
+	ss >> type;
+
+	if (type == "ignore") {
+		action.type = RuleAction::ACTION_IGNORE;
+
+	} else if (type == "key" || type == "macro") {
+		action.type = (type == "key") ? RuleAction::ACTION_KEY : RuleAction::ACTION_MACRO;
+
+		ss >> arg;
+		std::istringstream keys(arg);
+		string name;
+		while (std::getline(keys, name, ',')) {
+			cec_user_control_code key;
+			if (!parseKey(name, key)) {
+				error = "unknown CEC key '" + name + "'";
+				return false;
+			}
+			action.keys.push_back(key);
+		}
+		if (action.keys.empty() || (action.type == RuleAction::ACTION_KEY && action.keys.size() != 1)) {
+			error = "bad key list '" + arg + "'";
+			return false;
+		}
+
+	} else if (type == "announce") {
+		action.type = RuleAction::ACTION_ANNOUNCE;
+
+	} else if (type == "hook") {
+		action.type = RuleAction::ACTION_HOOK;
+
+		ss >> arg;
+		if (arg == "standby") {
+			action.hook = RuleAction::HOOK_STANDBY;
+		} else if (arg == "activate") {
+			action.hook = RuleAction::HOOK_ACTIVATE;
+		} else if (arg == "deactivate") {
+			action.hook = RuleAction::HOOK_DEACTIVATE;
+		} else {
+			error = "unknown hook '" + arg + "'";
+			return false;
+		}
+
+	} else if (type == "reply") {
+		action.type = RuleAction::ACTION_REPLY;
+
+		string first;
+		ss >> first >> arg;
+		if (arg.empty()) {
+			// No destination given, reply to whoever sent the command
+			arg = first;
+		} else if (!parseAddress(first, action.replyTo)) {
+			error = "unknown address '" + first + "'";
+			return false;
+		}
+
+		// The opcode may be given by name or as a hex byte, followed by the parameters
+		size_t colon = arg.find(':');
+		string opcode = arg.substr(0, colon);
+		int value;
+		if (parseOpcode(opcode, action.replyOpcode)) {
+			// named
+		} else if (opcode.size() <= 2 && parseNumber(opcode, 16, 255, value)) {
+			action.replyOpcode = (cec_opcode) value;
+		} else {
+			error = "unknown opcode '" + opcode + "'";
+			return false;
+		}
+
+		if (colon != string::npos) {
+			vector<uint8_t> mask;
+			if (!parseBytes(arg.substr(colon + 1), action.replyParameters, mask)
+					|| std::find(mask.begin(), mask.end(), 0) != mask.end()) {
+				error = "bad parameters '" + arg + "'";
+				return false;
+			}
+		}
+
+	} else {
+		error = "unknown action '" + type + "'";
+		return false;
+	}
+
+	if (ss >> arg) {
+		error = "trailing '" + arg + "'";
+		return false;
+	}
+	return true;
+}
+
+bool CommandRule::matches(const cec_command & command, cec_logical_address self, bool active) const {
+	if (command.initiator < CECDEVICE_TV || !(initiatorMask & (1 << command.initiator)))
+		return false;
+
+	switch (destination) {
+		case TO_ANY:
+			break;
+		case TO_SELF:
+			if (command.destination != CECDEVICE_BROADCAST && command.destination != self)
+				return false;
+			break;
+		case TO_MASK:
+			if (command.destination < CECDEVICE_TV || !(destinationMask & (1 << command.destination)))
+				return false;
+			break;
+	}
+
+	if (size >= 0 && command.parameters.size != size)
+		return false;
+
+	if (command.parameters.size < parameterCount)
+		return false;
+
+	for (uint8_t i = 0; i < parameterCount; i++) {
+		if ((command.parameters.data[i] & parameterMask[i]) != parameterValue[i])
+			return false;
+	}
+
+	return !whenActive || active;
+}
+
+CommandRules::CommandRules() {}
+
+bool CommandRules::parse(const string & line, cec_opcode & opcode, CommandRule & rule, string & error) {
+	// The match and action sides are split on the '=' surrounded by spaces
+	size_t equalPos = line.find(" = ");
+	if (equalPos == string::npos) {
+		error = "missing ' = ' between match and action";
+		return false;
+	}
+
+	std::istringstream match(line.substr(0, equalPos));
+	std::istringstream action(line.substr(equalPos + 3));
+
+	string token;
+	match >> token;
+
+	if (!parseOpcode(token, opcode)) {
+		error = "unknown opcode '" + token + "'";
+		return false;
+	}
+
+	while (match >> token) {
+		size_t pos = token.find('=');
+		string key = token.substr(0, pos);
+		string value = (pos == string::npos) ? "" : token.substr(pos + 1);
+
+		if (key == "from") {
+			if (!parseAddressMask(value, rule.initiatorMask)) {
+				error = "bad initiator '" + value + "'";
+				return false;
+			}
+		} else if (key == "to") {
+			if (value == "self") {
+				rule.destination = CommandRule::TO_SELF;
+			} else if (value == "any") {
+				rule.destination = CommandRule::TO_ANY;
+			} else if (parseAddressMask(value, rule.destinationMask)) {
+				rule.destination = CommandRule::TO_MASK;
+			} else {
+				error = "bad destination '" + value + "'";
+				return false;
+			}
+		} else if (key == "size") {
+			if (!parseNumber(value, 10, RULE_MAX_PARAMETERS, rule.size)) {
+				error = "bad size '" + value + "'";
+				return false;
+			}
+		} else if (key == "params") {
+			vector<uint8_t> bytes, mask;
+			if (!parseBytes(value, bytes, mask)) {
+				error = "bad parameters '" + value + "'";
+				return false;
+			}
+			rule.parameterCount = bytes.size();
+			std::copy(bytes.begin(), bytes.end(), rule.parameterValue);
+			std::copy(mask.begin(), mask.end(), rule.parameterMask);
+		} else if (key == "if" && value == "active") {
+			rule.whenActive = true;
+		} else {
+			error = "unknown condition '" + token + "'";
+			return false;
+		}
+	}
+
+	return parseAction(action, rule.action, error);
+}
+
+bool CommandRules::add(const string & line, int lineNumber) {
+	CommandRule rule;
+	cec_opcode opcode;
+	string error;
+
+	if (!parse(line, opcode, rule, error)) {
+		LOG4CPLUS_WARN(logger, "Invalid rule on line " << lineNumber << ": " << error);
+		return false;
+	}
+	rule.line = lineNumber;
+
+	table[opcode & 0xFF].push_back(rule);
+	return true;
+}
+
+void CommandRules::loadDefaults() {
+	for (size_t i = 0; i < sizeof(defaultRules) / sizeof(defaultRules[0]); i++) {
+		add(defaultRules[i]);
+	}
+}
+
+bool CommandRules::loadFromFile(const string & filename) {
+	LOG4CPLUS_INFO(logger, "Loading rules from: " << filename);
+
+	std::ifstream file(filename.c_str());
+	if (!file.is_open()) {
+		LOG4CPLUS_ERROR(logger, "Failed to open rules file: " << filename);
+		return false;
+	}
+
+	// Compile into a scratch table, then put the built-in rules behind ours
+	CommandRules loaded;
+	string line;
+	int lineNumber = 0;
+	int rulesLoaded = 0;
+	int failed = 0;
+
+	while (std::getline(file, line)) {
+		lineNumber++;
+
+		// Trim whitespace, skip empty lines and comments
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty() || line[0] == '#') {
+			continue;
+		}
+
+		if (loaded.add(line, lineNumber))
+			rulesLoaded++;
+		else
+			failed++;
+	}
+
+	for (int opcode = 0; opcode < 256; opcode++) {
+		loaded.table[opcode].insert(loaded.table[opcode].end(), table[opcode].begin(), table[opcode].end());
+		table[opcode].swap(loaded.table[opcode]);
+	}
+
+	LOG4CPLUS_INFO(logger, "Loaded " << rulesLoaded << " rules from " << filename);
+	if (failed)
+		LOG4CPLUS_ERROR(logger, failed << " invalid rules in " << filename);
+
+	// A file with mistakes in it is not half used on reload
+	return rulesLoaded > 0 && failed == 0;
+}
+
+const CommandRule * CommandRules::match(const cec_command & command, cec_logical_address self, bool active) const {
+	const vector<CommandRule> & rules = table[command.opcode & 0xFF];
+
+	for (vector<CommandRule>::const_iterator rule = rules.begin(); rule != rules.end(); ++rule) {
+		if (rule->matches(command, self, active))
+			return &*rule;
+	}
+	return NULL;
+}
+
+size_t CommandRules::size() const {
+	size_t count = 0;
+	for (int opcode = 0; opcode < 256; opcode++)
+		count += table[opcode].size();
+	return count;
+}
+
+bool CommandRules::parseAddress(const string & s, cec_logical_address & address) {
+	return ::parseAddress(s, address);
+}
+
+bool CommandRules::parseOpcode(const string & s, cec_opcode & opcode) {
+	return ::parseOpcode(s, opcode);
+}
+
+bool CommandRules::parseKey(const string & s, cec_user_control_code & key) {
+	return ::parseKey(s, key);
+}
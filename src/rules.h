@@ -0,0 +1,125 @@
+#include <libcec/cectypes.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A CEC frame is at most 16 bytes: header, opcode and 14 parameters
+#define RULE_MAX_PARAMETERS 14
+
+/**
+ * What to do when a CEC command matches a rule
+ */
+class RuleAction {
+	public:
+		enum Type
+		{
+			ACTION_IGNORE,  // swallow the command
+			ACTION_KEY,     // simulate a single key press
+			ACTION_HOOK,    // run the standby/activate/deactivate hook
+			ACTION_MACRO,   // simulate a sequence of key presses
+			ACTION_REPLY,   // transmit a CEC frame back on the bus
+			ACTION_ANNOUNCE, // tell the bus we are the active source, if we are
+		};
+
+		enum Hook
+		{
+			HOOK_STANDBY,
+			HOOK_ACTIVATE,
+			HOOK_DEACTIVATE,
+		};
+
+		RuleAction() : type(ACTION_IGNORE), hook(HOOK_STANDBY), replyTo(CEC::CECDEVICE_UNKNOWN), replyOpcode(CEC::CEC_OPCODE_NONE) {};
+
+		Type type;
+		Hook hook;                                 // ACTION_HOOK
+		std::vector<CEC::cec_user_control_code> keys; // ACTION_KEY, ACTION_MACRO
+		CEC::cec_logical_address replyTo;          // ACTION_REPLY: CECDEVICE_UNKNOWN means the initiator
+		CEC::cec_opcode replyOpcode;
+		std::vector<uint8_t> replyParameters;
+};
+
+/**
+ * A single rule, matched against a received CEC command
+ */
+class CommandRule {
+	public:
+		enum Destination
+		{
+			TO_ANY,   // any destination
+			TO_SELF,  // broadcast, or our own logical address
+			TO_MASK,  // one of the addresses in destinationMask
+		};
+
+		CommandRule() : initiatorMask(0xFFFF), destination(TO_ANY), destinationMask(0xFFFF),
+			size(-1), parameterCount(0), whenActive(false), line(0) {};
+
+		uint16_t initiatorMask;   // one bit per logical address
+		Destination destination;
+		uint16_t destinationMask; // one bit per logical address
+		int size;                 // number of parameters, -1 for any
+		uint8_t parameterCount;   // number of parameter bytes to compare
+		uint8_t parameterMask[RULE_MAX_PARAMETERS];
+		uint8_t parameterValue[RULE_MAX_PARAMETERS];
+		bool whenActive;          // only fire while we want to be the active source
+
+		RuleAction action;
+
+		int line;                 // where the rule came from, for logging
+
+		bool matches(const CEC::cec_command & command, CEC::cec_logical_address self, bool active) const;
+};
+
+/**
+ * Table of rules mapping received CEC commands to actions.
+ *
+ * Rules are compiled into a 256 entry jump table indexed by opcode, so each
+ * frame only ever looks at the rules written for its own opcode.
+ */
+class CommandRules {
+
+	private:
+
+		std::vector<CommandRule> table[256];
+
+		static bool parse(const std::string & line, CEC::cec_opcode & opcode, CommandRule & rule, std::string & error);
+
+	public:
+
+		CommandRules();
+
+		/**
+		 * Loads the built-in rules, matching the daemon's historical behaviour
+		 */
+		void loadDefaults();
+
+		/**
+		 * Loads rules from a file. These take precedence over the built-in rules.
+		 * False when the file can't be read or any of its lines is invalid.
+		 */
+		bool loadFromFile(const std::string & filename);
+
+		bool add(const std::string & line, int lineNumber = 0);
+
+		/**
+		 * Returns the first rule matching the command, or NULL
+		 */
+		const CommandRule * match(const CEC::cec_command & command, CEC::cec_logical_address self, bool active) const;
+
+		size_t size() const;
+
+		/**
+		 * Parses a logical address name such as TV or AUDIO, or a number
+		 */
+		static bool parseAddress(const std::string & s, CEC::cec_logical_address & address);
+
+		/**
+		 * Parses an opcode name such as ACTIVE_SOURCE, or 0xNN
+		 */
+		static bool parseOpcode(const std::string & s, CEC::cec_opcode & opcode);
+
+		/**
+		 * Parses a CEC key name such as SELECT
+		 */
+		static bool parseKey(const std::string & s, CEC::cec_user_control_code & key);
+};
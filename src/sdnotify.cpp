@@ -0,0 +1,108 @@
+/**
+ * sdnotify.cpp
+ *
+ * Talks the sd_notify(3) protocol directly, so we don't need libsystemd.
+ */
+#include "sdnotify.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("sdnotify");
+
+SdNotify::SdNotify() : fd(-1), addrlen(0), watchdogTimeout(0) {
+	const char *socket = getenv("NOTIFY_SOCKET");
+	if (socket) {
+		open(socket);
+	}
+
+	// The watchdog is only meant for us when WATCHDOG_PID is unset or our pid
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid  = getenv("WATCHDOG_PID");
+	if (usec && (!pid || atol(pid) == getpid())) {
+		watchdogTimeout = boost::chrono::microseconds(atoll(usec));
+	}
+
+	unsetenv("NOTIFY_SOCKET");
+	unsetenv("WATCHDOG_USEC");
+	unsetenv("WATCHDOG_PID");
+}
+
+SdNotify::~SdNotify() {
+	if (fd >= 0)
+		close(fd);
+}
+
+void SdNotify::open(const string & socket) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socket.empty() || (socket[0] != '/' && socket[0] != '@') || socket.size() >= sizeof(addr.sun_path)) {
+		LOG4CPLUS_WARN(logger, "Ignoring unsupported NOTIFY_SOCKET " << socket);
+		return;
+	}
+
+	memcpy(addr.sun_path, socket.data(), socket.size());
+	if (addr.sun_path[0] == '@') {
+		// abstract namespace
+		addr.sun_path[0] = '\0';
+	}
+	addrlen = offsetof(struct sockaddr_un, sun_path) + socket.size();
+
+	fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		LOG4CPLUS_WARN(logger, "Failed to create notify socket: " << strerror(errno));
+	}
+}
+
+bool SdNotify::send(const string & message) {
+	if (fd < 0)
+		return false;
+
+	LOG4CPLUS_TRACE(logger, "Notify " << message);
+
+	ssize_t ret = sendto(fd, message.data(), message.size(), MSG_NOSIGNAL, (struct sockaddr *) &addr, addrlen);
+	if (ret != (ssize_t) message.size()) {
+		LOG4CPLUS_DEBUG(logger, "Failed to notify: " << strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+boost::chrono::steady_clock::duration SdNotify::watchdogInterval() const {
+	// systemd recommends pinging at half the timeout
+	if (fd < 0)
+		return boost::chrono::steady_clock::duration::zero();
+	return watchdogTimeout / 2;
+}
+
+bool SdNotify::ready() {
+	return send("READY=1");
+}
+
+bool SdNotify::reloading() {
+	return send("RELOADING=1");
+}
+
+bool SdNotify::stopping() {
+	return send("STOPPING=1");
+}
+
+bool SdNotify::status(const string & status) {
+	return send("STATUS=" + status);
+}
+
+bool SdNotify::watchdog() {
+	return send("WATCHDOG=1");
+}
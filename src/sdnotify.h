@@ -0,0 +1,54 @@
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <boost/chrono.hpp>
+
+/**
+ * Minimal implementation of the systemd service notification protocol:
+ * datagrams of "KEY=value" lines sent to the socket named by $NOTIFY_SOCKET.
+ */
+class SdNotify {
+
+	private:
+
+		int fd;
+		struct sockaddr_un addr;
+		socklen_t addrlen;
+
+		boost::chrono::microseconds watchdogTimeout;
+
+		bool send(const std::string & message);
+
+	public:
+
+		/**
+		 * Reads $NOTIFY_SOCKET and $WATCHDOG_USEC, and removes them from the
+		 * environment so hook commands don't inherit them
+		 */
+		SdNotify();
+
+		virtual ~SdNotify();
+
+		bool enabled() const { return fd >= 0; };
+
+		/**
+		 * How often keepalives should be sent, zero when there is no watchdog
+		 */
+		boost::chrono::steady_clock::duration watchdogInterval() const;
+
+		bool ready();
+		bool reloading();
+		bool stopping();
+		bool status(const std::string & status);
+		bool watchdog();
+
+	private:
+
+		void open(const std::string & socket);
+
+		// Not implemented, owns a socket
+		SdNotify(SdNotify const&);
+		void operator=(SdNotify const&);
+};
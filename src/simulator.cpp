@@ -0,0 +1,1147 @@
+/**
+ * simulator.cpp
+ *
+ * Runs the daemon against a scripted CEC bus rather than an adapter. Each line
+ * of a scenario file is one of
+ *
+ *   device ADDR PHYS [vendor=XXXXXX] [name=NAME]
+ *   wait MS
+ *   key CEC_KEY [from=ADDR] [hold=MS] [repeat=MS] [lose=press|release]
+ *   frame FROM TO OPCODE[:XX..]
+ *   power ADDR on|off
+ *   source PHYS
+ *   loss PERCENT
+ *   alert CONNECTION_LOST|PERMISSION_ERROR|PORT_BUSY|PHYSICAL_ADDRESS_ERROR|TV_POLL_FAILED|SERVICE_DEVICE
+ *   loop N
+ *   end
+ *   expect key UINPUT_KEY press|release|repeat [within=MS] [repeats=N]
+ *   expect frame TO OPCODE[:XX..] [within=MS]
+ *   expect nothing MS
+ *   expect no frame TO OPCODE[:XX..] MS
+ *   expect open [within=MS]
+ *
+ * Comments start with #. device lines describe the bus before the scenario starts, the TV is on it
+ * at 0.0.0.0 unless described otherwise, and describing our own address
+ * (RECORDER1) gives us a physical address other than 1.0.0.0. The other
+ * lines run one after the other, the first failed expectation ends the run.
+ *
+ * A key is pressed, pressed again every repeat ms, and released after hold
+ * ms, 100 by default. lose drops its first press or its release on top of
+ * the loss percentage. libcec releases a key itself when the release is
+ * lost, so does the simulator. Key expectations skip the other events written to
+ * uinput, and also fail when the event came more than within ms, 1000 by
+ * default, after the key it answers, or when more than repeats repeats of the
+ * key were skipped on the way.
+ */
+#include "simulator.h"
+#include "config.h"
+#include "libcec.h"
+#include "hdmi.h"
+#include "rules.h"
+#include "uinput.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <boost/thread/lock_guard.hpp>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::string;
+using std::vector;
+
+typedef boost::chrono::steady_clock clock_type;
+
+static Logger logger = Logger::getInstance("simulator");
+
+// How long libcec waits for a release before releasing the key itself
+static const boost::chrono::milliseconds keyTimeout(500);
+
+// How often expectations look at what the daemon did
+static const boost::chrono::milliseconds pollInterval(2);
+
+// Frames the daemon sent that are kept for expect frame
+static const size_t heardMax = 256;
+
+// What a key step loses on purpose
+static const int losePress   = 1;
+static const int loseRelease = 2;
+
+// Device type each logical address reports, see REPORT_PHYSICAL_ADDRESS
+static const uint8_t deviceTypes[16] = { 0, 1, 1, 3, 4, 5, 3, 3, 4, 1, 3, 4, 2, 2, 2, 2 };
+
+static const char *addressNames[16] = {
+	"TV", "Recorder 1", "Recorder 2", "Tuner 1", "Playback 1", "Audio", "Tuner 2", "Tuner 3",
+	"Playback 2", "Recorder 3", "Tuner 4", "Playback 3", "Reserved 1", "Reserved 2", "Free use", "Broadcast",
+};
+
+static const char *opcodeName(cec_opcode opcode) {
+	static struct Names {
+		char name[256][5];
+		Names() {
+			for (int i = 0; i < 256; i++)
+				snprintf(name[i], sizeof(name[i]), "0x%02x", i);
+		}
+	} names;
+	return names.name[opcode & 0xFF];
+}
+
+static bool parseNumber(const string & s, int base, long max, long & value) {
+	char *end;
+
+	if (s.empty())
+		return false;
+
+	value = strtol(s.c_str(), &end, base);
+	return *end == '\0' && value >= 0 && value <= max;
+}
+
+static bool parsePhysical(const string & s, uint16_t & physical) {
+	std::istringstream ss(s);
+	HDMI::physical_address address;
+	if (!(ss >> address))
+		return false;
+	physical = address;
+	return true;
+}
+
+/**
+ * Parses OPCODE[:XX..] into the opcode and parameters of frame
+ */
+static bool parseFrame(const string & s, cec_command & frame) {
+	std::istringstream ss(s);
+	string item;
+
+	std::getline(ss, item, ':');
+	if (!CommandRules::parseOpcode(item, frame.opcode))
+		return false;
+	frame.opcode_set = 1;
+
+	while (std::getline(ss, item, ':')) {
+		long value;
+		if (item.size() > 2 || !parseNumber(item, 16, 255, value))
+			return false;
+		frame.parameters.PushBack((uint8_t) value);
+	}
+	return true;
+}
+
+/**
+ * Splits name=value, returns false if token isn't for name
+ */
+static bool option(const string & token, const char *name, string & value) {
+	size_t len = strlen(name);
+	if (token.compare(0, len, name) != 0 || token.size() <= len || token[len] != '=')
+		return false;
+	value = token.substr(len + 1);
+	return true;
+}
+
+static cec_logical_address ourAddress(const libcec_configuration & config) {
+	switch (config.deviceTypes[0]) {
+		case CEC_DEVICE_TYPE_PLAYBACK_DEVICE: return CECDEVICE_PLAYBACKDEVICE1;
+		case CEC_DEVICE_TYPE_TUNER:           return CECDEVICE_TUNER1;
+		default:                              return CECDEVICE_RECORDINGDEVICE1;
+	}
+}
+
+/**
+ * An adapter on the simulated bus
+ */
+class SimulatedAdapter : public CecAdapter {
+private:
+	std::shared_ptr<SimulatedBus> bus;
+	libcec_configuration config;
+
+public:
+	SimulatedAdapter(std::shared_ptr<SimulatedBus> bus, const libcec_configuration & config) : bus(bus), config(config) {
+		this->config.logicalAddresses.Clear();
+		this->config.logicalAddresses.primary = ourAddress(config);
+		this->config.logicalAddresses.Set(this->config.logicalAddresses.primary);
+	}
+
+	~SimulatedAdapter() {
+		bus->closed();
+	}
+
+	void InitVideoStandalone() {}
+
+	int8_t DetectAdapters(cec_adapter_descriptor *devices, uint8_t size) {
+		if (size == 0)
+			return 0;
+		memset(&devices[0], 0, sizeof(devices[0]));
+		strncpy(devices[0].strComName, "simulated", sizeof(devices[0].strComName) - 1);
+		strncpy(devices[0].strComPath, bus->filename.c_str(), sizeof(devices[0].strComPath) - 1);
+		return 1;
+	}
+
+	bool Open(const char *port) {
+		bus->opened(config);
+		return true;
+	}
+
+	void Close() {
+		bus->closed();
+	}
+
+	bool PingAdapter() {
+		boost::lock_guard<boost::mutex> guard(bus->lock);
+		return bus->open && bus->connected;
+	}
+
+	bool Transmit(const cec_command & command) {
+		return bus->transmitted(command);
+	}
+
+	bool SetActiveSource(cec_device_type type) {
+		cec_command frame;
+		cec_logical_address self = config.logicalAddresses.primary;
+		cec_command::Format(frame, self, CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE);
+		frame.parameters.PushBack((uint8_t) (GetDevicePhysicalAddress(self) >> 8));
+		frame.parameters.PushBack((uint8_t) (GetDevicePhysicalAddress(self) & 0xFF));
+		return bus->transmitted(frame);
+	}
+
+	bool SetInactiveView() {
+		cec_command frame;
+		cec_logical_address self = config.logicalAddresses.primary;
+		cec_command::Format(frame, self, CECDEVICE_TV, CEC_OPCODE_INACTIVE_SOURCE);
+		frame.parameters.PushBack((uint8_t) (GetDevicePhysicalAddress(self) >> 8));
+		frame.parameters.PushBack((uint8_t) (GetDevicePhysicalAddress(self) & 0xFF));
+		return bus->transmitted(frame);
+	}
+
+	cec_logical_addresses GetLogicalAddresses() {
+		return config.logicalAddresses;
+	}
+
+	cec_logical_addresses GetActiveDevices() {
+		cec_logical_addresses addresses;
+		addresses.Clear();
+
+		boost::lock_guard<boost::mutex> guard(bus->lock);
+		for (int i = 0; i < 15; i++) {
+			if (bus->devices[i].present && bus->devices[i].on)
+				addresses.Set((cec_logical_address) i);
+		}
+		return addresses;
+	}
+
+	uint16_t GetPhysicalAddress() {
+		return GetDevicePhysicalAddress(config.logicalAddresses.primary);
+	}
+
+	uint16_t GetDevicePhysicalAddress(cec_logical_address address) {
+		boost::lock_guard<boost::mutex> guard(bus->lock);
+		return address >= 0 && address < 15 && bus->devices[address].present ? bus->devices[address].physical : 0xFFFF;
+	}
+
+	uint32_t GetDeviceVendorId(cec_logical_address address) {
+		boost::lock_guard<boost::mutex> guard(bus->lock);
+		if (address < 0 || address >= 15 || !bus->devices[address].present || !bus->devices[address].on)
+			return CEC_VENDOR_UNKNOWN;
+		return bus->devices[address].vendor;
+	}
+
+	string GetDeviceOSDName(cec_logical_address address) {
+		boost::lock_guard<boost::mutex> guard(bus->lock);
+		return address >= 0 && address < 15 ? bus->devices[address].name : string();
+	}
+
+	const char *ToString(const cec_opcode opcode) {
+		return opcodeName(opcode);
+	}
+
+	const char *ToString(const cec_logical_address address) {
+		return address >= 0 && address < 16 ? addressNames[address] : "Unknown";
+	}
+
+	const char *ToString(const cec_vendor_id vendor) {
+		return "Simulated";
+	}
+};
+
+SimulatedBus::SimulatedBus(const string & filename, KeyCodes keyCodes) : filename(filename), sinkFd(-1), keyCodes(keyCodes), result(0),
+	self(CECDEVICE_RECORDINGDEVICE1), activePath(0xFFFF), open(false), connected(false), opens(0), loss(0), random(1),
+	callbacks(NULL), callbackParam(NULL), stopping(false), sinkOffset(0), opensSeen(1),
+	stepsRun(0), keysSent(0), framesLost(0), latencies(0), latencyTotal(0), latencyMax(0)
+{
+	devices[CECDEVICE_TV].present = true;
+	devices[CECDEVICE_TV].physical = 0x0000;
+	devices[CECDEVICE_TV].name = "TV";
+
+	std::ifstream file(filename.c_str());
+	if (!file.is_open()) {
+		throw std::runtime_error("Failed to open scenario " + filename);
+	}
+
+	string line;
+	int lineNumber = 0;
+	vector<size_t> loops;
+
+	while (std::getline(file, line)) {
+		lineNumber++;
+
+		// Drop comments, trim whitespace, skip empty lines
+		if (line.find('#') != string::npos)
+			line.erase(line.find('#'));
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty()) {
+			continue;
+		}
+
+		parse(line, lineNumber, loops);
+	}
+
+	if (!loops.empty()) {
+		std::ostringstream error;
+		error << filename << ":" << steps[loops.back()].line << ": loop without end";
+		throw std::runtime_error(error.str());
+	}
+
+#ifdef HAVE_MEMFD_CREATE
+	sinkFd = memfd_create("libcec-daemon-uinput", MFD_CLOEXEC);
+#else
+	sinkFd = ::open("/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+	if (sinkFd < 0) {
+		throw std::runtime_error("Failed to create the uinput sink");
+	}
+
+	LOG4CPLUS_INFO(logger, "Loaded " << steps.size() << " steps from " << filename);
+}
+
+SimulatedBus::~SimulatedBus() {
+	stop();
+	if (sinkFd >= 0)
+		close(sinkFd);
+}
+
+void SimulatedBus::stop() {
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		stopping = true;
+	}
+	changed.notify_all();
+
+	if (thread.joinable() && thread.get_id() != boost::this_thread::get_id())
+		thread.join();
+}
+
+CecAdapter * SimulatedBus::adapter(const libcec_configuration & config) {
+	return new SimulatedAdapter(shared_from_this(), config);
+}
+
+void SimulatedBus::parse(const string & line, int lineNumber, vector<size_t> & loops) {
+	std::istringstream ss(line);
+	string command, token, value;
+	string error;
+
+	ss >> command;
+
+	if (command == "device") {
+		cec_logical_address address;
+		uint16_t physical;
+
+		ss >> token;
+		if (!CommandRules::parseAddress(token, address) || address == CECDEVICE_BROADCAST) {
+			error = "bad address '" + token + "'";
+		} else if (!(ss >> token) || !parsePhysical(token, physical)) {
+			error = "bad physical address '" + token + "'";
+		} else {
+			Device & device = devices[address];
+			device.present = true;
+			device.physical = physical;
+			while (error.empty() && ss >> token) {
+				long vendor;
+				if (option(token, "vendor", value) && parseNumber(value, 16, 0xFFFFFF, vendor))
+					device.vendor = (uint32_t) vendor;
+				else if (option(token, "name", value))
+					device.name = value;
+				else
+					error = "unknown option '" + token + "'";
+			}
+		}
+	} else if (command == "expect") {
+		string what;
+		ss >> what;
+
+		if (what == "key") {
+			Step step(Step::EXPECT_KEY, lineNumber);
+			step.ms = 1000;
+			step.repeat = -1;
+			ss >> step.name >> token;
+			if (!keyCodes || !keyCodes(step.name, step.code)) {
+				error = "unknown key '" + step.name + "'";
+			} else if (token == "press") {
+				step.value = EV_KEY_PRESSED;
+			} else if (token == "release") {
+				step.value = EV_KEY_RELEASED;
+			} else if (token == "repeat") {
+				step.value = EV_KEY_REPEAT;
+			} else {
+				error = "expected press, release or repeat";
+			}
+			steps.push_back(step);
+		} else if (what == "frame") {
+			Step step(Step::EXPECT_FRAME, lineNumber);
+			step.ms = 1000;
+			ss >> token;
+			if (!CommandRules::parseAddress(token, step.frame.destination)) {
+				error = "bad address '" + token + "'";
+			} else if (!(ss >> token) || !parseFrame(token, step.frame)) {
+				error = "bad frame '" + token + "'";
+			}
+			steps.push_back(step);
+		} else if (what == "no") {
+			Step step(Step::EXPECT_NO_FRAME, lineNumber);
+			long ms = 0;
+			ss >> token;
+			if (token != "frame") {
+				error = "expected 'no frame'";
+			} else if (!(ss >> token) || !CommandRules::parseAddress(token, step.frame.destination)) {
+				error = "bad address '" + token + "'";
+			} else if (!(ss >> token) || !parseFrame(token, step.frame)) {
+				error = "bad frame '" + token + "'";
+			} else if (!(ss >> token) || !parseNumber(token, 10, 3600000, ms)) {
+				error = "bad duration '" + token + "'";
+			}
+			step.ms = ms;
+			steps.push_back(step);
+		} else if (what == "nothing") {
+			Step step(Step::EXPECT_NOTHING, lineNumber);
+			long ms = 0;
+			if (!(ss >> token) || !parseNumber(token, 10, 3600000, ms))
+				error = "bad duration '" + token + "'";
+			step.ms = ms;
+			steps.push_back(step);
+		} else if (what == "open") {
+			Step step(Step::EXPECT_OPEN, lineNumber);
+			step.ms = 5000;
+			steps.push_back(step);
+		} else {
+			error = "unknown expectation '" + what + "'";
+		}
+
+		// the options all expectations take
+		while (error.empty() && ss >> token) {
+			long ms;
+			if (option(token, "within", value) && parseNumber(value, 10, 3600000, ms)
+					&& steps.back().type != Step::EXPECT_NOTHING && steps.back().type != Step::EXPECT_NO_FRAME)
+				steps.back().ms = ms;
+			else if (option(token, "repeats", value) && parseNumber(value, 10, 100000, ms) && steps.back().type == Step::EXPECT_KEY)
+				steps.back().repeat = ms;
+			else
+				error = "unknown option '" + token + "'";
+		}
+	} else if (command == "wait") {
+		Step step(Step::WAIT, lineNumber);
+		long ms = 0;
+		if (!(ss >> token) || !parseNumber(token, 10, 3600000, ms))
+			error = "bad duration '" + token + "'";
+		step.ms = ms;
+		steps.push_back(step);
+	} else if (command == "key") {
+		Step step(Step::KEY, lineNumber);
+		step.address = CECDEVICE_TV;
+		step.ms = 100;
+		if (!(ss >> token) || !CommandRules::parseKey(token, step.key))
+			error = "unknown CEC key '" + token + "'";
+		while (error.empty() && ss >> token) {
+			long ms;
+			if (option(token, "from", value)) {
+				if (!CommandRules::parseAddress(value, step.address))
+					error = "bad address '" + value + "'";
+			} else if (option(token, "hold", value) && parseNumber(value, 10, 3600000, ms) && ms > 0) {
+				step.ms = ms;
+			} else if (option(token, "repeat", value) && parseNumber(value, 10, 3600000, ms)) {
+				step.repeat = ms;
+			} else if (option(token, "lose", value) && (value == "press" || value == "release")) {
+				step.value = value == "press" ? losePress : loseRelease;
+			} else {
+				error = "unknown option '" + token + "'";
+			}
+		}
+		steps.push_back(step);
+	} else if (command == "frame") {
+		Step step(Step::FRAME, lineNumber);
+		ss >> token;
+		if (!CommandRules::parseAddress(token, step.frame.initiator)) {
+			error = "bad address '" + token + "'";
+		} else if (!(ss >> token) || !CommandRules::parseAddress(token, step.frame.destination)) {
+			error = "bad address '" + token + "'";
+		} else if (!(ss >> token) || !parseFrame(token, step.frame)) {
+			error = "bad frame '" + token + "'";
+		}
+		steps.push_back(step);
+	} else if (command == "power") {
+		Step step(Step::POWER, lineNumber);
+		ss >> token >> value;
+		if (!CommandRules::parseAddress(token, step.address) || step.address == CECDEVICE_BROADCAST)
+			error = "bad address '" + token + "'";
+		else if (value != "on" && value != "off")
+			error = "expected on or off";
+		step.on = value == "on";
+		steps.push_back(step);
+	} else if (command == "source") {
+		Step step(Step::SOURCE, lineNumber);
+		if (!(ss >> token) || !parsePhysical(token, step.physical))
+			error = "bad physical address '" + token + "'";
+		steps.push_back(step);
+	} else if (command == "loss") {
+		Step step(Step::LOSS, lineNumber);
+		long percent = 0;
+		if (!(ss >> token) || !parseNumber(token, 10, 100, percent))
+			error = "bad percentage '" + token + "'";
+		step.count = percent;
+		steps.push_back(step);
+	} else if (command == "alert") {
+		Step step(Step::ALERT, lineNumber);
+		ss >> step.name;
+		if (step.name == "SERVICE_DEVICE")
+			step.alert = CEC_ALERT_SERVICE_DEVICE;
+		else if (step.name == "CONNECTION_LOST")
+			step.alert = CEC_ALERT_CONNECTION_LOST;
+		else if (step.name == "PERMISSION_ERROR")
+			step.alert = CEC_ALERT_PERMISSION_ERROR;
+		else if (step.name == "PORT_BUSY")
+			step.alert = CEC_ALERT_PORT_BUSY;
+		else if (step.name == "PHYSICAL_ADDRESS_ERROR")
+			step.alert = CEC_ALERT_PHYSICAL_ADDRESS_ERROR;
+		else if (step.name == "TV_POLL_FAILED")
+			step.alert = CEC_ALERT_TV_POLL_FAILED;
+		else
+			error = "unknown alert '" + step.name + "'";
+		steps.push_back(step);
+	} else if (command == "loop") {
+		Step step(Step::LOOP, lineNumber);
+		long count = 0;
+		if (!(ss >> token) || !parseNumber(token, 10, 100000000, count) || count < 1)
+			error = "bad count '" + token + "'";
+		step.count = count;
+		loops.push_back(steps.size());
+		steps.push_back(step);
+	} else if (command == "end") {
+		Step step(Step::END, lineNumber);
+		if (loops.empty()) {
+			error = "end without loop";
+		} else {
+			step.count = loops.back();
+			loops.pop_back();
+		}
+		steps.push_back(step);
+	} else {
+		error = "unknown command '" + command + "'";
+	}
+
+	if (error.empty() && ss >> token)
+		error = "unexpected '" + token + "'";
+
+	if (!error.empty()) {
+		std::ostringstream message;
+		message << filename << ":" << lineNumber << ": " << error;
+		throw std::runtime_error(message.str());
+	}
+}
+
+void SimulatedBus::opened(const libcec_configuration & config) {
+	libcec_configuration current = config;
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+
+		callbacks = config.callbacks;
+		callbackParam = config.callbackParam;
+		self = ourAddress(config);
+
+		// --port wins over the scenario
+		Device & us = devices[self];
+		if (config.iPhysicalAddress != 0 && config.iPhysicalAddress != 0xFFFF)
+			us.physical = config.iPhysicalAddress;
+		else if (!us.present)
+			us.physical = 0x1000;
+		us.present = true;
+		us.on = true;
+		us.name = config.strDeviceName;
+
+		current.logicalAddresses.Clear();
+		current.logicalAddresses.primary = self;
+		current.logicalAddresses.Set(self);
+		current.iPhysicalAddress = us.physical;
+
+		open = true;
+		connected = true;
+		opens++;
+
+		// libcec tells us the address it claimed once it is open
+		pending.push_back([this, current]() {
+			ICECCallbacks *callbacks;
+			void *param;
+			{
+				boost::lock_guard<boost::mutex> guard(lock);
+				if (!open)
+					return;
+				callbacks = this->callbacks;
+				param = callbackParam;
+			}
+			callbacks->configurationChanged(param, &current);
+		});
+
+		if (!thread.joinable() && !stopping)
+			thread = boost::thread(&SimulatedBus::run, this);
+	}
+	changed.notify_all();
+}
+
+void SimulatedBus::closed() {
+	boost::lock_guard<boost::mutex> guard(lock);
+	open = false;
+}
+
+/**
+ * Needs the lock
+ */
+bool SimulatedBus::lost() {
+	if (loss > 0 && (int) (random() % 100) < loss) {
+		framesLost++;
+		return true;
+	}
+	return false;
+}
+
+bool SimulatedBus::transmitted(const cec_command & command) {
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+
+		if (!open || !connected)
+			return false;
+
+		// nobody acknowledges a frame for a device that isn't there, or is off
+		cec_logical_address destination = command.destination;
+		if (destination != CECDEVICE_BROADCAST && !(devices[destination].present && devices[destination].on))
+			return false;
+		if (lost())
+			return false;
+
+		if (command.opcode_set && command.opcode == CEC_OPCODE_ACTIVE_SOURCE && command.initiator == self)
+			activePath = devices[self].physical;
+
+		hear(command);
+		if (command.opcode_set && destination != CECDEVICE_BROADCAST)
+			answer(command);
+	}
+	changed.notify_all();
+	return true;
+}
+
+/**
+ * Keeps a frame on the bus for expect frame, needs the lock
+ */
+void SimulatedBus::hear(const cec_command & frame) {
+	Heard heard = { frame, clock_type::now() };
+	this->heard.push_back(heard);
+	if (this->heard.size() > heardMax)
+		this->heard.pop_front();
+}
+
+/**
+ * Queues what the destination answers to command, needs the lock
+ */
+void SimulatedBus::answer(const cec_command & command) {
+	const Device & device = devices[command.destination];
+	cec_command reply;
+
+	switch (command.opcode) {
+		case CEC_OPCODE_GIVE_DEVICE_POWER_STATUS:
+			cec_command::Format(reply, command.destination, command.initiator, CEC_OPCODE_REPORT_POWER_STATUS);
+			reply.parameters.PushBack(0x00); // on
+			break;
+		case CEC_OPCODE_GIVE_PHYSICAL_ADDRESS:
+			cec_command::Format(reply, command.destination, CECDEVICE_BROADCAST, CEC_OPCODE_REPORT_PHYSICAL_ADDRESS);
+			reply.parameters.PushBack((uint8_t) (device.physical >> 8));
+			reply.parameters.PushBack((uint8_t) (device.physical & 0xFF));
+			reply.parameters.PushBack(deviceTypes[command.destination]);
+			break;
+		case CEC_OPCODE_GIVE_DEVICE_VENDOR_ID:
+			cec_command::Format(reply, command.destination, CECDEVICE_BROADCAST, CEC_OPCODE_DEVICE_VENDOR_ID);
+			reply.parameters.PushBack((uint8_t) (device.vendor >> 16));
+			reply.parameters.PushBack((uint8_t) (device.vendor >> 8));
+			reply.parameters.PushBack((uint8_t) (device.vendor & 0xFF));
+			break;
+		case CEC_OPCODE_GIVE_OSD_NAME:
+			cec_command::Format(reply, command.destination, command.initiator, CEC_OPCODE_SET_OSD_NAME);
+			for (size_t i = 0; i < device.name.size() && i < 14; i++)
+				reply.parameters.PushBack((uint8_t) device.name[i]);
+			break;
+		default:
+			return;
+	}
+
+	pending.push_back([this, reply]() { send(reply); });
+}
+
+bool SimulatedBus::send(const cec_command & command) {
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		if (!open || !connected)
+			return false;
+		if (lost()) {
+			LOG4CPLUS_DEBUG(logger, "Lost " << command);
+			return false;
+		}
+	}
+	deliver(command);
+	return true;
+}
+
+void SimulatedBus::deliver(const cec_command & command) {
+	ICECCallbacks *callbacks;
+	void *param;
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		if (!open)
+			return;
+		callbacks = this->callbacks;
+		param = callbackParam;
+	}
+	callbacks->commandReceived(param, &command);
+}
+
+void SimulatedBus::deliver(const cec_keypress & key) {
+	ICECCallbacks *callbacks;
+	void *param;
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		if (!open)
+			return;
+		callbacks = this->callbacks;
+		param = callbackParam;
+	}
+
+	stimuli.push_back(clock_type::now());
+	if (stimuli.size() > 64)
+		stimuli.pop_front();
+
+	callbacks->keyPress(param, &key);
+}
+
+bool SimulatedBus::sleepUntil(clock_type::time_point deadline) {
+	boost::unique_lock<boost::mutex> guard(lock);
+
+	while (!stopping) {
+		while (!pending.empty()) {
+			std::function<void ()> callback = pending.front();
+			pending.pop_front();
+
+			guard.unlock();
+			callback();
+			guard.lock();
+		}
+
+		if (clock_type::now() >= deadline)
+			return true;
+		changed.wait_until(guard, deadline);
+	}
+	return false;
+}
+
+void SimulatedBus::run() {
+	LOG4CPLUS_INFO(logger, "Running scenario " << filename);
+
+	clock_type::time_point start = clock_type::now();
+	vector< std::pair<size_t, int> > loops;
+	size_t pc = 0;
+
+	// the configuration libcec reports when opening comes first
+	sleepUntil(start);
+
+	while (pc < steps.size() && result == 0) {
+		if (!step(pc, loops))
+			break;
+		stepsRun++;
+	}
+
+	if (result == 0 && pc < steps.size()) {
+		LOG4CPLUS_WARN(logger, "Scenario " << filename << " stopped on line " << steps[pc].line);
+		result = -1;
+	}
+
+	if (result == 0) {
+		result = 1;
+
+		std::ostringstream summary;
+		summary.setf(std::ios::fixed);
+		summary.precision(1);
+		summary << "Scenario " << filename << " passed: " << stepsRun << " steps in "
+		        << boost::chrono::duration<double>(clock_type::now() - start).count() << "s, "
+		        << keysSent << " keys, " << framesLost << " frames lost";
+		if (latencies) {
+			summary << ", key latency average " << latencyTotal.count() / 1000.0 / latencies
+			        << "ms, max " << latencyMax.count() / 1000.0 << "ms";
+		}
+		LOG4CPLUS_INFO(logger, summary.str());
+	}
+
+	if (finished)
+		finished(passed());
+}
+
+void SimulatedBus::fail(const Step & step, const string & why) {
+	LOG4CPLUS_ERROR(logger, "Scenario " << filename << " failed on line " << step.line << ": " << why);
+	result = -1;
+}
+
+/**
+ * Runs the step at pc and moves on, returns false when the scenario is over
+ */
+bool SimulatedBus::step(size_t & pc, vector< std::pair<size_t, int> > & loops) {
+	const Step & step = steps[pc++];
+
+	switch (step.type) {
+		case Step::WAIT:
+			return sleepUntil(clock_type::now() + boost::chrono::milliseconds(step.ms));
+
+		case Step::KEY:
+			key(step);
+			return !stopping;
+
+		case Step::FRAME:
+			send(step.frame);
+			return true;
+
+		case Step::POWER:
+		{
+			cec_command frame;
+			{
+				boost::lock_guard<boost::mutex> guard(lock);
+				devices[step.address].on = step.on;
+				if (step.address != CECDEVICE_TV)
+					return true;
+
+				// a TV tells everybody when it goes into standby, and where it is when it comes back
+				if (step.on) {
+					cec_command::Format(frame, CECDEVICE_TV, CECDEVICE_BROADCAST, CEC_OPCODE_REPORT_PHYSICAL_ADDRESS);
+					frame.parameters.PushBack((uint8_t) (devices[CECDEVICE_TV].physical >> 8));
+					frame.parameters.PushBack((uint8_t) (devices[CECDEVICE_TV].physical & 0xFF));
+					frame.parameters.PushBack(deviceTypes[CECDEVICE_TV]);
+				} else {
+					cec_command::Format(frame, CECDEVICE_TV, CECDEVICE_BROADCAST, CEC_OPCODE_STANDBY);
+				}
+			}
+			send(frame);
+			return true;
+		}
+
+		case Step::SOURCE:
+		{
+			cec_command frame;
+			cec_command::Format(frame, CECDEVICE_TV, CECDEVICE_BROADCAST, CEC_OPCODE_SET_STREAM_PATH);
+			frame.parameters.PushBack((uint8_t) (step.physical >> 8));
+			frame.parameters.PushBack((uint8_t) (step.physical & 0xFF));
+			if (!send(frame))
+				return true;
+
+			ICECCallbacks *callbacks;
+			void *param;
+			cec_logical_address self;
+			bool is;
+			{
+				boost::lock_guard<boost::mutex> guard(lock);
+				self = this->self;
+				bool was = activePath == devices[self].physical;
+				is = step.physical == devices[self].physical;
+				activePath = step.physical;
+
+				// libcec answers a stream path to us by announcing us
+				if (is) {
+					cec_command announce;
+					cec_command::Format(announce, self, CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE);
+					announce.parameters.PushBack((uint8_t) (step.physical >> 8));
+					announce.parameters.PushBack((uint8_t) (step.physical & 0xFF));
+					hear(announce);
+				}
+				if (!open || was == is)
+					return true;
+				callbacks = this->callbacks;
+				param = callbackParam;
+			}
+			changed.notify_all();
+
+			callbacks->sourceActivated(param, self, is);
+			return true;
+		}
+
+		case Step::LOSS:
+		{
+			boost::lock_guard<boost::mutex> guard(lock);
+			loss = step.count;
+			return true;
+		}
+
+		case Step::ALERT:
+		{
+			ICECCallbacks *callbacks;
+			void *param;
+			{
+				boost::lock_guard<boost::mutex> guard(lock);
+				if (step.alert == CEC_ALERT_CONNECTION_LOST)
+					connected = false;
+				if (!open)
+					return true;
+				callbacks = this->callbacks;
+				param = callbackParam;
+			}
+
+			libcec_parameter parameter;
+			parameter.paramType = CEC_PARAMETER_TYPE_UNKOWN;
+			parameter.paramData = NULL;
+			callbacks->alert(param, step.alert, parameter);
+			return true;
+		}
+
+		case Step::LOOP:
+			loops.push_back(std::make_pair(pc, step.count));
+			return true;
+
+		case Step::END:
+			if (--loops.back().second > 0) {
+				pc = loops.back().first;
+			} else {
+				loops.pop_back();
+			}
+			return true;
+
+		case Step::EXPECT_KEY:
+			return expectKey(step);
+
+		case Step::EXPECT_FRAME:
+			return expectFrame(step);
+
+		case Step::EXPECT_NOTHING:
+			return expectNothing(step);
+
+		case Step::EXPECT_NO_FRAME:
+			return expectNoFrame(step);
+
+		case Step::EXPECT_OPEN:
+			return expectOpen(step);
+	}
+	return true;
+}
+
+/**
+ * Presses the key, repeats it and releases it, like a TV forwarding a remote
+ */
+void SimulatedBus::key(const Step & step) {
+	cec_logical_address self;
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		self = this->self;
+	}
+
+	cec_command press, release;
+	cec_command::Format(press, step.address, self, CEC_OPCODE_USER_CONTROL_PRESSED);
+	press.parameters.PushBack((uint8_t) step.key);
+	cec_command::Format(release, step.address, self, CEC_OPCODE_USER_CONTROL_RELEASE);
+
+	cec_keypress key;
+	key.keycode = step.key;
+	key.duration = 0;
+
+	clock_type::time_point start = clock_type::now();
+	clock_type::time_point pressed = clock_type::time_point::min();
+	int interval = step.repeat > 0 ? step.repeat : step.ms;
+
+	for (int at = 0; at < step.ms; at += interval) {
+		if (!sleepUntil(start + boost::chrono::milliseconds(at)))
+			return;
+		if ((at == 0 && step.value == losePress) || !send(press))
+			continue;
+		deliver(key);
+		pressed = clock_type::now();
+	}
+
+	if (!sleepUntil(start + boost::chrono::milliseconds(step.ms)))
+		return;
+	keysSent++;
+
+	if (step.value != loseRelease && send(release)) {
+		if (pressed == clock_type::time_point::min())
+			return;
+	} else {
+		// libcec gives up waiting for the release
+		if (pressed == clock_type::time_point::min() || !sleepUntil(pressed + keyTimeout))
+			return;
+	}
+
+	key.duration = boost::chrono::duration_cast<boost::chrono::milliseconds>(clock_type::now() - start).count();
+	deliver(key);
+}
+
+bool SimulatedBus::expectKey(const Step & step) {
+	clock_type::time_point deadline = clock_type::now() + boost::chrono::milliseconds(step.ms);
+	int repeats = 0;
+
+	while (true) {
+		struct input_event ev;
+		while (pread(sinkFd, &ev, sizeof(ev), sinkOffset) == sizeof(ev)) {
+			sinkOffset += sizeof(ev);
+			if (ev.type != EV_KEY || ev.code != step.code)
+				continue;
+			if (ev.value != step.value) {
+				if (ev.value == EV_KEY_REPEAT && step.repeat >= 0 && ++repeats > step.repeat) {
+					std::ostringstream why;
+					why << "more than " << step.repeat << " " << step.name << " repeats";
+					fail(step, why.str());
+					return false;
+				}
+				continue;
+			}
+
+			// the latest key sent before the event is the one it answers
+			clock_type::time_point at(boost::chrono::seconds(ev.input_event_sec) + boost::chrono::microseconds(ev.input_event_usec));
+			boost::chrono::microseconds latency(0);
+			for (std::deque<clock_type::time_point>::reverse_iterator stimulus = stimuli.rbegin(); stimulus != stimuli.rend(); ++stimulus) {
+				if (*stimulus <= at) {
+					latency = boost::chrono::duration_cast<boost::chrono::microseconds>(at - *stimulus);
+					break;
+				}
+			}
+
+			latencies++;
+			latencyTotal += latency;
+			latencyMax = std::max(latencyMax, latency);
+			LOG4CPLUS_DEBUG(logger, "Line " << step.line << ": " << step.name << " after " << latency.count() / 1000.0 << "ms");
+
+			if (latency > boost::chrono::milliseconds(step.ms)) {
+				std::ostringstream why;
+				why << step.name << " came " << latency.count() / 1000.0 << "ms after the key, more than " << step.ms << "ms";
+				fail(step, why.str());
+				return false;
+			}
+			return true;
+		}
+
+		if (clock_type::now() >= deadline) {
+			std::ostringstream why;
+			why << "no " << step.name << (step.value == EV_KEY_PRESSED ? " press" : step.value == EV_KEY_RELEASED ? " release" : " repeat")
+			    << " within " << step.ms << "ms";
+			fail(step, why.str());
+			return false;
+		}
+		if (!sleepUntil(std::min(clock_type::now() + pollInterval, deadline)))
+			return false;
+	}
+}
+
+/**
+ * Whether frame is what an expectation asked for, the parameters being a prefix
+ */
+static bool matches(const cec_command & frame, const cec_command & expected) {
+	if (frame.destination != expected.destination || !frame.opcode_set || frame.opcode != expected.opcode
+			|| frame.parameters.size < expected.parameters.size)
+		return false;
+	return memcmp(frame.parameters.data, expected.parameters.data, expected.parameters.size) == 0;
+}
+
+bool SimulatedBus::expectFrame(const Step & step) {
+	clock_type::time_point deadline = clock_type::now() + boost::chrono::milliseconds(step.ms);
+
+	while (true) {
+		{
+			boost::lock_guard<boost::mutex> guard(lock);
+			while (!heard.empty()) {
+				cec_command frame = heard.front().frame;
+				heard.pop_front();
+
+				if (matches(frame, step.frame))
+					return true;
+			}
+		}
+
+		if (clock_type::now() >= deadline) {
+			std::ostringstream why;
+			why << "no " << opcodeName(step.frame.opcode) << " frame to " << addressNames[step.frame.destination & 0xF]
+			    << " within " << step.ms << "ms";
+			fail(step, why.str());
+			return false;
+		}
+		if (!sleepUntil(std::min(clock_type::now() + pollInterval, deadline)))
+			return false;
+	}
+}
+
+bool SimulatedBus::expectNothing(const Step & step) {
+	if (!sleepUntil(clock_type::now() + boost::chrono::milliseconds(step.ms)))
+		return false;
+
+	struct input_event ev;
+	while (pread(sinkFd, &ev, sizeof(ev), sinkOffset) == sizeof(ev)) {
+		sinkOffset += sizeof(ev);
+		if (ev.type == EV_KEY) {
+			std::ostringstream why;
+			why << "unexpected key " << ev.code << (ev.value == EV_KEY_PRESSED ? " press" : ev.value == EV_KEY_RELEASED ? " release" : " repeat");
+			fail(step, why.str());
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Fails on a matching frame sent since the last expect frame, or in the next step.ms
+ */
+bool SimulatedBus::expectNoFrame(const Step & step) {
+	if (!sleepUntil(clock_type::now() + boost::chrono::milliseconds(step.ms)))
+		return false;
+
+	boost::lock_guard<boost::mutex> guard(lock);
+	while (!heard.empty()) {
+		cec_command frame = heard.front().frame;
+		heard.pop_front();
+
+		if (matches(frame, step.frame)) {
+			std::ostringstream why;
+			why << "unexpected " << opcodeName(step.frame.opcode) << " frame to " << addressNames[step.frame.destination & 0xF];
+			fail(step, why.str());
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SimulatedBus::expectOpen(const Step & step) {
+	clock_type::time_point deadline = clock_type::now() + boost::chrono::milliseconds(step.ms);
+
+	while (true) {
+		{
+			boost::lock_guard<boost::mutex> guard(lock);
+			if (opens > opensSeen && open) {
+				opensSeen = opens;
+				return true;
+			}
+		}
+
+		if (clock_type::now() >= deadline) {
+			std::ostringstream why;
+			why << "adapter not opened again within " << step.ms << "ms";
+			fail(step, why.str());
+			return false;
+		}
+		if (!sleepUntil(std::min(clock_type::now() + pollInterval, deadline)))
+			return false;
+	}
+}
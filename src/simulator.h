@@ -0,0 +1,197 @@
+#include <libcec/cectypes.h>
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <boost/chrono.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CecAdapter;
+
+/**
+ * A CEC bus with a TV, and whatever else a scenario file puts on it, standing
+ * in for the adapter so the daemon runs without any hardware. The scenario
+ * drives the devices, and checks what the daemon sends back on the bus and
+ * writes to uinput, which goes to a memfd sink instead of the kernel.
+ *
+ * The scenario starts once the adapter is first opened. Callbacks come from
+ * the scenario thread, like they come from libcec's own thread.
+ */
+class SimulatedBus : public std::enable_shared_from_this<SimulatedBus> {
+
+	public:
+
+		/**
+		 * Looks up a uinput key name, such as KEY_ENTER
+		 */
+		typedef std::function<bool (const std::string & name, uint16_t & code)> KeyCodes;
+
+		/**
+		 * Reads the scenario and creates the sink, throws std::runtime_error
+		 * if either fails
+		 */
+		SimulatedBus(const std::string & filename, KeyCodes keyCodes);
+		~SimulatedBus();
+
+		/**
+		 * Where uinput writes its events, see UInput::setSink
+		 */
+		int sink() const { return sinkFd; };
+
+		/**
+		 * A new adapter on this bus
+		 */
+		CecAdapter * adapter(const CEC::libcec_configuration & config);
+
+		/**
+		 * Ends the scenario, if it is still running
+		 */
+		void stop();
+
+		/**
+		 * Called from the scenario thread when it ran to the end, or failed
+		 */
+		void onFinished(std::function<void (bool passed)> finished) { this->finished = finished; };
+
+		bool passed() const { return result > 0; };
+
+	private:
+
+		// Not implemented
+		SimulatedBus(SimulatedBus const&);
+		void operator=(SimulatedBus const&);
+
+		struct Step
+		{
+			enum Type
+			{
+				WAIT,           // wait MS
+				KEY,            // key CEC_KEY [from=ADDR] [hold=MS] [repeat=MS] [lose=press|release]
+				FRAME,          // frame FROM TO OPCODE[:XX..]
+				POWER,          // power ADDR on|off
+				SOURCE,         // source PHYS
+				LOSS,           // loss PERCENT
+				ALERT,          // alert NAME
+				LOOP,           // loop N
+				END,            // end
+				EXPECT_KEY,     // expect key KEY_NAME press|release|repeat [within=MS] [repeats=N]
+				EXPECT_FRAME,   // expect frame TO OPCODE[:XX..] [within=MS]
+				EXPECT_NOTHING, // expect nothing MS
+				EXPECT_NO_FRAME, // expect no frame TO OPCODE[:XX..] MS
+				EXPECT_OPEN,    // expect open [within=MS]
+			};
+
+			Step(Type type, int line) : type(type), line(line), count(0), ms(0), repeat(0), address(CEC::CECDEVICE_UNKNOWN),
+				physical(0), on(false), key(CEC::CEC_USER_CONTROL_CODE_UNKNOWN), code(0), value(0),
+				alert(CEC::CEC_ALERT_SERVICE_DEVICE) { frame.Clear(); };
+
+			Type type;
+			int line;
+			int count;   // LOOP: times round, END: index of its LOOP, LOSS: percentage
+			int ms;      // WAIT, EXPECT_NOTHING, EXPECT_NO_FRAME: how long, KEY: hold, EXPECT_*: within
+			int repeat;  // KEY: interval between repeated presses, 0 for none, EXPECT_KEY: most repeats on the way, -1 for any
+			CEC::cec_logical_address address; // KEY: from, POWER: device
+			uint16_t physical;                 // SOURCE: stream path
+			std::string name;                  // EXPECT_KEY, ALERT: as written
+			bool on;
+			CEC::cec_user_control_code key;
+			uint16_t code;  // EXPECT_KEY: uinput key
+			int value;      // EXPECT_KEY: EV_KEY_PRESSED, EV_KEY_RELEASED or EV_KEY_REPEAT, KEY: what to lose
+			CEC::cec_command frame;
+			CEC::libcec_alert alert;
+		};
+
+		struct Device
+		{
+			Device() : present(false), on(true), physical(0xFFFF), vendor(CEC::CEC_VENDOR_UNKNOWN) {};
+
+			bool present;
+			bool on;       // acknowledges frames, and answers
+			uint16_t physical;
+			uint32_t vendor;
+			std::string name;
+		};
+
+		std::string filename;
+		std::vector<Step> steps;
+		int sinkFd;
+		KeyCodes keyCodes;
+		std::function<void (bool passed)> finished;
+		std::atomic<int> result; // 0 while running, 1 passed, -1 failed
+
+		void parse(const std::string & line, int lineNumber, std::vector<size_t> & loops);
+		void fail(const Step & step, const std::string & why);
+
+		// The bus, guarded by lock
+		mutable boost::mutex lock;
+		boost::condition_variable changed;
+		Device devices[16];
+		CEC::cec_logical_address self;
+		uint16_t activePath;
+		bool open;
+		bool connected;   // false after a connection lost alert, until opened again
+		unsigned opens;   // times the adapter was opened
+		int loss;         // % of frames lost
+		std::minstd_rand random;
+		CEC::ICECCallbacks *callbacks;
+		void *callbackParam;
+		std::deque< std::function<void ()> > pending;   // callbacks for the scenario thread to make
+
+		struct Heard
+		{
+			CEC::cec_command frame;
+			boost::chrono::steady_clock::time_point at;
+		};
+		std::deque<Heard> heard; // frames the daemon sent, and libcec sent for it
+		void hear(const CEC::cec_command & frame);
+
+		friend class SimulatedAdapter;
+		void opened(const CEC::libcec_configuration & config);
+		void closed();
+		bool transmitted(const CEC::cec_command & command);
+		void answer(const CEC::cec_command & command);
+		bool lost();
+		bool send(const CEC::cec_command & command);
+
+		// The scenario thread
+		boost::thread thread;
+		bool stopping;
+		void run();
+		bool step(size_t & pc, std::vector< std::pair<size_t, int> > & loops);
+
+		// Waits until deadline, making the pending callbacks meanwhile, returns false when stopping
+		bool sleepUntil(boost::chrono::steady_clock::time_point deadline);
+
+		void deliver(const CEC::cec_command & command);
+		void deliver(const CEC::cec_keypress & key);
+		void key(const Step & step);
+
+		bool expectKey(const Step & step);
+		bool expectFrame(const Step & step);
+		bool expectNothing(const Step & step);
+		bool expectNoFrame(const Step & step);
+		bool expectOpen(const Step & step);
+
+		// Reading the sink back
+		off_t sinkOffset;
+		unsigned opensSeen;
+		std::deque<boost::chrono::steady_clock::time_point> stimuli; // when the last keys were sent, oldest first
+
+		// Results
+		unsigned stepsRun;
+		unsigned keysSent;
+		unsigned framesLost;
+		unsigned latencies;
+		boost::chrono::microseconds latencyTotal;
+		boost::chrono::microseconds latencyMax;
+};
@@ -0,0 +1,123 @@
+/**
+ * status.h
+ *
+ * The status page libcec-daemon publishes with --status-page, and how to read
+ * it. This header has no dependencies beyond libc and can be copied into any C
+ * or C++ program:
+ *
+ *   const struct cec_daemon_status *page = cec_daemon_status_map(CEC_DAEMON_STATUS_PATH);
+ *   struct cec_daemon_status status;
+ *   if (page && cec_daemon_status_read(page, &status) == 0 && status.active)
+ *       ...
+ *
+ * Reading never talks to the daemon: the page is a file in /dev/shm that the
+ * daemon updates in place under a sequence lock, so a read is a copy of a few
+ * hundred bytes, retried in the rare case it raced with an update.
+ *
+ * The file is always CEC_DAEMON_STATUS_FILE_SIZE bytes. The layout only ever
+ * grows at the end, size tells how much of it the daemon writes. A change that
+ * isn't compatible bumps CEC_DAEMON_STATUS_VERSION.
+ */
+#ifndef CEC_DAEMON_STATUS_H
+#define CEC_DAEMON_STATUS_H
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define CEC_DAEMON_STATUS_PATH    "/dev/shm/libcec-daemon.status"
+#define CEC_DAEMON_STATUS_MAGIC   0x53434543 /* "CECS" */
+#define CEC_DAEMON_STATUS_VERSION 1
+#define CEC_DAEMON_STATUS_FILE_SIZE 4096
+
+enum cec_daemon_status_state
+{
+	CEC_DAEMON_STATUS_STOPPED = 0, /* the daemon exited */
+	CEC_DAEMON_STATUS_CLOSED  = 1, /* running, the adapter isn't open */
+	CEC_DAEMON_STATUS_OPEN    = 2,
+};
+
+enum cec_daemon_status_power
+{
+	CEC_DAEMON_STATUS_POWER_UNKNOWN = 0,
+	CEC_DAEMON_STATUS_POWER_ON      = 1,
+	CEC_DAEMON_STATUS_POWER_STANDBY = 2,
+};
+
+struct cec_daemon_status
+{
+	uint32_t magic;            /* CEC_DAEMON_STATUS_MAGIC once the page is set up */
+	uint16_t version;          /* CEC_DAEMON_STATUS_VERSION */
+	uint16_t size;             /* bytes of this struct the daemon writes */
+	uint32_t sequence;         /* odd while the daemon updates the page */
+	uint32_t pid;              /* of the daemon */
+	uint64_t updated;          /* CLOCK_REALTIME of the last update, in nanoseconds */
+
+	uint8_t  state;            /* enum cec_daemon_status_state */
+	uint8_t  active;           /* 1 while we are the active source */
+	uint8_t  tv_power;         /* enum cec_daemon_status_power */
+	uint8_t  logical_address;  /* ours, 15 while unknown */
+	uint16_t physical_address; /* ours, 0xFFFF while unknown */
+	uint16_t last_key;         /* CEC user control code of the last remote key, 0xFFFF if none */
+	uint64_t last_key_time;    /* CLOCK_REALTIME of the last remote key, in nanoseconds, 0 if none */
+	uint32_t keys;             /* remote key presses and repeats since the daemon started */
+	uint32_t reserved;
+
+	char     keymap[128];      /* keymap file in use, empty for the built-in keymap */
+};
+
+/**
+ * Maps the page read only, NULL if there is none. The mapping stays valid
+ * when the daemon restarts.
+ */
+static inline const struct cec_daemon_status *cec_daemon_status_map(const char *path)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	void *page = mmap(NULL, sizeof(struct cec_daemon_status), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	return page == MAP_FAILED ? NULL : (const struct cec_daemon_status *) page;
+}
+
+static inline void cec_daemon_status_unmap(const struct cec_daemon_status *page)
+{
+	munmap((void *) page, sizeof(struct cec_daemon_status));
+}
+
+/**
+ * Copies a consistent snapshot of the page to out. Returns 0, or -1 if the
+ * page isn't set up, is of another version, or is stuck being updated.
+ */
+static inline int cec_daemon_status_read(const struct cec_daemon_status *page, struct cec_daemon_status *out)
+{
+	int tries;
+	for (tries = 0; ; tries++) {
+		/* an update takes a moment, one that never ends is a daemon that died in it */
+		if (tries == 100000)
+			return -1;
+
+		uint32_t begin = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+		if (begin & 1)
+			continue;
+
+		memcpy(out, page, sizeof(*out));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->sequence, __ATOMIC_RELAXED) == begin)
+			break;
+	}
+
+	if (out->magic != CEC_DAEMON_STATUS_MAGIC || out->version != CEC_DAEMON_STATUS_VERSION)
+		return -1;
+
+	/* a newer daemon may write more, an older one less */
+	if (out->size < sizeof(*out))
+		memset((char *) out + out->size, 0, sizeof(*out) - out->size);
+	return 0;
+}
+
+#endif /* CEC_DAEMON_STATUS_H */
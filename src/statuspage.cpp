@@ -0,0 +1,187 @@
+/**
+ * statuspage.cpp
+ */
+#include "statuspage.h"
+#include "libcec.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <map>
+#include <stdexcept>
+
+#include <sys/stat.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("statuspage");
+
+// Everything from pid on is written by publish(), the header before it only once
+static const size_t bodyOffset = offsetof(cec_daemon_status, pid);
+
+StatusPage::StatusPage() : page(NULL) {}
+
+StatusPage::~StatusPage() {
+	close();
+	if (page)
+		munmap(page, CEC_DAEMON_STATUS_FILE_SIZE);
+}
+
+/**
+ * Opens the page left by an earlier daemon, if it is a plain file of ours,
+ * -1 if there is none. Anything else at path, e.g. a symlink to a file we
+ * would clobber or a file somebody else could write to under the readers, is
+ * removed.
+ */
+static int reopen(const string & path) {
+	int fd = ::open(path.c_str(), O_RDWR | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0 && errno == ENOENT)
+		return -1;
+
+	struct stat st;
+	if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid() && st.st_nlink == 1)
+		return fd;
+
+	if (fd >= 0)
+		::close(fd);
+	LOG4CPLUS_WARN(logger, "Replacing " << path << ", it isn't a status page of ours");
+	if (unlink(path.c_str()) < 0 && errno != ENOENT)
+		throw std::runtime_error("Failed to remove " + path + ": " + strerror(errno));
+	return -1;
+}
+
+void StatusPage::open(const string & path) {
+	int fd = reopen(path);
+	if (fd < 0)
+		fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("Failed to open status page " + path + ": " + strerror(errno));
+
+	// the readers' mappings of a page left by an earlier daemon stay valid
+	if (ftruncate(fd, CEC_DAEMON_STATUS_FILE_SIZE) < 0) {
+		int error = errno;
+		::close(fd);
+		throw std::runtime_error("Failed to size status page " + path + ": " + strerror(error));
+	}
+
+	void *mapped = mmap(NULL, CEC_DAEMON_STATUS_FILE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED)
+		throw std::runtime_error("Failed to map status page " + path + ": " + strerror(errno));
+
+	page = (cec_daemon_status *) mapped;
+
+	// a daemon that died while updating left the sequence odd
+	uint32_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->sequence, (sequence | 1) + 1, __ATOMIC_RELAXED);
+
+	cec_daemon_status status;
+	memset(&status, 0, sizeof(status));
+	status.state            = CEC_DAEMON_STATUS_CLOSED;
+	status.logical_address  = CECDEVICE_BROADCAST;
+	status.physical_address = 0xFFFF;
+	status.last_key         = 0xFFFF;
+	publish(status);
+
+	page->version = CEC_DAEMON_STATUS_VERSION;
+	page->size    = sizeof(cec_daemon_status);
+	__atomic_store_n(&page->magic, CEC_DAEMON_STATUS_MAGIC, __ATOMIC_RELEASE);
+
+	LOG4CPLUS_INFO(logger, "Publishing the status at " << path);
+}
+
+void StatusPage::close() {
+	if (!page || page->state == CEC_DAEMON_STATUS_STOPPED)
+		return;
+
+	cec_daemon_status status;
+	memcpy(&status, page, sizeof(status));
+	status.state = CEC_DAEMON_STATUS_STOPPED;
+	publish(status);
+}
+
+void StatusPage::publish(const cec_daemon_status & status) {
+	if (!page)
+		return;
+
+	uint32_t sequence = __atomic_load_n(&page->sequence, __ATOMIC_RELAXED);
+	__atomic_store_n(&page->sequence, sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	memcpy((char *) page + bodyOffset, (const char *) &status + bodyOffset, sizeof(status) - bodyOffset);
+	page->pid     = getpid();
+	page->updated = now();
+
+	__atomic_store_n(&page->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+uint64_t StatusPage::now() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void printTime(std::ostream & out, uint64_t time) {
+	time_t seconds = time / 1000000000;
+	struct tm local;
+	char buf[32];
+	localtime_r(&seconds, &local);
+	strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+	out << buf << "." << std::setfill('0') << std::setw(3) << (time / 1000000) % 1000 << std::setfill(' ');
+
+	uint64_t now = StatusPage::now();
+	if (now >= time)
+		out << " (" << (now - time) / 1000000000 << "s ago)";
+}
+
+bool StatusPage::print(const string & path, std::ostream & out) {
+	const cec_daemon_status *page = cec_daemon_status_map(path.c_str());
+	if (!page) {
+		out << "No status page at " << path << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	cec_daemon_status status;
+	int ret = cec_daemon_status_read(page, &status);
+	cec_daemon_status_unmap(page);
+	if (ret < 0) {
+		out << "Status page " << path << " is not set up, or of another version" << std::endl;
+		return false;
+	}
+
+	static const char *states[] = { "stopped", "adapter closed", "adapter open" };
+	static const char *powers[] = { "unknown", "on", "standby" };
+
+	out << "state:            " << (status.state < 3 ? states[status.state] : "?") << std::endl;
+	out << "pid:              " << status.pid << std::endl;
+	out << "updated:          "; printTime(out, status.updated); out << std::endl;
+	out << "active source:    " << (status.active ? "yes" : "no") << std::endl;
+	out << "TV power:         " << (status.tv_power < 3 ? powers[status.tv_power] : "?") << std::endl;
+	out << "logical address:  " << (int) status.logical_address << std::endl;
+	out << "physical address: ";
+	if (status.physical_address == 0xFFFF)
+		out << "unknown" << std::endl;
+	else
+		out << (status.physical_address >> 12) << "." << ((status.physical_address >> 8) & 0xF) << "."
+		    << ((status.physical_address >> 4) & 0xF) << "." << (status.physical_address & 0xF) << std::endl;
+	out << "keymap:           " << (status.keymap[0] ? status.keymap : "built-in") << std::endl;
+	out << "keys:             " << status.keys << std::endl;
+	out << "last key:         ";
+	if (status.last_key == 0xFFFF) {
+		out << "none" << std::endl;
+	} else {
+		std::map<cec_user_control_code, const char *>::const_iterator name = Cec::cecUserControlCodeName.find((cec_user_control_code) status.last_key);
+		out << (name != Cec::cecUserControlCodeName.end() ? name->second : "UNKNOWN") << " at ";
+		printTime(out, status.last_key_time);
+		out << std::endl;
+	}
+	return true;
+}
@@ -0,0 +1,57 @@
+#include "status.h"
+
+#include <ostream>
+#include <string>
+
+/**
+ * Publishes the daemon's state in a file in /dev/shm, see status.h, so the
+ * programs polling it never have to ask the daemon.
+ *
+ * Only one thread, the main loop, publishes: it bumps the sequence to odd,
+ * writes the page and bumps the sequence to even again, and readers retry
+ * when the sequence was odd or changed while they copied.
+ */
+class StatusPage {
+
+	public:
+
+		StatusPage();
+		virtual ~StatusPage();
+
+		/**
+		 * Creates the page at path, or takes over one left by an earlier
+		 * daemon if it is a regular file we own, throws std::runtime_error if
+		 * it can't
+		 */
+		void open(const std::string & path);
+
+		/**
+		 * Marks the page stopped, it stays for the readers to see so
+		 */
+		void close();
+
+		bool enabled() const { return page != NULL; };
+
+		/**
+		 * Copies status to the page, everything from pid on
+		 */
+		void publish(const cec_daemon_status & status);
+
+		/**
+		 * CLOCK_REALTIME in nanoseconds, as the page has it
+		 */
+		static uint64_t now();
+
+		/**
+		 * Prints the page at path in a human readable form
+		 */
+		static bool print(const std::string & path, std::ostream & out);
+
+	private:
+
+		// Not implemented
+		StatusPage(StatusPage const&);
+		void operator=(StatusPage const&);
+
+		cec_daemon_status *page;
+};
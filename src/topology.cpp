@@ -0,0 +1,122 @@
+/**
+ * topology.cpp
+ */
+#include "topology.h"
+#include "hdmi.h"
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+static Logger logger = Logger::getInstance("topology");
+
+static const uint16_t unknownAddress = 0xFFFF;
+
+Topology::Topology() : self(CECDEVICE_UNKNOWN), physical(unknownAddress), conflicted(false) {
+	reset();
+}
+
+void Topology::reset() {
+	for (int i = 0; i < 16; i++) {
+		addresses[i] = unknownAddress;
+		types[i] = CEC_DEVICE_TYPE_RESERVED;
+	}
+	conflicted = false;
+}
+
+uint16_t Topology::parent(uint16_t address) {
+	for (int shift = 0; shift < 16; shift += 4) {
+		if (address & (0xF << shift))
+			return address & ~(0xF << shift);
+	}
+	return unknownAddress;
+}
+
+void Topology::observed(const cec_command & command) {
+	if (!command.opcode_set || command.opcode != CEC_OPCODE_REPORT_PHYSICAL_ADDRESS)
+		return;
+
+	const cec_datapacket & p = command.parameters;
+	if (p.size < 2 || command.initiator >= CECDEVICE_BROADCAST)
+		return;
+
+	reported(command.initiator, (uint16_t) (p.data[0] << 8 | p.data[1]),
+		p.size >= 3 ? (int) p.data[2] : (int) CEC_DEVICE_TYPE_RESERVED);
+}
+
+void Topology::reported(cec_logical_address logical, uint16_t address, int type) {
+	types[logical] = type;
+	if (addresses[logical].exchange(address) != address)
+		LOG4CPLUS_DEBUG(logger, "Device " << (int) logical << " at " << HDMI::physical_address(address));
+
+	// it moved there, whoever had that address before is gone
+	for (int i = 0; i < CECDEVICE_BROADCAST; i++) {
+		if (i != logical && addresses[i] == address)
+			addresses[i] = unknownAddress;
+	}
+
+	if (address == physical && logical != self && !conflicted.exchange(true)) {
+		LOG4CPLUS_WARN(logger, "Device " << (int) logical << " reports our physical address " << HDMI::physical_address(address)
+			<< ", the HDMI port was probably not detected, try -p");
+	}
+}
+
+void Topology::setOurAddress(cec_logical_address logical, uint16_t address) {
+	self = logical;
+	if (physical.exchange(address) == address)
+		return;
+
+	conflicted = false;
+	HDMI::address detected;
+	if (port(address, detected))
+		LOG4CPLUS_INFO(logger, "On HDMI port " << detected << " (" << HDMI::physical_address(address) << ")");
+
+	if (logical < CECDEVICE_BROADCAST)
+		addresses[logical] = address;
+}
+
+uint16_t Topology::physicalAddress(cec_logical_address logical) const {
+	if (logical < CECDEVICE_TV || logical >= CECDEVICE_BROADCAST)
+		return unknownAddress;
+	return addresses[logical];
+}
+
+bool Topology::port(uint16_t address, HDMI::address & out) const {
+	if (address == 0 || address == unknownAddress)
+		return false;
+
+	uint16_t up = parent(address);
+
+	// the digit that differs from the parent is the port
+	int shift = 0;
+	while (!(address & (0xF << shift)))
+		shift += 4;
+
+	cec_logical_address base = CECDEVICE_UNKNOWN;
+	if (up == 0) {
+		base = CECDEVICE_TV;
+	} else {
+		for (int i = 0; i < CECDEVICE_BROADCAST; i++) {
+			if (addresses[i] == up && (i == CECDEVICE_AUDIOSYSTEM || types[i] == CEC_DEVICE_TYPE_AUDIO_SYSTEM)) {
+				base = CECDEVICE_AUDIOSYSTEM;
+				break;
+			}
+		}
+	}
+	if (base == CECDEVICE_UNKNOWN)
+		return false;
+
+	// libcec works out the physical address from the base device and port
+	out = HDMI::address();
+	out.logical = base;
+	out.port = (address >> shift) & 0xF;
+	return true;
+}
+
+bool Topology::ourPort(HDMI::address & out) const {
+	if (conflicted)
+		return false;
+	return port(physical, out);
+}
@@ -0,0 +1,72 @@
+#include <libcec/cectypes.h>
+
+#include <atomic>
+#include <cstdint>
+
+namespace HDMI { class address; }
+
+/**
+ * The HDMI tree of the bus, from the physical addresses the devices report.
+ * A device's parent is its address with the last non zero digit cleared, so
+ * 1.2.0.0 sits on port 2 of 1.0.0.0, which sits on port 1 of the TV at 0.0.0.0.
+ *
+ * Kept while the adapter is reopened, so the port found behind the TV or the
+ * audio system can be given to libcec straight away rather than detected again.
+ *
+ * Updated from the libcec callbacks, read from the main loop.
+ */
+class Topology {
+
+	public:
+
+		Topology();
+
+		/**
+		 * Follows a frame received from the bus
+		 */
+		void observed(const CEC::cec_command & command);
+
+		/**
+		 * Our own addresses, as libcec negotiated them
+		 */
+		void setOurAddress(CEC::cec_logical_address logical, uint16_t physical);
+
+		/**
+		 * Physical address a device reported, 0xFFFF while unknown
+		 */
+		uint16_t physicalAddress(CEC::cec_logical_address logical) const;
+
+		/**
+		 * Another device reported our physical address, libcec most likely
+		 * failed to detect our port
+		 */
+		bool conflict() const { return conflicted; };
+
+		/**
+		 * The TV or audio system port physical sits on, false when its
+		 * parent isn't either of them or isn't known
+		 */
+		bool port(uint16_t physical, HDMI::address & port) const;
+
+		/**
+		 * The port we sit on, false while unknown or in conflict
+		 */
+		bool ourPort(HDMI::address & port) const;
+
+		/**
+		 * Forgets the tree, when we moved to another bus
+		 */
+		void reset();
+
+		static uint16_t parent(uint16_t physical);
+
+	private:
+
+		std::atomic<uint16_t> addresses[16];   // per logical address
+		std::atomic<int> types[16];            // cec_device_type, per logical address
+		std::atomic<int> self;                 // our cec_logical_address
+		std::atomic<uint16_t> physical;        // our physical address
+		std::atomic<bool> conflicted;
+
+		void reported(CEC::cec_logical_address logical, uint16_t address, int type);
+};
@@ -0,0 +1,262 @@
+/**
+ * transmit.cpp
+ *
+ * Bus timings are the nominal ones from the HDMI-CEC specification: a 4.5ms
+ * start bit followed by 10 bit blocks of 2.4ms bits (header, opcode and each
+ * parameter), and a signal free time of 7 bit periods before an initiator may
+ * send again, or 5 before a different initiator may.
+ */
+#include "transmit.h"
+
+#include <algorithm>
+
+using namespace CEC;
+
+static const boost::chrono::steady_clock::duration bitPeriod   = boost::chrono::microseconds(2400);
+static const boost::chrono::steady_clock::duration startBit    = boost::chrono::microseconds(4500);
+static const boost::chrono::steady_clock::duration blockTime   = bitPeriod * 10;
+
+static const boost::chrono::steady_clock::duration window      = boost::chrono::seconds(1);
+
+// Devices usually answer a request within this, so leave them the bus first
+static const boost::chrono::steady_clock::duration settleTime  = boost::chrono::milliseconds(50);
+
+// Followers assume a key was released when it isn't repeated within 550ms
+const TransmitQueue::clock::duration TransmitQueue::keyRepeat = boost::chrono::milliseconds(200);
+
+static const uint8_t maxAttempts = 3;
+static const boost::chrono::steady_clock::duration retryDelay  = boost::chrono::milliseconds(100);
+
+TransmitQueue::TransmitQueue() : count(0), sequence(0), current(-1), historyNext(0),
+	lastEnd(clock::time_point::min()), lastOurs(false), budget(0.5) {
+	for (size_t i = 0; i < TRANSMIT_QUEUE_SIZE; i++)
+		entries[i].used = false;
+	for (size_t i = 0; i < TRANSMIT_HISTORY_SIZE; i++)
+		history[i].end = clock::time_point::min();
+}
+
+TransmitQueue::clock::duration TransmitQueue::frameTime(const cec_command & frame) {
+	size_t blocks = 1;
+	if (frame.opcode_set)
+		blocks += 1 + frame.parameters.size;
+	return startBit + blockTime * blocks;
+}
+
+bool TransmitQueue::same(const cec_command & a, const cec_command & b) {
+	return a.initiator == b.initiator && a.destination == b.destination
+		&& a.opcode_set == b.opcode_set && (!a.opcode_set || a.opcode == b.opcode)
+		&& a.parameters.size == b.parameters.size
+		&& std::equal(a.parameters.data, a.parameters.data + a.parameters.size, b.parameters.data);
+}
+
+TransmitQueue::Entry * TransmitQueue::alloc(Kind kind, Priority priority, clock::time_point now) {
+	if (count == TRANSMIT_QUEUE_SIZE)
+		return NULL;
+
+	for (size_t i = 0; i < TRANSMIT_QUEUE_SIZE; i++) {
+		Entry & entry = entries[i];
+		if (entry.used)
+			continue;
+
+		entry.used      = true;
+		entry.kind      = kind;
+		entry.priority  = priority;
+		entry.sequence  = sequence++;
+		entry.attempts  = 0;
+		entry.presses   = 0;
+		entry.notBefore = now;
+		count++;
+		return &entry;
+	}
+	return NULL;
+}
+
+bool TransmitQueue::push(const cec_command & frame, Priority priority, clock::time_point now) {
+	for (size_t i = 0; i < TRANSMIT_QUEUE_SIZE; i++) {
+		Entry & entry = entries[i];
+		if (entry.used && entry.kind == KIND_FRAME && (int) i != current && same(entry.frame, frame)) {
+			// Already on its way, it only has to go out as soon as the most urgent copy
+			entry.priority = std::min(entry.priority, priority);
+			return false;
+		}
+	}
+
+	Entry *entry = alloc(KIND_FRAME, priority, now);
+	if (entry == NULL)
+		return false;
+
+	entry->frame = frame;
+	return true;
+}
+
+bool TransmitQueue::pushKey(cec_logical_address initiator, cec_logical_address destination,
+		cec_user_control_code key, Priority priority, clock::time_point now) {
+
+	for (size_t i = 0; i < TRANSMIT_QUEUE_SIZE; i++) {
+		Entry & entry = entries[i];
+		if (entry.used && entry.kind == KIND_KEY && entry.presses > 0
+				&& entry.frame.initiator == initiator && entry.frame.destination == destination
+				&& entry.frame.parameters.data[0] == key) {
+			// Still held down, keep it held for one more press
+			entry.presses++;
+			entry.priority = std::min(entry.priority, priority);
+			return false;
+		}
+	}
+
+	Entry *entry = alloc(KIND_KEY, priority, now);
+	if (entry == NULL)
+		return false;
+
+	cec_command::Format(entry->frame, initiator, destination, CEC_OPCODE_USER_CONTROL_PRESSED);
+	entry->frame.parameters.PushBack((uint8_t) key);
+	entry->presses = 1;
+	return true;
+}
+
+void TransmitQueue::frameOf(const Entry & entry, cec_command & frame) const {
+	if (entry.kind == KIND_KEY && entry.presses == 0) {
+		cec_command::Format(frame, entry.frame.initiator, entry.frame.destination, CEC_OPCODE_USER_CONTROL_RELEASE);
+	} else {
+		frame = entry.frame;
+	}
+}
+
+int TransmitQueue::pick(clock::time_point now) const {
+	int best = -1;
+	for (size_t i = 0; i < TRANSMIT_QUEUE_SIZE; i++) {
+		const Entry & entry = entries[i];
+		if (!entry.used || entry.notBefore > now)
+			continue;
+		if (best < 0 || entry.priority < entries[best].priority
+				|| (entry.priority == entries[best].priority && entry.sequence < entries[best].sequence))
+			best = i;
+	}
+	return best;
+}
+
+TransmitQueue::clock::time_point TransmitQueue::allowedAt(const Entry & entry, const cec_command & frame, clock::time_point now) const {
+	// Signal free time, plus room for an answer to somebody else's frame unless we are the answer
+	clock::time_point at = now;
+	if (lastEnd != clock::time_point::min()) {
+		if (lastOurs)
+			at = lastEnd + bitPeriod * 7;
+		else
+			at = lastEnd + (entry.priority == PRIORITY_HIGH ? bitPeriod * 5 : settleTime);
+		at = std::max(at, now);
+	}
+
+	// Occupancy over the window ending when the frame would be sent
+	clock::duration allowed = boost::chrono::duration_cast<clock::duration>(window * budget);
+	clock::duration length = frameTime(frame);
+	clock::duration used = clock::duration::zero();
+	for (size_t i = 0; i < TRANSMIT_HISTORY_SIZE; i++) {
+		if (history[i].end > at - window)
+			used += history[i].length;
+	}
+	if (used + length <= allowed)
+		return at;
+
+	// Wait for the oldest busy periods to leave the window, history is in time order
+	for (size_t n = 0; n < TRANSMIT_HISTORY_SIZE; n++) {
+		const Busy & b = history[(historyNext + n) % TRANSMIT_HISTORY_SIZE];
+		if (b.end <= at - window)
+			continue;
+		used -= b.length;
+		if (used + length <= allowed)
+			return b.end + window;
+	}
+	return at;
+}
+
+bool TransmitQueue::next(clock::time_point now, cec_command & frame) {
+	current = -1;
+
+	int i = pick(now);
+	if (i < 0)
+		return false;
+
+	frameOf(entries[i], frame);
+	if (allowedAt(entries[i], frame, now) > now)
+		return false;
+
+	current = i;
+	return true;
+}
+
+TransmitQueue::Result TransmitQueue::sent(const cec_command & frame, bool acked, clock::time_point now) {
+	// Sent or not, the bus was busy for it
+	busy(frame, now, true);
+
+	if (current < 0)
+		return acked ? RESULT_SENT : RESULT_FAILED;
+
+	Entry & entry = entries[current];
+	current = -1;
+
+	Result result = RESULT_SENT;
+	if (!acked) {
+		if (++entry.attempts < maxAttempts) {
+			entry.notBefore = now + retryDelay * entry.attempts;
+			return RESULT_RETRY;
+		}
+		result = RESULT_FAILED;
+	}
+	entry.attempts = 0;
+
+	if (entry.kind == KIND_KEY && entry.presses > 0) {
+		// A press that didn't make it still needs its release
+		entry.presses = acked ? entry.presses - 1 : 0;
+		entry.notBefore = now + keyRepeat;
+		return result;
+	}
+
+	entry.used = false;
+	count--;
+	return result;
+}
+
+void TransmitQueue::observed(const cec_command & frame, clock::time_point now) {
+	busy(frame, now, false);
+}
+
+void TransmitQueue::busy(const cec_command & frame, clock::time_point now, bool ours) {
+	Busy & b = history[historyNext];
+	b.end    = now;
+	b.length = frameTime(frame);
+	historyNext = (historyNext + 1) % TRANSMIT_HISTORY_SIZE;
+
+	lastEnd  = now;
+	lastOurs = ours;
+}
+
+TransmitQueue::clock::time_point TransmitQueue::deadline(clock::time_point now) const {
+	clock::time_point deadline = clock::time_point::max();
+	for (size_t i = 0; i < TRANSMIT_QUEUE_SIZE; i++) {
+		const Entry & entry = entries[i];
+		if (!entry.used)
+			continue;
+
+		cec_command frame;
+		frameOf(entry, frame);
+		clock::time_point at = std::max(entry.notBefore, now);
+		deadline = std::min(deadline, allowedAt(entry, frame, at));
+	}
+	return deadline;
+}
+
+double TransmitQueue::occupancy(clock::time_point now) const {
+	clock::duration used = clock::duration::zero();
+	for (size_t i = 0; i < TRANSMIT_HISTORY_SIZE; i++) {
+		if (history[i].end > now - window)
+			used += history[i].length;
+	}
+	return std::min(1.0, boost::chrono::duration<double>(used).count() / boost::chrono::duration<double>(window).count());
+}
+
+void TransmitQueue::clear() {
+	for (size_t i = 0; i < TRANSMIT_QUEUE_SIZE; i++)
+		entries[i].used = false;
+	count = 0;
+	current = -1;
+}
@@ -0,0 +1,155 @@
+#include <libcec/cectypes.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#include <boost/chrono.hpp>
+
+/**
+ * Most frames waiting to go on the bus, so queueing never allocates
+ */
+#define TRANSMIT_QUEUE_SIZE 16
+
+/**
+ * Busy periods remembered to measure bus occupancy
+ */
+#define TRANSMIT_HISTORY_SIZE 40
+
+/**
+ * Schedules our outgoing CEC frames.
+ *
+ * The bus only carries a few hundred bits per second, and a frame sent
+ * straight after someone else's tends to collide or be dropped by the TV.
+ * Frames are queued by priority, redundant ones are coalesced, and a frame
+ * is only released once the bus has been quiet for a moment and the time
+ * the bus was busy over the last second, by us or anyone else, leaves room
+ * for it. Failed frames are retried a few times.
+ *
+ * The queue itself never talks to the adapter: next() hands out the frame
+ * to send and sent() is told how that went.
+ */
+class TransmitQueue {
+
+	public:
+
+		typedef boost::chrono::steady_clock clock;
+
+		enum Priority
+		{
+			PRIORITY_HIGH,   // replies somebody is waiting for
+			PRIORITY_NORMAL, // key presses, source changes
+			PRIORITY_LOW,    // announcements nobody asked for
+			PRIORITY_MAX,
+		};
+
+		enum Result
+		{
+			RESULT_SENT,
+			RESULT_RETRY,  // failed, will be tried again
+			RESULT_FAILED, // failed for the last time
+		};
+
+		/**
+		 * How often a held key repeats USER_CONTROL_PRESSED
+		 */
+		static const clock::duration keyRepeat;
+
+		TransmitQueue();
+
+		/**
+		 * Fraction (0-1] of the last second the bus may be busy before we hold back
+		 */
+		void setBudget(double budget) {this->budget = budget;};
+
+		/**
+		 * Queues a frame, returns false if it was coalesced with one already
+		 * queued, or dropped because the queue is full
+		 */
+		bool push(const CEC::cec_command & frame, Priority priority, clock::time_point now);
+
+		/**
+		 * Queues a remote key press and release. Presses of a key already
+		 * queued for the same device make it held down for longer instead,
+		 * repeating USER_CONTROL_PRESSED once per press.
+		 */
+		bool pushKey(CEC::cec_logical_address initiator, CEC::cec_logical_address destination,
+			CEC::cec_user_control_code key, Priority priority, clock::time_point now);
+
+		/**
+		 * Takes the frame that should be sent now, returns false if none may be
+		 */
+		bool next(clock::time_point now, CEC::cec_command & frame);
+
+		/**
+		 * Reports how sending the frame returned by next() went
+		 */
+		Result sent(const CEC::cec_command & frame, bool acked, clock::time_point now);
+
+		/**
+		 * Accounts for a frame somebody else sent on the bus
+		 */
+		void observed(const CEC::cec_command & frame, clock::time_point now);
+
+		/**
+		 * When next() may have something to send, time_point::max() when nothing is queued
+		 */
+		clock::time_point deadline(clock::time_point now) const;
+
+		/**
+		 * Fraction of the last second the bus was busy
+		 */
+		double occupancy(clock::time_point now) const;
+
+		bool empty() const { return count == 0; };
+		void clear();
+
+		/**
+		 * Time a frame takes on the wire
+		 */
+		static clock::duration frameTime(const CEC::cec_command & frame);
+
+	private:
+
+		enum Kind
+		{
+			KIND_FRAME,
+			KIND_KEY, // USER_CONTROL_PRESSED repeated presses times, then USER_CONTROL_RELEASE
+		};
+
+		struct Entry
+		{
+			bool used;
+			Kind kind;
+			Priority priority;
+			CEC::cec_command frame;
+			uint64_t sequence;          // FIFO order within a priority
+			uint8_t attempts;           // failed attempts so far
+			unsigned presses;           // KIND_KEY presses still to send
+			clock::time_point notBefore;
+		};
+
+		struct Busy
+		{
+			clock::time_point end;
+			clock::duration length;
+		};
+
+		Entry entries[TRANSMIT_QUEUE_SIZE];
+		size_t count;
+		uint64_t sequence;
+		int current; // entry handed out by next(), -1 if none
+
+		Busy history[TRANSMIT_HISTORY_SIZE];
+		size_t historyNext;
+		clock::time_point lastEnd; // when the last frame on the bus ended
+		bool lastOurs;             // and whether we sent it
+
+		double budget;
+
+		Entry * alloc(Kind kind, Priority priority, clock::time_point now);
+		int pick(clock::time_point now) const;
+		void frameOf(const Entry & entry, CEC::cec_command & frame) const;
+		clock::time_point allowedAt(const Entry & entry, const CEC::cec_command & frame, clock::time_point now) const;
+		void busy(const CEC::cec_command & frame, clock::time_point now, bool ours);
+		static bool same(const CEC::cec_command & a, const CEC::cec_command & b);
+};
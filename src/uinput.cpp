@@ -1,11 +1,15 @@
 #include "uinput.h"
+#include "metrics.h"
+#include "profile.h"
 
+#include <algorithm>
 #include <cstring>
 #include <stdexcept>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/uinput.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <log4cplus/logger.h>
@@ -18,10 +22,39 @@ static const char *uinput_filename[] = {"/dev/uinput", "/dev/input/uinput", "/de
 
 static Logger logger = Logger::getInstance("uinput");
 
-UInput::UInput(const char *dev_name, const std::vector< std::list<__u16> > & keys) : fd(-1) {
+int UInput::sink = -1;
+
+UInput::UInput(const char *dev_name, const std::vector< std::list<__u16> > & keys) : fd(-1), sinking(false), pointer(false),
+	name(dev_name), keys(keys) {}
+
+void UInput::setPointer(bool pointer) {
+	if (this->fd >= 0 && pointer == this->pointer)
+		return;
+
+	if (this->fd >= 0) {
+		LOG4CPLUS_INFO(logger, "Creating the device again " << (pointer ? "with" : "without") << " the pointer");
+		destroy();
+	}
+	this->pointer = pointer;
+
+	StartupProfile::Scope profile(StartupProfile::PHASE_UINPUT);
+	if (sink >= 0) {
+		this->fd = dup(sink);
+		if (this->fd < 0)
+			throw std::runtime_error("Failed to open uinput sink");
+		sinking = true;
+		LOG4CPLUS_INFO(logger, "Writing events to a sink rather than uinput");
+		return;
+	}
 	openAll();
-	setup(dev_name, keys);
-	create();
+	try {
+		setup();
+		create();
+	} catch (...) {
+		close(this->fd);
+		this->fd = -1;
+		throw;
+	}
 }
 
 UInput::~UInput() {
@@ -69,13 +102,13 @@ void UInput::openAll() {
 	}
 }
 
-void UInput::setup(const char *dev_name, const std::vector< std::list<__u16> > & keys) {
+void UInput::setup() {
 
 	int ret;
 	struct uinput_user_dev uidev;
 	memset(&uidev, 0, sizeof(uidev));
 
-	strncpy(uidev.name, dev_name, UINPUT_MAX_NAME_SIZE);
+	strncpy(uidev.name, name.c_str(), UINPUT_MAX_NAME_SIZE);
 	uidev.id.bustype = BUS_USB;
 	uidev.id.vendor  = 1;
 	uidev.id.product = 1;
@@ -87,8 +120,14 @@ void UInput::setup(const char *dev_name, const std::vector< std::list<__u16> > &
 		//cerr << "Failed to setup uinput: " << errno << " " << strerror(errno) << endl;
 	}
 
-	// We only want to send keypresses
+	// We only want to send keypresses, and relative motion for pointer mode
 	ret  = ioctl(this->fd, UI_SET_EVBIT, EV_KEY);
+	if (pointer) {
+		ret |= ioctl(this->fd, UI_SET_EVBIT, EV_REL);
+		ret |= ioctl(this->fd, UI_SET_RELBIT, REL_X);
+		ret |= ioctl(this->fd, UI_SET_RELBIT, REL_Y);
+		ret |= ioctl(this->fd, UI_SET_KEYBIT, BTN_LEFT);
+	}
 
 	// Add all the keys we might use
 	for (std::vector< std::list<__u16> >::const_iterator i = keys.begin(); i != keys.end(); ++i) {
@@ -119,7 +158,7 @@ void UInput::create() {
 	sleep(1);
 }
 
-void UInput::send_event(__u16 type, __u16 code, __s32 value) const {
+void UInput::send_event(__u16 type, __u16 code, __s32 value) {
 	struct input_event ev;
 	memset(&ev, 0, sizeof(ev));
 
@@ -127,19 +166,113 @@ void UInput::send_event(__u16 type, __u16 code, __s32 value) const {
 	ev.code  = code;
 	ev.value = value;
 
-	int ret = write(this->fd, &ev, sizeof(ev));
-	if (ret != sizeof(ev)) {
-		throw std::runtime_error("Failed to send_event");
+	send_events(&ev, 1);
+}
+
+void UInput::send_events(const struct input_event *events, size_t count) {
+	if (sinking) {
+		write_stamped(events, count);
+	} else {
+		ssize_t ret = write(this->fd, events, count * sizeof(*events));
+		if (ret != (ssize_t) (count * sizeof(*events))) {
+			Metrics::instance().inc(Metrics::UINPUT_ERRORS);
+			throw std::runtime_error("Failed to send_event");
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const struct input_event & ev = events[i];
+		if (ev.type != EV_KEY || ev.code > KEY_MAX)
+			continue;
+
+		if (ev.value == EV_KEY_RELEASED) {
+			pressed.reset(ev.code);
+		} else {
+			pressed.set(ev.code);
+			pressedAt[ev.code] = boost::chrono::steady_clock::now();
+		}
 	}
 }
 
-void UInput::sync() const {
+/**
+ * The kernel stamps the events written to uinput, so a sink gets them stamped
+ * with the same clock
+ */
+void UInput::write_stamped(const struct input_event *events, size_t count) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	struct input_event stamped[16];
+	while (count > 0) {
+		size_t n = std::min(count, sizeof(stamped) / sizeof(stamped[0]));
+		for (size_t i = 0; i < n; i++) {
+			stamped[i] = events[i];
+			stamped[i].input_event_sec  = now.tv_sec;
+			stamped[i].input_event_usec = now.tv_nsec / 1000;
+		}
+
+		ssize_t ret = write(this->fd, stamped, n * sizeof(stamped[0]));
+		if (ret != (ssize_t) (n * sizeof(stamped[0]))) {
+			Metrics::instance().inc(Metrics::UINPUT_ERRORS);
+			throw std::runtime_error("Failed to send_event");
+		}
+		events += n;
+		count  -= n;
+	}
+}
+
+void UInput::sync() {
 	send_event(EV_SYN, SYN_REPORT, 0);
 }
 
+size_t UInput::releaseAll() {
+	size_t released = 0;
+	for (size_t code = 0; code <= KEY_MAX && pressed.any(); code++) {
+		if (pressed.test(code)) {
+			LOG4CPLUS_DEBUG(logger, "Releasing " << code);
+			send_event(EV_KEY, code, EV_KEY_RELEASED);
+			released++;
+		}
+	}
+	if (released)
+		sync();
+	return released;
+}
+
+size_t UInput::releaseStuck(boost::chrono::steady_clock::time_point now, boost::chrono::steady_clock::duration maxHold) {
+	size_t released = 0;
+	for (size_t code = 0; code <= KEY_MAX && pressed.any(); code++) {
+		if (pressed.test(code) && now - pressedAt[code] >= maxHold) {
+			LOG4CPLUS_WARN(logger, "Key " << code << " held for too long, releasing it");
+			send_event(EV_KEY, code, EV_KEY_RELEASED);
+			released++;
+		}
+	}
+	if (released)
+		sync();
+	return released;
+}
+
+boost::chrono::steady_clock::time_point UInput::stuckDeadline(boost::chrono::steady_clock::duration maxHold) const {
+	boost::chrono::steady_clock::time_point deadline = boost::chrono::steady_clock::time_point::max();
+	for (size_t code = 0; code <= KEY_MAX && pressed.any(); code++) {
+		if (pressed.test(code) && pressedAt[code] + maxHold < deadline)
+			deadline = pressedAt[code] + maxHold;
+	}
+	return deadline;
+}
+
 
 void UInput::destroy() {
-	ioctl(this->fd, UI_DEV_DESTROY);
+	if (this->fd < 0)
+		return;
+
+	try {
+		releaseAll();
+	} catch (...) {}
+
+	if (!sinking)
+		ioctl(this->fd, UI_DEV_DESTROY);
 	close(this->fd);
 
 	this->fd = -1;
@@ -1,30 +1,88 @@
 #include <linux/input.h>
 
+#include <bitset>
 #include <vector>
 #include <list>
+#include <string>
+
+#include <boost/chrono.hpp>
 
 #define EV_KEY_RELEASED 0
 #define EV_KEY_PRESSED  1
 #define EV_KEY_REPEAT   2
 
+// input_event timestamps, as named since Linux 4.16
+#ifndef input_event_sec
+#define input_event_sec  time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
 class UInput {
 private:
-	int fd; // Handle for uinput file ops
+	int fd; // Handle for uinput file ops, -1 until the device is created
+	bool sinking; // fd is a plain file rather than uinput
+	bool pointer; // the device has the pointer axes and button
+
+	std::string name;
+	std::vector< std::list<__u16> > keys;
+
+	static int sink;
 
 	int open(const char *uinput_path);
 	void openAll();
-	void setup(const char *dev_name, const std::vector< std::list<__u16> > & keys);
+	void setup();
 	void create();
+	void write_stamped(const struct input_event *events, size_t count);
 
 	void destroy();
 
+	// Keys we have pressed on the device, and when they were last pressed or repeated
+	std::bitset<KEY_MAX + 1> pressed;
+	boost::chrono::steady_clock::time_point pressedAt[KEY_MAX + 1];
+
 	// TODO Add something like
 	// onUInputEvent(
 
 public:
+	/**
+	 * The device is only created by setPointer()
+	 */
 	UInput(const char *dev_name, const std::vector< std::list<__u16> > & keys);
 	virtual ~UInput();
 
-	void send_event(__u16 type, __u16 code, __s32 value) const;
-	void sync() const;
+	/**
+	 * Creates the device, or creates it again when it should gain or lose
+	 * the relative axes and the left button pointer mode needs. Without them
+	 * udev doesn't take the device for a mouse.
+	 */
+	void setPointer(bool pointer);
+
+	/**
+	 * Devices created from now on write their events, timestamped, to fd
+	 * instead of creating a uinput device
+	 */
+	static void setSink(int fd) { sink = fd; };
+
+	void send_event(__u16 type, __u16 code, __s32 value);
+
+	/**
+	 * Writes several events at once
+	 */
+	void send_events(const struct input_event *events, size_t count);
+	void sync();
+
+	/**
+	 * Releases every key still held down, returns how many were
+	 */
+	size_t releaseAll();
+
+	/**
+	 * Releases the keys that haven't been pressed or repeated for maxHold
+	 */
+	size_t releaseStuck(boost::chrono::steady_clock::time_point now, boost::chrono::steady_clock::duration maxHold);
+
+	/**
+	 * When releaseStuck() will next have something to do, time_point::max() if nothing is held
+	 */
+	boost::chrono::steady_clock::time_point stuckDeadline(boost::chrono::steady_clock::duration maxHold) const;
 };
@@ -0,0 +1,187 @@
+/**
+ * vendor.cpp
+ *
+ * Vendor specific remote control decoders. Each file describes one vendor:
+ *
+ *   vendor 0xXXXXXX [name]
+ *   button XX[:XX..] = CEC_KEY
+ *   command XX[:XX..] = CEC_KEY
+ *   command-id XX[:XX..] = CEC_KEY
+ *
+ * "button" matches VENDOR_REMOTE_BUTTON_DOWN parameters, "command" matches
+ * VENDOR_COMMAND parameters and "command-id" VENDOR_COMMAND_WITH_ID parameters
+ * following the vendor ID. The payload is matched as a prefix, bytes are hexadecimal.
+ */
+#include "vendor.h"
+#include "libcec.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::map;
+using std::string;
+using std::vector;
+
+static Logger logger = Logger::getInstance("vendor");
+
+static bool parseKey(const string & s, cec_user_control_code & key) {
+	for (map<cec_user_control_code, const char *>::const_iterator it = Cec::cecUserControlCodeName.begin();
+			it != Cec::cecUserControlCodeName.end(); ++it) {
+		if (s == it->second && it->first != CEC_USER_CONTROL_CODE_UNKNOWN) {
+			key = it->first;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parsePayload(const string & s, vector<uint8_t> & payload) {
+	std::istringstream ss(s);
+	string item;
+
+	while (std::getline(ss, item, ':')) {
+		char *end;
+		long v = strtol(item.c_str(), &end, 16);
+		if (item.empty() || item.size() > 2 || *end != '\0' || v < 0)
+			return false;
+		payload.push_back((uint8_t) v);
+	}
+	return !payload.empty();
+}
+
+bool VendorDecoders::load(const string & path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+		return loadFile(path);
+
+	DIR *dir = opendir(path.c_str());
+	if (!dir) {
+		LOG4CPLUS_ERROR(logger, "Failed to open vendor decoder directory: " << path);
+		return false;
+	}
+
+	vector<string> files;
+	while (struct dirent *entry = readdir(dir)) {
+		string name = entry->d_name;
+		if (name.size() > 5 && name.compare(name.size() - 5, 5, ".conf") == 0)
+			files.push_back(path + "/" + name);
+	}
+	closedir(dir);
+
+	std::sort(files.begin(), files.end());
+
+	bool ok = !files.empty();
+	for (vector<string>::const_iterator file = files.begin(); file != files.end(); ++file)
+		ok &= loadFile(*file);
+	return ok;
+}
+
+bool VendorDecoders::loadFile(const string & filename) {
+	std::ifstream file(filename.c_str());
+	if (!file.is_open()) {
+		LOG4CPLUS_ERROR(logger, "Failed to open vendor decoder file: " << filename);
+		return false;
+	}
+
+	Decoder *decoder = NULL;
+	uint32_t vendor = 0;
+	int lineNumber = 0;
+	int entries = 0;
+	int failed = 0;
+	string line;
+
+	while (std::getline(file, line)) {
+		lineNumber++;
+
+		// Trim whitespace, skip empty lines and comments
+		line.erase(0, line.find_first_not_of(" \t"));
+		line.erase(line.find_last_not_of(" \t\r") + 1);
+		if (line.empty() || line[0] == '#')
+			continue;
+
+		std::istringstream ss(line);
+		string type, payload, equals, key;
+		ss >> type;
+
+		if (type == "vendor") {
+			string id;
+			ss >> id;
+			char *end;
+			vendor = (uint32_t) strtoul(id.c_str(), &end, 16);
+			if (id.empty() || *end != '\0' || vendor == 0 || vendor > 0xFFFFFF) {
+				LOG4CPLUS_WARN(logger, "Invalid vendor ID on line " << lineNumber << " in " << filename << ": " << line);
+				decoder = NULL;
+				failed++;
+				continue;
+			}
+			decoder = &decoders[vendor];
+			std::getline(ss >> std::ws, decoder->name);
+			continue;
+		}
+
+		Kind kind;
+		if (type == "button")
+			kind = KIND_BUTTON;
+		else if (type == "command")
+			kind = KIND_COMMAND;
+		else if (type == "command-id")
+			kind = KIND_COMMAND_WITH_ID;
+		else {
+			LOG4CPLUS_WARN(logger, "Invalid line " << lineNumber << " in " << filename << ": " << line);
+			failed++;
+			continue;
+		}
+
+		if (!decoder) {
+			LOG4CPLUS_WARN(logger, "No vendor given before line " << lineNumber << " in " << filename);
+			failed++;
+			continue;
+		}
+
+		Entry entry;
+		ss >> payload >> equals >> key;
+		if (!parsePayload(payload, entry.payload) || equals != "=" || !parseKey(key, entry.key)) {
+			LOG4CPLUS_WARN(logger, "Invalid line " << lineNumber << " in " << filename << ": " << line);
+			failed++;
+			continue;
+		}
+
+		vector<Entry> & bucket = decoder->table[kind][entry.payload[0]];
+		bucket.push_back(entry);
+		std::stable_sort(bucket.begin(), bucket.end(),
+			[](const Entry & a, const Entry & b) { return a.payload.size() > b.payload.size(); });
+		entries++;
+	}
+
+	LOG4CPLUS_INFO(logger, "Loaded " << entries << " vendor codes from " << filename);
+	if (failed)
+		LOG4CPLUS_ERROR(logger, failed << " invalid lines in " << filename);
+
+	// A file with mistakes in it is not half used on reload
+	return entries > 0 && failed == 0;
+}
+
+cec_user_control_code VendorDecoders::decode(uint32_t vendor, Kind kind, const uint8_t *payload, size_t size) const {
+	map<uint32_t, Decoder>::const_iterator decoder = decoders.find(vendor);
+	if (decoder == decoders.end() || size == 0)
+		return CEC_USER_CONTROL_CODE_UNKNOWN;
+
+	const vector<Entry> & bucket = decoder->second.table[kind][payload[0]];
+	for (vector<Entry>::const_iterator entry = bucket.begin(); entry != bucket.end(); ++entry) {
+		if (entry->payload.size() <= size && memcmp(&entry->payload[0], payload, entry->payload.size()) == 0)
+			return entry->key;
+	}
+	return CEC_USER_CONTROL_CODE_UNKNOWN;
+}
@@ -0,0 +1,57 @@
+#include <libcec/cectypes.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Decoders for vendor specific remote control frames, keyed by vendor ID and
+ * loaded from data files, which turn the frames into ordinary user control codes
+ */
+class VendorDecoders {
+
+	public:
+
+		enum Kind
+		{
+			KIND_BUTTON,          // VENDOR_REMOTE_BUTTON_DOWN parameters
+			KIND_COMMAND,         // VENDOR_COMMAND parameters
+			KIND_COMMAND_WITH_ID, // VENDOR_COMMAND_WITH_ID parameters after the vendor ID
+			KIND_MAX,
+		};
+
+		/**
+		 * Loads a decoder file, or every *.conf file in a directory. False when
+		 * one can't be read or any of their lines is invalid.
+		 */
+		bool load(const std::string & path);
+
+		bool empty() const { return decoders.empty(); };
+		bool handles(uint32_t vendor) const { return decoders.count(vendor) != 0; };
+
+		/**
+		 * Looks up the key a vendor payload stands for, CEC_USER_CONTROL_CODE_UNKNOWN if none
+		 */
+		CEC::cec_user_control_code decode(uint32_t vendor, Kind kind, const uint8_t *payload, size_t size) const;
+
+	private:
+
+		struct Entry
+		{
+			std::vector<uint8_t> payload;
+			CEC::cec_user_control_code key;
+		};
+
+		struct Decoder
+		{
+			std::string name;
+			// Indexed by the first payload byte, longest payloads first
+			std::vector<Entry> table[KIND_MAX][256];
+		};
+
+		std::map<uint32_t, Decoder> decoders;
+
+		bool loadFile(const std::string & filename);
+};
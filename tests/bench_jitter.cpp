@@ -0,0 +1,176 @@
+/**
+ * bench_jitter.cpp
+ *
+ * Measures how late a dispatch thread wakes up for a key while every CPU is
+ * kept busy, with and without the real-time mode. A producer thread, standing
+ * in for libcec's, hands over a timestamp every interval the way the key
+ * callback does; the dispatch thread, set up with RealTime like Main::loop,
+ * wakes on the condition variable and writes an event like uinput does.
+ *
+ *   tests/bench_jitter                          normal priority
+ *   tests/bench_jitter --realtime 50 --cpu 1    SCHED_FIFO, pinned
+ *
+ * Prints the wake-up latency percentiles. Not part of make check, the numbers
+ * depend on the machine.
+ */
+#include "realtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <boost/chrono.hpp>
+#include <boost/program_options.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+namespace po = boost::program_options;
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+typedef boost::chrono::steady_clock clock_type;
+
+static std::atomic<bool> stopping(false);
+
+/**
+ * Synthetic load: integer work over a buffer bigger than the caches
+ */
+static void load() {
+	vector<unsigned> buffer(4 << 20);
+	unsigned x = 1;
+	for (size_t i = 0; !stopping.load(std::memory_order_relaxed); i = (i + 4099) % buffer.size()) {
+		x = x * 1103515245 + 12345;
+		buffer[i] += x;
+	}
+}
+
+int main(int argc, char *argv[]) {
+	po::options_description desc("Allowed options");
+	desc.add_options()
+	    ("help,h",   "show help message")
+	    ("samples",  po::value<int>()->default_value(5000), "keys to time")
+	    ("interval", po::value<int>()->default_value(2000), "microseconds between keys")
+	    ("load",     po::value<int>()->default_value(boost::thread::hardware_concurrency()), "busy threads")
+	    ("realtime", po::value<int>(), "dispatch at this real-time priority")
+	    ("realtime-policy", po::value<string>()->default_value("fifo"), "real-time scheduling policy")
+	    ("cpu",      po::value<int>(), "pin dispatching to this CPU");
+
+	po::variables_map vm;
+	try {
+		po::store(po::parse_command_line(argc, argv, desc), vm);
+		po::notify(vm);
+	} catch (po::error & e) {
+		cerr << argv[0] << ": " << e.what() << endl;
+		return 1;
+	}
+	if (vm.count("help")) {
+		cout << desc << endl;
+		return 0;
+	}
+
+	int samples = vm["samples"].as<int>();
+	boost::chrono::microseconds interval(vm["interval"].as<int>());
+
+	RealTime realtime;
+	try {
+		realtime.setPolicy(vm["realtime-policy"].as<string>());
+		if (vm.count("realtime"))
+			realtime.setPriority(vm["realtime"].as<int>());
+		if (vm.count("cpu"))
+			realtime.setCpu(vm["cpu"].as<int>());
+	} catch (std::exception & e) {
+		cerr << argv[0] << ": " << e.what() << endl;
+		return 1;
+	}
+
+	vector<boost::thread> loaders;
+	for (int i = 0; i < vm["load"].as<int>(); i++)
+		loaders.push_back(boost::thread(load));
+
+	// Handed over from the producer to the dispatch thread, like a key
+	boost::mutex lock;
+	boost::condition_variable cond;
+	clock_type::time_point posted;
+	bool pending = false;
+	bool done = false;
+
+	vector<double> latencies;
+	latencies.reserve(samples);
+
+	boost::thread dispatcher([&]() {
+		realtime.apply();
+
+		int sink = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		char event[24] = {};
+
+		boost::unique_lock<boost::mutex> guard(lock);
+		for (;;) {
+			while (!pending && !done)
+				cond.wait(guard);
+			if (done)
+				break;
+
+			clock_type::time_point woke = clock_type::now();
+			latencies.push_back(boost::chrono::duration<double, boost::micro>(woke - posted).count());
+			pending = false;
+
+			guard.unlock();
+			if (write(sink, event, sizeof(event)) < 0)
+				perror("write");
+			guard.lock();
+		}
+		close(sink);
+	});
+
+	clock_type::time_point next = clock_type::now();
+	for (int i = 0; i < samples; i++) {
+		next += interval;
+		boost::this_thread::sleep_until(next);
+
+		// A key that comes in before the previous one was taken replaces it
+		boost::lock_guard<boost::mutex> guard(lock);
+		posted  = clock_type::now();
+		pending = true;
+		cond.notify_one();
+	}
+	{
+		boost::lock_guard<boost::mutex> guard(lock);
+		done = true;
+		cond.notify_one();
+	}
+	dispatcher.join();
+
+	stopping = true;
+	for (size_t i = 0; i < loaders.size(); i++)
+		loaders[i].join();
+
+	if (latencies.empty()) {
+		cerr << "No samples" << endl;
+		return 1;
+	}
+	std::sort(latencies.begin(), latencies.end());
+	double total = 0;
+	for (size_t i = 0; i < latencies.size(); i++)
+		total += latencies[i];
+
+	cout << latencies.size() << " keys, " << loaders.size() << " busy threads, "
+	     << (realtime.enabled() ? "real-time" : "normal priority") << endl;
+	cout << "wake-up latency (us): min " << latencies.front()
+	     << ", mean " << total / latencies.size()
+	     << ", p50 " << latencies[latencies.size() / 2]
+	     << ", p99 " << latencies[latencies.size() * 99 / 100]
+	     << ", p99.9 " << latencies[latencies.size() * 999 / 1000]
+	     << ", max " << latencies.back() << endl;
+	return 0;
+}
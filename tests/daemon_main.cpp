@@ -0,0 +1,8 @@
+/**
+ * daemon_main.cpp
+ *
+ * The daemon with its main() renamed to daemonMain(), for tests that run it
+ * on a thread of their own.
+ */
+#define main daemonMain
+#include "main.cpp"
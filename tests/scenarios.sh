@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# scenarios.sh
+#
+# Runs the daemon on the simulated bus for each scenario in scenarios/, with
+# the options its "# Run with:" line gives, and fails if any of them does.
+# Run by make check, or by hand from the source directory after a build.
+
+srcdir=${srcdir:-.}
+daemon=${DAEMON:-$(pwd)/libcec-daemon}
+
+if [ ! -x "$daemon" ]; then
+	echo "FAIL: no daemon at $daemon" >&2
+	exit 1
+fi
+
+# The options in the scenarios are relative to the source directory
+cd "$srcdir" || exit 1
+
+failures=0
+for scenario in scenarios/*.conf; do
+	args=$(sed -n 's/^# Run with: libcec-daemon //p' "$scenario" | head -n 1)
+	if [ -z "$args" ]; then
+		args="--simulate $scenario"
+	fi
+
+	log=$(timeout 300 "$daemon" $args 2>&1)
+	status=$?
+	if [ $status -ne 0 ]; then
+		echo "$log" >&2
+		echo "FAIL: $scenario exited with $status" >&2
+		failures=$((failures + 1))
+	else
+		echo "PASS: $scenario"
+	fi
+done
+
+[ $failures -eq 0 ]
@@ -0,0 +1,256 @@
+/**
+ * test_allocations.cpp
+ *
+ * Replays a trace of key presses, repeats and releases through the path they
+ * take from libcec: the keyPress callback, the dispatch queue and uinput, with
+ * the daemon running on a simulated bus. malloc and operator new are replaced
+ * by counting versions, and once the trace has been replayed to warm up, the
+ * callback and dispatch threads must not allocate at all.
+ */
+#include "main.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <string>
+
+#include <unistd.h>
+
+#include <boost/thread/thread.hpp>
+
+using namespace CEC;
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+int daemonMain(int argc, char *argv[]);
+
+// glibc's own allocator, under the names it exports for this
+extern "C" {
+	void *__libc_malloc(size_t size);
+	void *__libc_calloc(size_t count, size_t size);
+	void *__libc_realloc(void *ptr, size_t size);
+	void *__libc_memalign(size_t alignment, size_t size);
+	void  __libc_free(void *ptr);
+}
+
+static std::atomic<bool> armed(false);
+static __thread bool watched = false;  // set on the callback and dispatch threads
+static std::atomic<unsigned> allocations(0);
+static std::atomic<size_t> firstSize(0);
+
+static inline void counted(size_t size) {
+	if (armed.load(std::memory_order_relaxed) && watched) {
+		if (allocations.fetch_add(1) == 0)
+			firstSize = size;
+	}
+}
+
+extern "C" {
+
+void *malloc(size_t size) {
+	counted(size);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+	counted(count * size);
+	return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	counted(size);
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+	counted(size);
+	*ptr = __libc_memalign(alignment, size);
+	return *ptr ? 0 : ENOMEM;
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+	counted(size);
+	return __libc_memalign(alignment, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+}
+
+void *operator new(size_t size) {
+	counted(size);
+	void *ptr = __libc_malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void *operator new[](size_t size) {
+	return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+	counted(size);
+	return __libc_malloc(size ? size : 1);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+	return operator new(size, std::nothrow);
+}
+
+void operator delete(void *ptr) noexcept {
+	__libc_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	__libc_free(ptr);
+}
+
+// What libcec calls, see libcec.cpp
+void cecKeyPress(void *cbParam, const cec_keypress *key);
+
+struct TraceKey
+{
+	cec_user_control_code key;
+	int repeats;
+};
+
+// Short presses, held keys that repeat, keys mapped to several uinput keys
+static const TraceKey trace[] = {
+	{ CEC_USER_CONTROL_CODE_SELECT,       0 },
+	{ CEC_USER_CONTROL_CODE_UP,           3 },
+	{ CEC_USER_CONTROL_CODE_DOWN,         0 },
+	{ CEC_USER_CONTROL_CODE_LEFT,         2 },
+	{ CEC_USER_CONTROL_CODE_RIGHT,        0 },
+	{ CEC_USER_CONTROL_CODE_NUMBER1,      0 },
+	{ CEC_USER_CONTROL_CODE_EXIT,         0 },
+	{ CEC_USER_CONTROL_CODE_PLAY,         0 },
+	{ CEC_USER_CONTROL_CODE_VOLUME_UP,    4 },
+	{ CEC_USER_CONTROL_CODE_CHANNEL_DOWN, 1 },
+};
+
+static void sleepMs(long ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+/**
+ * The keys the dispatch thread handled, from the status page
+ */
+static unsigned keysHandled(const cec_daemon_status *page) {
+	cec_daemon_status status;
+	return cec_daemon_status_read(page, &status) == 0 ? status.keys : 0;
+}
+
+/**
+ * Calls the keyPress callback as libcec does, returns the presses and repeats sent
+ */
+static unsigned replay(CecCallback *callback) {
+	unsigned pressed = 0;
+
+	for (size_t i = 0; i < sizeof(trace) / sizeof(trace[0]); i++) {
+		cec_keypress key;
+		key.keycode  = trace[i].key;
+		key.duration = 0;
+		for (int r = 0; r <= trace[i].repeats; r++) {
+			cecKeyPress(callback, &key);
+			pressed++;
+			sleepMs(r < trace[i].repeats ? 100 : 50);
+		}
+
+		key.duration = 50 + 100 * trace[i].repeats;
+		cecKeyPress(callback, &key);
+		sleepMs(30);
+	}
+	return pressed;
+}
+
+static bool waitForKeys(const cec_daemon_status *page, unsigned keys) {
+	for (int i = 0; i < 500 && keysHandled(page) < keys; i++)
+		sleepMs(10);
+	return keysHandled(page) >= keys;
+}
+
+int main() {
+	char dir[] = "/tmp/test_allocations.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string scenario = string(dir) + "/idle.conf";
+	string status   = string(dir) + "/status";
+
+	// The bus only needs to stay up, the keys come from the trace
+	std::ofstream(scenario.c_str()) << "wait 60000\n";
+
+	boost::thread dispatcher([&]() {
+		const char *argv[] = { "libcec-daemon", "--simulate", scenario.c_str(), "--status-page", status.c_str(), NULL };
+		watched = true;
+		daemonMain(5, (char **) argv);
+	});
+
+	const cec_daemon_status *page = NULL;
+	for (int i = 0; i < 500; i++) {
+		cec_daemon_status state;
+		if (!page)
+			page = cec_daemon_status_map(status.c_str());
+		if (page && cec_daemon_status_read(page, &state) == 0 && state.state == CEC_DAEMON_STATUS_OPEN)
+			break;
+		sleepMs(10);
+	}
+
+	int failures = 0;
+	if (!page) {
+		cerr << "FAIL: the daemon didn't start" << endl;
+		failures++;
+	} else {
+		CecCallback *callback = &Main::instance();
+		watched = true;
+
+		// Warm up: first key, first repeat, first release of each
+		unsigned keys = replay(callback);
+		if (!waitForKeys(page, keys)) {
+			cerr << "FAIL: the daemon handled " << keysHandled(page) << " of " << keys << " keys while warming up" << endl;
+			failures++;
+		}
+
+		armed = true;
+		for (int round = 0; round < 3; round++)
+			keys += replay(callback);
+		bool handled = waitForKeys(page, keys);
+		sleepMs(200);
+		armed = false;
+		watched = false;
+
+		if (!handled) {
+			cerr << "FAIL: the daemon handled " << keysHandled(page) << " of " << keys << " keys" << endl;
+			failures++;
+		}
+		if (allocations) {
+			cerr << "FAIL: " << allocations << " allocations on the key path after warming up, the first of "
+			     << firstSize << " bytes" << endl;
+			failures++;
+		}
+
+		cec_daemon_status_unmap(page);
+	}
+
+	Main::instance().stop();
+	dispatcher.join();
+
+	unlink(scenario.c_str());
+	unlink(status.c_str());
+	rmdir(dir);
+
+	return failures ? 1 : 0;
+}
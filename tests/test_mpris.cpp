@@ -0,0 +1,343 @@
+/**
+ * test_mpris.cpp
+ *
+ * Runs MprisBridge against a private dbus-daemon, with fake players on the
+ * bus: players found at startup and when they appear, calls going to the
+ * player that plays, and the connection made again once the bus came back.
+ * Skipped when dbus-daemon, or $DBUS_DAEMON, can't be started.
+ */
+#include "mpris.h"
+
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <boost/thread/lock_guard.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <dbus/dbus.h>
+
+using namespace CEC;
+
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+static int failures = 0;
+
+static void check(bool ok, const string & what) {
+	if (!ok) {
+		cerr << "FAIL: " << what << endl;
+		failures++;
+	}
+}
+
+static void sleepMs(long ms) {
+	struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+		;
+}
+
+static bool waitFor(std::function<bool()> done, long ms = 5000) {
+	for (long waited = 0; !done() && waited < ms; waited += 10)
+		sleepMs(10);
+	return done();
+}
+
+/**
+ * A bus of our own, listening on dir/bus
+ */
+class Bus {
+
+	public:
+
+		Bus(const string & dir) : dir(dir), pid(-1) {
+			config = dir + "/bus.conf";
+			std::ofstream(config.c_str())
+				<< "<!DOCTYPE busconfig PUBLIC \"-//freedesktop//DTD D-Bus Bus Configuration 1.0//EN\"\n"
+				<< " \"http://www.freedesktop.org/standards/dbus/1.0/busconfig.dtd\">\n"
+				<< "<busconfig>\n"
+				<< "  <type>session</type>\n"
+				<< "  <listen>unix:path=" << dir << "/bus</listen>\n"
+				<< "  <auth>EXTERNAL</auth>\n"
+				<< "  <policy context=\"default\">\n"
+				<< "    <allow send_destination=\"*\"/>\n"
+				<< "    <allow receive_sender=\"*\"/>\n"
+				<< "    <allow own=\"*\"/>\n"
+				<< "  </policy>\n"
+				<< "</busconfig>\n";
+		};
+
+		~Bus() {
+			stop();
+			unlink((dir + "/bus").c_str());
+			unlink(config.c_str());
+		};
+
+		string address() const { return "unix:path=" + dir + "/bus"; };
+
+		bool start() {
+			string socket = dir + "/bus";
+			unlink(socket.c_str());
+
+			const char *daemon = getenv("DBUS_DAEMON") ? getenv("DBUS_DAEMON") : "dbus-daemon";
+			string option = "--config-file=" + config;
+			pid = fork();
+			if (pid == 0) {
+				execlp(daemon, daemon, option.c_str(), "--nofork", (char *) NULL);
+				_exit(127);
+			}
+
+			struct stat st;
+			for (int i = 0; i < 500 && stat(socket.c_str(), &st) < 0; i++) {
+				if (waitpid(pid, NULL, WNOHANG) == pid) {
+					pid = -1;
+					return false;
+				}
+				sleepMs(10);
+			}
+			return stat(socket.c_str(), &st) == 0;
+		};
+
+		void stop() {
+			if (pid < 0)
+				return;
+			kill(pid, SIGTERM);
+			waitpid(pid, NULL, 0);
+			pid = -1;
+		};
+
+	private:
+
+		string dir;
+		string config;
+		pid_t pid;
+};
+
+/**
+ * An MPRIS player on the bus, remembering the methods called on it
+ */
+class FakePlayer {
+
+	public:
+
+		FakePlayer() : connection(NULL), stopping(false) {};
+
+		~FakePlayer() {
+			close();
+		};
+
+		bool open(const string & address, const string & name, const string & status) {
+			this->status = status;
+
+			DBusError error;
+			dbus_error_init(&error);
+			connection = dbus_connection_open_private(address.c_str(), &error);
+			if (connection == NULL || !dbus_bus_register(connection, &error)) {
+				cerr << "Failed to connect " << name << ": " << (dbus_error_is_set(&error) ? error.message : "unknown error") << endl;
+				dbus_error_free(&error);
+				return false;
+			}
+			dbus_connection_set_exit_on_disconnect(connection, FALSE);
+
+			DBusObjectPathVTable vtable;
+			memset(&vtable, 0, sizeof(vtable));
+			vtable.message_function = &FakePlayer::handle;
+			dbus_connection_register_object_path(connection, "/org/mpris/MediaPlayer2", &vtable, this);
+			if (dbus_bus_request_name(connection, name.c_str(), DBUS_NAME_FLAG_DO_NOT_QUEUE, &error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+				cerr << "Failed to own " << name << endl;
+				dbus_error_free(&error);
+				return false;
+			}
+
+			stopping = false;
+			thread = boost::thread([this]() {
+				while (!stopping && dbus_connection_read_write_dispatch(connection, 20))
+					;
+			});
+			return true;
+		};
+
+		/**
+		 * Leaving the bus, the name goes with the connection
+		 */
+		void close() {
+			if (connection == NULL)
+				return;
+			stopping = true;
+			thread.join();
+			dbus_connection_close(connection);
+			dbus_connection_unref(connection);
+			connection = NULL;
+		};
+
+		/**
+		 * Changes PlaybackStatus, and says so on the bus as a player does
+		 */
+		void setStatus(const string & status) {
+			{
+				boost::lock_guard<boost::mutex> guard(lock);
+				this->status = status;
+			}
+
+			DBusMessage *signal = dbus_message_new_signal("/org/mpris/MediaPlayer2", "org.freedesktop.DBus.Properties", "PropertiesChanged");
+			DBusMessageIter it, changed, entry, variant, invalidated;
+			const char *iface = "org.mpris.MediaPlayer2.Player";
+			const char *property = "PlaybackStatus";
+			const char *value = status.c_str();
+
+			dbus_message_iter_init_append(signal, &it);
+			dbus_message_iter_append_basic(&it, DBUS_TYPE_STRING, &iface);
+			dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "{sv}", &changed);
+			dbus_message_iter_open_container(&changed, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+			dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &property);
+			dbus_message_iter_open_container(&entry, DBUS_TYPE_VARIANT, "s", &variant);
+			dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &value);
+			dbus_message_iter_close_container(&entry, &variant);
+			dbus_message_iter_close_container(&changed, &entry);
+			dbus_message_iter_close_container(&it, &changed);
+			dbus_message_iter_open_container(&it, DBUS_TYPE_ARRAY, "s", &invalidated);
+			dbus_message_iter_close_container(&it, &invalidated);
+
+			dbus_connection_send(connection, signal, NULL);
+			dbus_connection_flush(connection);
+			dbus_message_unref(signal);
+		};
+
+		bool called(const string & method) {
+			boost::lock_guard<boost::mutex> guard(lock);
+			for (size_t i = 0; i < calls.size(); i++) {
+				if (calls[i] == method)
+					return true;
+			}
+			return false;
+		};
+
+	private:
+
+		DBusConnection *connection;
+		boost::thread thread;
+		std::atomic<bool> stopping;
+
+		boost::mutex lock;
+		string status;
+		vector<string> calls;
+
+		static DBusHandlerResult handle(DBusConnection *connection, DBusMessage *message, void *data) {
+			FakePlayer *player = static_cast<FakePlayer *>(data);
+			if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL)
+				return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+			DBusMessage *reply = dbus_message_new_method_return(message);
+			boost::lock_guard<boost::mutex> guard(player->lock);
+			player->calls.push_back(dbus_message_get_member(message));
+
+			if (dbus_message_is_method_call(message, "org.freedesktop.DBus.Properties", "Get")) {
+				DBusMessageIter it, variant;
+				const char *value = player->status.c_str();
+				dbus_message_iter_init_append(reply, &it);
+				dbus_message_iter_open_container(&it, DBUS_TYPE_VARIANT, "s", &variant);
+				dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &value);
+				dbus_message_iter_close_container(&it, &variant);
+			}
+
+			dbus_connection_send(connection, reply, NULL);
+			dbus_message_unref(reply);
+			return DBUS_HANDLER_RESULT_HANDLED;
+		};
+};
+
+int main() {
+	dbus_threads_init_default();
+
+	char dir[] = "/tmp/test_mpris.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+
+	int result;
+	{
+		Bus bus(dir);
+		if (!bus.start()) {
+			cerr << "SKIP: dbus-daemon didn't start" << endl;
+			rmdir(dir);
+			return 77;
+		}
+
+		// A player there before us, found by listing the names
+		FakePlayer first;
+		check(first.open(bus.address(), "org.mpris.MediaPlayer2.first", "Stopped"), "first player on the bus");
+
+		MprisBridge bridge;
+		check(!bridge.handles(CEC_USER_CONTROL_CODE_PLAY), "nothing handled before starting");
+		bridge.start(bus.address());
+
+		check(waitFor([&]() { return bridge.handles(CEC_USER_CONTROL_CODE_PLAY); }), "player already on the bus found");
+		check(!bridge.handles(CEC_USER_CONTROL_CODE_UP), "only media keys handled");
+		bridge.post(CEC_USER_CONTROL_CODE_PLAY);
+		check(waitFor([&]() { return first.called("Play"); }), "Play called on the only player");
+
+		// A player appearing later, asked for its PlaybackStatus once found
+		FakePlayer second;
+		check(second.open(bus.address(), "org.mpris.MediaPlayer2.second", "Paused"), "second player on the bus");
+		check(waitFor([&]() { return second.called("Get"); }), "appearing player found");
+		bridge.post(CEC_USER_CONTROL_CODE_PAUSE);
+		check(waitFor([&]() { return second.called("Pause"); }), "Pause called on the player found last");
+
+		// The one that plays wins over the one heard from last
+		first.setStatus("Playing");
+		second.setStatus("Paused");
+		sleepMs(200);
+		bridge.post(CEC_USER_CONTROL_CODE_STOP);
+		check(waitFor([&]() { return first.called("Stop"); }), "Stop called on the playing player");
+
+		second.setStatus("Playing");
+		first.setStatus("Paused");
+		sleepMs(200);
+		bridge.post(CEC_USER_CONTROL_CODE_FORWARD);
+		check(waitFor([&]() { return second.called("Next"); }), "Next called on the player that started playing");
+
+		// Gone from the bus, the other one is left
+		second.close();
+		sleepMs(200);
+		bridge.post(CEC_USER_CONTROL_CODE_BACKWARD);
+		check(waitFor([&]() { return first.called("Previous"); }), "Previous called on the player left");
+
+		// The bus goes away: players are forgotten, and connecting again
+		// backs off until the bus is back
+		bus.stop();
+		first.close();
+		check(waitFor([&]() { return !bridge.handles(CEC_USER_CONTROL_CODE_PLAY); }), "players forgotten with the connection");
+		sleepMs(1500);
+		check(bus.start(), "bus started again");
+
+		FakePlayer again;
+		check(again.open(bus.address(), "org.mpris.MediaPlayer2.first", "Playing"), "player back on the bus");
+		check(waitFor([&]() { return bridge.handles(CEC_USER_CONTROL_CODE_PLAY); }, 35000), "connected again once the bus is back");
+		bridge.post(CEC_USER_CONTROL_CODE_PLAY);
+		check(waitFor([&]() { return again.called("Play"); }), "Play called after connecting again");
+
+		bridge.stop();
+		again.close();
+		result = failures ? 1 : 0;
+	}
+
+	rmdir(dir);
+	return result;
+}
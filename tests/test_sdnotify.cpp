@@ -0,0 +1,126 @@
+/**
+ * test_sdnotify.cpp
+ *
+ * Checks what SdNotify sends by standing in for systemd on a local socket.
+ */
+#include "sdnotify.h"
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+static int failures = 0;
+
+static void check(bool ok, const string & what) {
+	if (!ok) {
+		cerr << "FAIL: " << what << endl;
+		failures++;
+	}
+}
+
+/**
+ * A datagram socket bound to path, as systemd's notify socket is
+ */
+static int bindSocket(const string & path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+
+	int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *) &addr, offsetof(struct sockaddr_un, sun_path) + path.size()) < 0) {
+		perror("bind");
+		exit(1);
+	}
+
+	struct timeval timeout = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	return fd;
+}
+
+static string receive(int fd) {
+	char buf[256];
+	ssize_t len = recv(fd, buf, sizeof(buf), 0);
+	return len < 0 ? string("<nothing>") : string(buf, len);
+}
+
+int main() {
+	char dir[] = "/tmp/test_sdnotify.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string path = string(dir) + "/notify";
+	string abstract = string("@test_sdnotify.") + std::to_string(getpid());
+
+	// A socket path, and a watchdog for us
+	{
+		int fd = bindSocket(path);
+		setenv("NOTIFY_SOCKET", path.c_str(), 1);
+		setenv("WATCHDOG_USEC", "2000000", 1);
+		setenv("WATCHDOG_PID", std::to_string(getpid()).c_str(), 1);
+
+		SdNotify notify;
+		check(notify.enabled(), "enabled with NOTIFY_SOCKET set");
+		check(notify.watchdogInterval() == boost::chrono::seconds(1), "keepalives at half of WATCHDOG_USEC");
+		check(!getenv("NOTIFY_SOCKET") && !getenv("WATCHDOG_USEC") && !getenv("WATCHDOG_PID"), "environment cleared for the hooks");
+
+		check(notify.status("Opening") && receive(fd) == "STATUS=Opening", "STATUS=");
+		check(notify.ready() && receive(fd) == "READY=1", "READY=1");
+		check(notify.watchdog() && receive(fd) == "WATCHDOG=1", "WATCHDOG=1");
+		check(notify.reloading() && receive(fd) == "RELOADING=1", "RELOADING=1");
+		check(notify.stopping() && receive(fd) == "STOPPING=1", "STOPPING=1");
+
+		close(fd);
+	}
+
+	// An abstract socket, and a watchdog meant for another process
+	{
+		int fd = bindSocket(abstract);
+		setenv("NOTIFY_SOCKET", abstract.c_str(), 1);
+		setenv("WATCHDOG_USEC", "2000000", 1);
+		setenv("WATCHDOG_PID", "1", 1);
+
+		SdNotify notify;
+		check(notify.watchdogInterval() == boost::chrono::steady_clock::duration::zero(), "no watchdog for another pid");
+		check(notify.ready() && receive(fd) == "READY=1", "READY=1 on an abstract socket");
+
+		close(fd);
+	}
+
+	// Not started by systemd
+	{
+		unsetenv("NOTIFY_SOCKET");
+		setenv("WATCHDOG_USEC", "2000000", 1);
+
+		SdNotify notify;
+		check(!notify.enabled(), "disabled without NOTIFY_SOCKET");
+		check(notify.watchdogInterval() == boost::chrono::steady_clock::duration::zero(), "no watchdog without NOTIFY_SOCKET");
+		check(!notify.ready(), "nothing sent without NOTIFY_SOCKET");
+	}
+
+	// Nobody listening any more
+	{
+		setenv("NOTIFY_SOCKET", path.c_str(), 1);
+		SdNotify notify;
+		unlink(path.c_str());
+		check(!notify.ready(), "failure reported once the socket is gone");
+	}
+
+	rmdir(dir);
+	return failures ? 1 : 0;
+}
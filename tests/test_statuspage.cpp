@@ -0,0 +1,161 @@
+/**
+ * test_statuspage.cpp
+ *
+ * Checks the page StatusPage publishes as a reader sees it through status.h,
+ * and that whatever else is found at its path is replaced rather than
+ * written through.
+ */
+#include "statuspage.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+static int failures = 0;
+
+static void check(bool ok, const string & what) {
+	if (!ok) {
+		cerr << "FAIL: " << what << endl;
+		failures++;
+	}
+}
+
+static bool read(const string & path, cec_daemon_status & status) {
+	const cec_daemon_status *page = cec_daemon_status_map(path.c_str());
+	if (!page)
+		return false;
+	int ret = cec_daemon_status_read(page, &status);
+	cec_daemon_status_unmap(page);
+	return ret == 0;
+}
+
+static string contents(const string & path) {
+	std::ifstream file(path.c_str());
+	return string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+/**
+ * Whether path is now a page of ours, rather than what was there
+ */
+static bool ours(const string & path) {
+	struct stat st;
+	return lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_uid == geteuid()
+		&& st.st_size == CEC_DAEMON_STATUS_FILE_SIZE;
+}
+
+int main() {
+	char dir[] = "/tmp/test_statuspage.XXXXXX";
+	if (!mkdtemp(dir)) {
+		perror("mkdtemp");
+		return 1;
+	}
+	string path   = string(dir) + "/status";
+	string victim = string(dir) + "/victim";
+
+	// A new page, as readers see it before the adapter is open
+	ino_t inode = 0;
+	{
+		StatusPage page;
+		page.open(path);
+
+		cec_daemon_status status;
+		check(read(path, status), "new page readable");
+		check(status.state == CEC_DAEMON_STATUS_CLOSED, "closed at first");
+		check(status.logical_address == 15, "logical address 15 while unknown");
+		check(status.physical_address == 0xFFFF, "physical address 0xFFFF while unknown");
+		check(status.pid == (uint32_t) getpid(), "our pid");
+		check(ours(path), "created as a file of ours");
+
+		status.state  = CEC_DAEMON_STATUS_OPEN;
+		status.active = 1;
+		status.keys   = 3;
+		page.publish(status);
+		check(read(path, status) && status.state == CEC_DAEMON_STATUS_OPEN && status.active && status.keys == 3, "published state read back");
+
+		struct stat st;
+		stat(path.c_str(), &st);
+		inode = st.st_ino;
+	}
+
+	// Left stopped, and taken over by the next daemon in place
+	{
+		cec_daemon_status status;
+		check(read(path, status) && status.state == CEC_DAEMON_STATUS_STOPPED, "stopped once closed");
+
+		StatusPage page;
+		page.open(path);
+		struct stat st;
+		check(stat(path.c_str(), &st) == 0 && st.st_ino == inode, "our own page reused, readers keep their mapping");
+		check(read(path, status) && status.state == CEC_DAEMON_STATUS_CLOSED, "reused page reset");
+	}
+	unlink(path.c_str());
+
+	// A symlink is not followed, its target is left alone
+	{
+		std::ofstream(victim.c_str()) << "victim";
+		if (symlink(victim.c_str(), path.c_str()) < 0)
+			perror("symlink");
+
+		StatusPage page;
+		page.open(path);
+		check(contents(victim) == "victim", "symlink target untouched");
+		check(ours(path), "symlink replaced by a page");
+	}
+	unlink(path.c_str());
+	unlink(victim.c_str());
+
+	// A file somebody else owns could be written under the readers
+	if (geteuid() == 0) {
+		std::ofstream(path.c_str()) << "planted";
+		if (chown(path.c_str(), 65534, 65534) < 0)
+			perror("chown");
+
+		StatusPage page;
+		page.open(path);
+		check(ours(path), "foreign file replaced by a page");
+	}
+	unlink(path.c_str());
+
+	// Neither is a hard link to a file elsewhere
+	{
+		std::ofstream(victim.c_str()) << "victim";
+		if (link(victim.c_str(), path.c_str()) < 0)
+			perror("link");
+
+		StatusPage page;
+		page.open(path);
+		check(contents(victim) == "victim", "hard linked file untouched");
+		check(ours(path), "hard link replaced by a page");
+	}
+	unlink(path.c_str());
+	unlink(victim.c_str());
+
+	// What can't be removed is an error
+	{
+		mkdir(path.c_str(), 0700);
+		bool threw = false;
+		try {
+			StatusPage page;
+			page.open(path);
+		} catch (std::runtime_error & e) {
+			threw = true;
+		}
+		check(threw, "directory in the way reported");
+		rmdir(path.c_str());
+	}
+
+	rmdir(dir);
+	return failures ? 1 : 0;
+}